@@ -92,6 +92,11 @@
 //#define DACCVIOL   (1 << 1)
 //#define IACCVIOL   (1 << 0)
 
+#define MPU_KEYCACHE_RASR (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_INTERNAL_RAM | MPU_REGION_2KB)
+
+// start of the .keycache section, aligned to its size by memmap
+extern uint8_t _keycache;
+
 void mpu_init(void) {
   const uint32_t table[] = {
     // todo only allow exec on code area, not on storage area or system area
@@ -107,8 +112,10 @@ void mpu_init(void) {
 #endif //RAMLOAD
     (0x40000000 | MPU_REGION_Valid | 2), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_PERIPHERIALS | MPU_REGION_512MB | MPU_RW),
     (0x60000000 | MPU_REGION_Valid | 3), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_EXTERNAL_RAM | MPU_REGION_512MB | MPU_No_access),
-    (0x80000000 | MPU_REGION_Valid | 4), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_EXTERNAL_RAM | MPU_REGION_512MB | MPU_No_access),
-    (0xA0000000 | MPU_REGION_Valid | 5), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_PERIPHERIALS | MPU_REGION_512MB | MPU_No_access),
+    // external ram and fsmc regs, 0x80000000 - 0xbfffffff
+    (0x80000000 | MPU_REGION_Valid | 4), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_EXTERNAL_RAM | MPU_REGION_1GB | MPU_No_access),
+    // cached keys, closed unless mpu_keycache_open()
+    (((uint32_t) &_keycache) | MPU_REGION_Valid | 5), (MPU_KEYCACHE_RASR | MPU_No_access),
     //(0xE0000000 | MPU_REGION_Valid | 6), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_PERIPHERIALS | MPU_REGION_512MB | MPU_RW_No_access),
     (0xE0000000 | MPU_REGION_Valid | 6), (MPU_REGION_Enabled | MPU_NO_EXEC | MPU_PERIPHERIALS | MPU_REGION_512MB | MPU_RW),
   };
@@ -130,3 +137,18 @@ void mpu_init(void) {
   // not needed as irqs are initialized later
   //enable_irqs();
 }
+
+// gives access to the key cache region, until mpu_keycache_close()
+void mpu_keycache_open(void) {
+  MPU->RNR = 5;
+  MPU->RASR = MPU_KEYCACHE_RASR | MPU_RW;
+  __DSB();
+  __ISB();
+}
+
+void mpu_keycache_close(void) {
+  MPU->RNR = 5;
+  MPU->RASR = MPU_KEYCACHE_RASR | MPU_No_access;
+  __DSB();
+  __ISB();
+}
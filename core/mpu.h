@@ -1,6 +1,11 @@
 #ifndef MPU_H
 #define MPU_H
 
+// size of the .keycache section, the mpu region is as big
+#define MPU_KEYCACHE_SIZE 2048
+
 void mpu_init(void);
+void mpu_keycache_open(void);
+void mpu_keycache_close(void);
 
 #endif // MPU_H
@@ -1,5 +1,5 @@
 /* simple embedded flash filesystem */
-/* test with `gcc -DSTFS_INLINE_TESTS -o stfs stfs.c 2>&1 && ./stfs | less` */
+/* test with `make stfs-sim` or `make stfs-bench`, or by hand: `gcc -DSTFS_INLINE_TESTS -I.. -o stfs stfs.c ../utils/lzg/{de,en}code.c ../utils/lzg/checksum.c 2>&1 && ./stfs | less` */
 /* for how to use see main() */
 
 /*
@@ -15,7 +15,8 @@
 
   - no file metadata like timestamps or access permissions.
 
-  - filenames are max 32 bytes long, files max 64KB.
+  - filenames are max 32 bytes long, files max 512KB (64KB for files
+    written by older versions).
 
   - always reserves one empty block for vacuuming.
 
@@ -29,24 +30,55 @@
    chunk_size = 128
    chunks_per_block = 1024
 
-   4 different chunk types are used:
+   6 different chunk types are used:
 
    empty = 0xff (1B) irrelevant(all 0xff) (127B)
    inode (128B)- contain file meta information
      - chunktype (0xAA) (1B)
      - directory | file (1b)
+     - name_len (6b)
+     - legacy (1b) - file stored in data chunks by older versions
      - size (2B)
      - parent_directory_obj_id (4B)
      - obj_id (4B)
-     - name_len (6b)
      - name (32B)
-     - data (84B)
-   data (7B) - contain data
+     - replaced obj_id (4B) - see stfs_replace()
+     - size upper half (2B) - unless legacy
+     - codec (1B) - 0xff, or 0x01 for lzg compressed data, see stfs_creplace()
+     - data (77B)
+   extent data (1B) - contain data, of the extent chunk closing their run
+    - chunktype (0x99) (1B)
+    - data blob (127B)
+   extent (10B) - closes a run of extent data chunks in the same block
+    - chunktype (0x66) (1B)
+    - number of extent data chunks before it (1B)
+    - obj_id (4B)
+    - seq_id (4B) - the extent holds bytes from seq_id*EXTENT_SIZE on
+    - data blob (118B)
+   data (7B) - contain data of legacy files
     - chunktype (0xCC) (1B)
     - seq_id (2B)
     - obj_id (4B)
     - data blob (chunksize-metasize)
-   deleted = 0x00 (1B) irrelevant(all 0x00) (127B)
+   deleted = 0x00 (1B) irrelevant(0x00, words left erased stay 0xff) (127B)
+
+   4 more types are used for housekeeping:
+
+   header (9B) - first chunk of each block, written after erasing it
+    - chunktype (0x33) (1B)
+    - magic "STFS" (4B)
+    - erase count (4B)
+   vacuum (2B) - first chunk after the header in the block being vacuumed into
+    - chunktype (0x55) (1B)
+    - block being vacuumed (1B)
+   checkpoint (76B) - what stfs_init would find scanning, see Checkpoint_t
+    - chunktype (0x3C) (1B)
+    - valid (4B) - 0xffffffff until the store changes
+    - number of checkpoint data chunks before it (1B)
+    - ...
+   checkpoint data (1B) - the inode index at the time of the checkpoint
+    - chunktype (0xC3) (1B)
+    - data blob (127B)
 
    inode with oid 1 is the root directory and virtual
 
@@ -56,11 +88,19 @@
 #include <string.h> // mem*
 #include <unistd.h>
 
+#ifdef STFS_INLINE_TESTS
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <time.h>
+#else
 #include "libopencm3/stm32/flash.h"
 #include "randombytes_pitchfork.h"
 #include "irq.h"
 #include "delay.h"
+#endif // STFS_INLINE_TESTS
 #include "stfs.h"
+#include "utils/lzg/lzg.h"
 
 #define OID_BLOCK_SIZE (CHUNKS_PER_BLOCK * (NBLOCKS - 1) + MAX_OPEN_FILES + 3)
 #define OID_START_OFFSET 1
@@ -73,22 +113,169 @@
 #define LOG(level, ...)
 #endif // DEBUG_LEVEL
 
+#ifdef STFS_INLINE_TESTS
+/* host simulation of the flash: blocks[] is plain RAM, programming can
+   only clear bits like on NOR flash, erasing sets a sector to 0xff */
+Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK] __attribute__((aligned(CHUNK_SIZE)));
+#define FLASH_BASE ((uintptr_t) blocks)
+#define FLASH_CR_PROGRAM_X64 3
+
+static struct {
+  uint32_t touched;  // chunks inspected while searching the flash
+  uint32_t programs; // bytes or words programmed
+  uint32_t unlocks;
+  uint32_t irqoffs;
+  uint32_t checkpoints; // chunks written for checkpoints, and drops of them
+} stats;
+#define STAT(counter, n) stats.counter+=(n)
+
+// the power fails when sim_powerfail counts down to 0 on a flash
+// operation, which is left half done, resuming at sim_reset
+static jmp_buf sim_reset;
+static uint32_t sim_powerfail;
+#define POWERFAIL() (sim_powerfail!=0 && --sim_powerfail==0)
+
+static void flash_unlock(void) { stats.unlocks++; }
+static void flash_lock(void) {}
+static void disable_irqs(void) { stats.irqoffs++; }
+static void enable_irqs(void) {}
+
+#if STFS_PROGRAM_X32
+static void flash_program_word(uintptr_t address, uint32_t data) {
+  if(POWERFAIL()) longjmp(sim_reset, 1);
+  *(uint32_t*) address&=data;
+  stats.programs++;
+}
+#else
+static void flash_program(uintptr_t address, const void *data, uint32_t len) {
+  uint8_t *dst=(uint8_t*) address;
+  const uint8_t *src=data;
+  uint32_t i;
+  for(i=0;i<len;i++) {
+    if(POWERFAIL()) longjmp(sim_reset, 1);
+    dst[i]&=src[i];
+  }
+  stats.programs+=len;
+}
+#endif // STFS_PROGRAM_X32
+
+static uint32_t sim_erases, sim_wear[NBLOCKS];
+
+static void flash_erase_sector(uint8_t sector, uint32_t program_size) {
+  (void) program_size;
+  sim_erases++;
+  sim_wear[sector-STARTBLOCK]++;
+  if(POWERFAIL()) {
+    memset(&blocks[sector-STARTBLOCK], 0xff, sizeof(blocks[0])/2);
+    longjmp(sim_reset, 1);
+  }
+  memset(&blocks[sector-STARTBLOCK], 0xff, sizeof(blocks[0]));
+}
+
+static void randombytes_buf(void * const buf, const size_t size) {
+  size_t i;
+  for(i=0;i<size;i++) ((uint8_t*) buf)[i]=rand();
+}
+
+#else
 // from old storage.h
 #define FLASH_BASE 0x08040000 // sector 6 (128KB)
 extern Chunk blocks[NBLOCKS][CHUNKS_PER_BLOCK];
-static STFS_File fdesc[MAX_OPEN_FILES];
+#define STAT(counter, n)
+#endif // STFS_INLINE_TESTS
+static STFS_Fd fds[STFS_MAX_FDS];
+static STFS_File files[MAX_OPEN_FILES];
+static Chunk dirty[STFS_DIRTY_FILES]; // inodes of files, Empty if unused
+// the last extent of the file opened with O_REPLACE, if partial. it is
+// only stored when full or by stfs_close, so writing a file in small
+// pieces costs no more programs than stfs_replace.
+static struct {
+  uint8_t file;         // index of the STFS_File, 0xff if unused
+  uint8_t buf[EXTENT_SIZE];
+} rtail;
 static uint32_t errno;
 static uint32_t reserved_block;
+
+// an incremental vacuum moves the live chunks of victim into
+// reserved_block, src is the next chunk to look at in the victim, dst the
+// next free chunk in the reserved block. victim<0 when none is running.
+static struct {
+  int victim;
+  uint32_t mark; // vacuum chunk in the reserved block
+  uint32_t src;
+  uint32_t dst;
+} vac = { -1, 0, 0, 0 };
+
+// per block accounting kept up to date by write_chunk, so that neither
+// allocation nor vacuum has to scan the flash. blocks are filled from
+// their start, all chunks from next on are empty.
+static struct {
+  uint16_t live;    // inode and data chunks
+  uint16_t deleted;
+  uint16_t next;
+  uint32_t erases;  // from the header, 0 for blocks without one
+} bstat[NBLOCKS];
+
+// blocks formatted by older versions have no header
+#define HDR(b) (blocks[b][0].type==Header)
+
+// the reserved block only holds live chunks while a vacuum migrates into it
+#define RESERVED(b) ((b)==reserved_block && vac.victim<0)
+
+#define LIVE(type) ((type)==Inode || (type)==Data || (type)==Extent || (type)==ExtentData)
+// checkpoints are counted as deleted from the start, vacuum drops them
+#define DEAD(type) ((type)==Deleted || (type)==Checkpoint || (type)==CheckpointData)
+// file holding an lzg stream, directories have no codec
+#define COMPRESSED(inode) ((inode)->type==File && !(inode)->legacy && (inode)->codec==STFS_LZG)
+
+// oid of an Inode, Data or Extent chunk, 0 for other chunks
+static uint32_t chunk_oid(const Chunk *chunk) {
+  switch(chunk->type) {
+  case(Inode): { return chunk->inode.oid; }
+  case(Data): { return chunk->data.oid; }
+  case(Extent): { return chunk->extent.oid; }
+  default: { return 0; }
+  }
+}
+
+// seq of a Data or Extent chunk
+static uint32_t chunk_seq(const Chunk *chunk) {
+  if(chunk->type==Data) return chunk->data.seq;
+  return chunk->extent.seq;
+}
+
+static uint32_t inode_size(const Inode_t *inode) {
+  if(inode->legacy) return inode->size;
+  return inode->size | ((uint32_t) inode->size_hi<<16);
+}
+
+static void inode_set_size(Inode_t *inode, const uint32_t size) {
+  inode->size=size;
+  if(!inode->legacy) inode->size_hi=size>>16;
+}
+
+// flash ops run with irqs disabled, so the systick can't measure them,
+// instead their duration is estimated using the typical timings of the
+// stm32f2 datasheet
+#define PROGRAM_US 16       // per byte or word
+#define ERASE_US   1000000  // per 128KB sector
+#if STFS_PROGRAM_X32
+#define PROGRAM_WIDTH 4
+#else
+#define PROGRAM_WIDTH 1
+#endif
+static uint32_t flash_us, max_latency;
 static uint32_t current_oid_offset = OID_START_OFFSET;
+static uint32_t oid_hw; // highest oid in use, found at mount
 
 static int validfd(uint32_t fildes) {
-  if(fildes>=MAX_OPEN_FILES) {
+  if(fildes>=STFS_MAX_FDS) {
     // fail invalid fildes
     LOG(1, "[x] invalid fd, %d\n", fildes);
     errno = E_INVFD;
     return -1;
   }
-  if(fdesc[fildes].free!=0) {
+  if(fds[fildes].file>=MAX_OPEN_FILES) {
     // fail not open
     LOG(1, "[x] unused fd, %d\n", fildes);
     errno = E_NOTOPEN;
@@ -97,17 +284,175 @@ static int validfd(uint32_t fildes) {
   return 0;
 }
 
-static const Chunk* find_inode_by_parent_fname(
+// the open file of a valid fd, NULL if its inode has been deleted
+static STFS_File* fd_file(const uint32_t fildes) {
+  STFS_File *f=&files[fds[fildes].file];
+  if(f->ichunk==NULL) {
+    // fail unlinked or replaced since opening it
+    LOG(1, "[x] file of fd %d is gone\n", fildes);
+    errno = E_NOTFOUND;
+    return NULL;
+  }
+  return f;
+}
+
+/* like the index the inode of open files follows the chunk: a new inode
+   (old==NULL) is taken by the open file of its oid, a deleted one
+   (new==NULL) leaves it without, and vacuum moves it. the copies of
+   dirty files are kept. */
+static void file_relink(const Chunk *old, const Chunk *new) {
+  uint32_t i;
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    if(files[i].refs==0 || files[i].idirty) continue;
+    if(old?files[i].ichunk==old:files[i].oid==new->inode.oid) files[i].ichunk=new;
+  }
+}
+
+// the inode of f to change, copied to RAM the first time
+static Inode_t* file_inode(STFS_File *f) {
+  uint32_t i;
+  if(f->idirty) return (Inode_t*) &f->ichunk->inode;
+  for(i=0;i<STFS_DIRTY_FILES && dirty[i].type!=Empty;i++);
+  if(i>=STFS_DIRTY_FILES) {
+    // fail, too many files being written
+    LOG(1, "[x] no room for another dirty inode\n");
+    errno = E_NOFDS;
+    return NULL;
+  }
+  memcpy(&dirty[i], f->ichunk, sizeof(Chunk));
+  f->ichunk=&dirty[i];
+  f->idirty=1;
+  return &dirty[i].inode;
+}
+
+#if STFS_INDEX_SIZE > 0
+/* in-RAM index of all inodes, maps (parent oid, name hash) to the
+   location of the inode chunk. it is built by stfs_init and kept up to
+   date by store_chunk, del_chunk and vacuum. if there are more inodes
+   than STFS_INDEX_SIZE the index is dropped and lookups fall back to
+   scanning the flash. */
+typedef struct {
+  uint32_t parent;
+  uint16_t hash;
+  uint16_t loc; // block * CHUNKS_PER_BLOCK + chunk
+} IndexEntry;
+
+static IndexEntry inode_index[STFS_INDEX_SIZE];
+static uint32_t index_len;
+static uint8_t index_valid;
+
+static uint16_t name_hash(const uint8_t *name, const uint32_t len) {
+  // fnv-1a folded to 16 bits
+  uint32_t h=2166136261u, i;
+  for(i=0;i<len;i++) {
+    h^=name[i];
+    h*=16777619u;
+  }
+  return (h>>16) ^ (h & 0xffff);
+}
+
+static void index_add(const uint32_t b, const uint32_t c) {
+  if(!index_valid) return;
+  if(index_len>=STFS_INDEX_SIZE) {
+    LOG(1, "[!] inode index full, falling back to scanning\n");
+    index_valid=0;
+    return;
+  }
+  inode_index[index_len].parent=blocks[b][c].inode.parent;
+  inode_index[index_len].hash=name_hash(blocks[b][c].inode.name, blocks[b][c].inode.name_len);
+  inode_index[index_len].loc=b*CHUNKS_PER_BLOCK+c;
+  index_len++;
+}
+
+static void index_del(const uint32_t b, const uint32_t c) {
+  const uint16_t loc=b*CHUNKS_PER_BLOCK+c;
+  uint32_t i;
+  for(i=0;i<index_len;i++) {
+    if(inode_index[i].loc==loc) {
+      inode_index[i]=inode_index[--index_len];
+      return;
+    }
+  }
+}
+
+static void index_move(const uint32_t ob, const uint32_t oc, const uint32_t nb, const uint32_t nc) {
+  const uint16_t loc=ob*CHUNKS_PER_BLOCK+oc;
+  uint32_t i;
+  for(i=0;i<index_len;i++) {
+    if(inode_index[i].loc==loc) {
+      inode_index[i].loc=nb*CHUNKS_PER_BLOCK+nc;
+      return;
+    }
+  }
+}
+
+static void index_build(void) {
+  uint32_t b, c;
+  index_len=0;
+  index_valid=1;
+  for(b=0;b<NBLOCKS && index_valid;b++) {
+    if(RESERVED(b)) continue;
+    for(c=0;c<CHUNKS_PER_BLOCK && blocks[b][c].type!=Empty;c++) {
+      STAT(touched, 1);
+      if(blocks[b][c].type==Inode) index_add(b, c);
+    }
+  }
+}
+
+static const Chunk* index_find(const uint32_t parent,
+                               const uint8_t* fname, const uint32_t fsize,
+                               uint32_t *block, uint32_t *chunk) {
+  const uint16_t hash=name_hash(fname, fsize);
+  uint32_t i;
+  for(i=0;i<index_len;i++) {
+    if(inode_index[i].parent!=parent || inode_index[i].hash!=hash) continue;
+    const uint32_t b=inode_index[i].loc/CHUNKS_PER_BLOCK, c=inode_index[i].loc%CHUNKS_PER_BLOCK;
+    if(fsize == blocks[b][c].inode.name_len &&
+       memcmp(fname, &blocks[b][c].inode.name, fsize)==0) {
+      *block=b;
+      *chunk=c;
+      return &blocks[b][c];
+    }
+  }
+  return NULL;
+}
+
+// the first max children of parent at or after loc, in flash order
+static uint32_t index_children(const uint32_t parent, const uint32_t loc,
+                               const Inode_t **ents, const uint32_t max) {
+  uint32_t i, j, n=0;
+  for(i=0;i<index_len && max>0;i++) {
+    if(inode_index[i].parent!=parent || inode_index[i].loc<loc) continue;
+    const Inode_t *inode=&blocks[inode_index[i].loc/CHUNKS_PER_BLOCK][inode_index[i].loc%CHUNKS_PER_BLOCK].inode;
+    if(n==max && inode>ents[n-1]) continue;
+    // insertion sort, dropping the last one when full
+    for(j=(n<max)?n++:n-1;j>0 && ents[j-1]>inode;j--) ents[j]=ents[j-1];
+    ents[j]=inode;
+  }
+  return n;
+}
+#else
+#define index_valid 0
+#define index_add(b, c)
+#define index_del(b, c)
+#define index_move(ob, oc, nb, nc)
+#define index_build()
+#define index_find(parent, fname, fsize, block, chunk) NULL
+#define index_children(parent, loc, ents, max) 0
+#endif // STFS_INDEX_SIZE > 0
+
+static const Chunk* scan_inode_by_parent_fname(
                          const uint32_t parent,
                          const uint8_t* fname,
                          uint32_t *block, uint32_t *chunk) {
-  LOG(3, "[i] find_inode_by_parent_fname %x %s %d %d\n", parent, fname, *block, *chunk);
+  LOG(3, "[i] scan_inode_by_parent_fname %x %s %d %d\n", parent, fname, *block, *chunk);
   uint32_t b;
   const uint32_t fsize=strlen((const char*) fname);
   for(b=0;b<NBLOCKS;b++) {
-    if(b==reserved_block) continue;
+    if(RESERVED(b)) continue;
     uint32_t c;
     for(c=0;c<CHUNKS_PER_BLOCK && blocks[b][c].type!=Empty;c++) {
+      STAT(touched, 1);
       if(blocks[b][c].type==Inode &&
          (blocks[b][c].inode.parent==parent) &&
          (fsize == blocks[b][c].inode.name_len) &&
@@ -121,6 +466,16 @@ static const Chunk* find_inode_by_parent_fname(
   return NULL;
 }
 
+static const Chunk* find_inode_by_parent_fname(
+                         const uint32_t parent,
+                         const uint8_t* fname,
+                         uint32_t *block, uint32_t *chunk) {
+  if(index_valid) {
+    return index_find(parent, fname, strlen((const char*) fname), block, chunk);
+  }
+  return scan_inode_by_parent_fname(parent, fname, block, chunk);
+}
+
 static const Chunk* find_chunk(
                          const ChunkType type,
                          const uint32_t oid,
@@ -129,8 +484,9 @@ static const Chunk* find_chunk(
                          uint32_t *block, uint32_t *chunk) {
   uint32_t b,c=*chunk;
   for(b=*block;b<NBLOCKS;b++) {
-    if(b==reserved_block) continue;
+    if(RESERVED(b)) continue;
     for(;c<CHUNKS_PER_BLOCK;c++) {
+      STAT(touched, 1);
       if(blocks[b][c].type==type && (
               // for inodes we match oids
               (type==Inode && oid!=0 && blocks[b][c].inode.oid==oid) ||
@@ -140,6 +496,9 @@ static const Chunk* find_chunk(
               (type==Data && seq!=0xffff && blocks[b][c].data.oid==oid && blocks[b][c].data.seq==seq) ||
               // for data we match only oid
               (type==Data && seq==0xffff && blocks[b][c].data.oid==oid) ||
+              // for extents the same
+              (type==Extent && blocks[b][c].extent.oid==oid &&
+               (seq==0xffff || blocks[b][c].extent.seq==seq)) ||
               // empty and deleted we match easily
               (type==Empty || type==Deleted) )) {
         *block=b;
@@ -153,6 +512,141 @@ static const Chunk* find_chunk(
   return NULL;
 }
 
+// inode of oid, from the index if it is in use
+static const Chunk* inode_by_oid(const uint32_t oid) {
+  uint32_t b=0, c=0;
+#if STFS_INDEX_SIZE > 0
+  if(index_valid) {
+    uint32_t i;
+    for(i=0;i<index_len;i++) {
+      const Chunk *chunk=&blocks[inode_index[i].loc/CHUNKS_PER_BLOCK][inode_index[i].loc%CHUNKS_PER_BLOCK];
+      if(chunk->inode.oid==oid) return chunk;
+    }
+    return NULL;
+  }
+#endif
+  return find_chunk(Inode, oid, 0, 0, &b, &c);
+}
+
+#define NOCHUNK 0xffff
+
+/* every open file keeps the location of its extent chunks (or data
+   chunks for legacy files) indexed by seq. the map is filled by
+   stfs_open in one pass over the flash and kept up to date by
+   store_chunk, del_chunk and vacuum. */
+static void map_build(STFS_File *f) {
+  const uint32_t oid=f->oid;
+  uint32_t b, c;
+  memset(f->chunkmap, 0xff, sizeof(f->chunkmap));
+  for(b=0;b<NBLOCKS;b++) {
+    if(RESERVED(b)) continue;
+    for(c=0;c<CHUNKS_PER_BLOCK && blocks[b][c].type!=Empty;c++) {
+      STAT(touched, 1);
+      if((blocks[b][c].type==Data || blocks[b][c].type==Extent) &&
+         chunk_oid(&blocks[b][c])==oid &&
+         chunk_seq(&blocks[b][c])<STFS_CHUNKMAP_SIZE) {
+        f->chunkmap[chunk_seq(&blocks[b][c])]=b*CHUNKS_PER_BLOCK+c;
+      }
+    }
+  }
+}
+
+// updates the maps of all open files for the data or extent chunk at b,c
+static void map_set(const uint32_t b, const uint32_t c, const uint16_t loc) {
+  const uint32_t oid=chunk_oid(&blocks[b][c]), seq=chunk_seq(&blocks[b][c]);
+  uint32_t i;
+  if(seq>=STFS_CHUNKMAP_SIZE) return;
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    if(files[i].refs>0 && files[i].oid==oid) {
+      files[i].chunkmap[seq]=loc;
+    }
+  }
+}
+
+static const Chunk* find_data(const STFS_File *f, const uint32_t seq,
+                              uint32_t *block, uint32_t *chunk) {
+  if(seq<STFS_CHUNKMAP_SIZE) {
+    const uint16_t loc=f->chunkmap[seq];
+    if(loc==NOCHUNK) return NULL;
+    *block=loc/CHUNKS_PER_BLOCK;
+    *chunk=loc%CHUNKS_PER_BLOCK;
+    return &blocks[*block][*chunk];
+  }
+  *block=*chunk=0;
+  return find_chunk(f->ichunk->inode.legacy?Data:Extent, f->oid, 0, seq, block, chunk);
+}
+
+// chunks an extent of len bytes needs before its extent chunk
+static uint32_t extent_count(const uint32_t len) {
+  if(len<=EXTENT_TAIL) return 0;
+  return (len-EXTENT_TAIL+EXTENT_DATA-1)/EXTENT_DATA;
+}
+
+// byte off of the extent closed by ext, the next avail bytes are in the
+// same chunk. ext can be in flash or in a buffer of the whole extent.
+static uint8_t* extent_at(Chunk *ext, const uint32_t off, uint32_t *avail) {
+  const uint32_t k=ext->extent.count;
+  if(off<k*EXTENT_DATA) {
+    *avail=EXTENT_DATA-off%EXTENT_DATA;
+    return (ext-k+off/EXTENT_DATA)->extdata.data+off%EXTENT_DATA;
+  }
+  if(off-k*EXTENT_DATA>=EXTENT_TAIL) {
+    *avail=0;
+    return NULL;
+  }
+  *avail=EXTENT_TAIL-(off-k*EXTENT_DATA);
+  return ext->extent.data+off-k*EXTENT_DATA;
+}
+
+// copies len bytes from off of the extent to dst, or from src into the
+// extent if dst is NULL
+static int extent_copy(Chunk *ext, uint32_t off, uint8_t *dst, const uint8_t *src, uint32_t len) {
+  uint32_t avail;
+  uint8_t *ptr;
+  while(len>0) {
+    if((ptr=extent_at(ext, off, &avail))==NULL) {
+      // fail, beyond the extent
+      errno = E_NOCHUNK;
+      return -1;
+    }
+    if(avail>len) avail=len;
+    if(dst) {
+      memcpy(dst, ptr, avail);
+      dst+=avail;
+    } else {
+      memcpy(ptr, src, avail);
+      src+=avail;
+    }
+    off+=avail;
+    len-=avail;
+  }
+  return 0;
+}
+
+/* assembles extent seq of oid in chunks: the oldlen bytes of the old
+   extent (if any), with the bytes from buf on top of them at [from,
+   to). returns the number of chunks, the extent chunk is the last. */
+static uint32_t extent_build(Chunk *chunks, const uint32_t oid, const uint32_t seq,
+                             Chunk *old, const uint32_t oldlen,
+                             const uint8_t *buf, const uint32_t from, const uint32_t to) {
+  const uint32_t k=extent_count(oldlen>to?oldlen:to);
+  uint32_t i, avail, off;
+  uint8_t *ptr;
+  memset(chunks, 0xff, (k+1)*sizeof(Chunk));
+  for(i=0;i<k;i++) chunks[i].type=ExtentData;
+  chunks[k].type=Extent;
+  chunks[k].extent.count=k;
+  chunks[k].extent.oid=oid;
+  chunks[k].extent.seq=seq;
+  for(off=0;old && off<oldlen;off+=avail) {
+    if((ptr=extent_at(old, off, &avail))==NULL) break;
+    if(avail>oldlen-off) avail=oldlen-off;
+    extent_copy(&chunks[k], off, NULL, ptr, avail);
+  }
+  extent_copy(&chunks[k], from, NULL, buf, to-from);
+  return k+1;
+}
+
 static uint32_t oid_by_path(uint8_t *path, uint32_t *b, uint32_t *c) {
   LOG(3, "[i] oid_by_path %s\n", path);
   if(path[0]==0) { // root directory virtual path is 0 size
@@ -206,62 +700,190 @@ static uint32_t oid_by_path(uint8_t *path, uint32_t *b, uint32_t *c) {
   return blocks[*b][*c].inode.oid;
 }
 
+static Chunk *ckpt;   // checkpoint describing the store, NULL if none
+static uint32_t idle; // stfs_vacuum_step calls since the last change
+static uint32_t changes; // programs and erases since the last checkpoint
+
+// the store is about to change, which the checkpoint doesn't describe,
+// clearing its valid word is a single program
+static void checkpoint_drop(void) {
+  Chunk *chunk=ckpt;
+  idle=0;
+  changes++;
+  if(chunk==NULL) return;
+  ckpt=NULL;
+  STAT(checkpoints, 1);
+  disable_irqs();
+  flash_unlock();
+#if STFS_PROGRAM_X32
+  flash_program_word((uintptr_t) &chunk->checkpoint.valid, 0);
+  flash_us+=PROGRAM_US;
+#else
+  const uint32_t zero=0;
+  flash_program((uintptr_t) &chunk->checkpoint.valid, (const uint8_t*) &zero, sizeof(zero));
+  flash_us+=sizeof(zero)*PROGRAM_US;
+#endif
+  flash_lock();
+  enable_irqs();
+}
+
+/* programs n consecutive chunks in one unlock of the flash. irqs are
+   only disabled while programming a single chunk, so that usb doesn't
+   starve during long writes. */
+static int write_chunks(Chunk *dst, const Chunk *src, const uint32_t n) {
+  if(((uintptr_t)dst)%sizeof(Chunk)!=0 || // not aligned
+     ((uintptr_t)dst)<FLASH_BASE ||       // outside of device
+     ((uintptr_t)(dst+n))>(FLASH_BASE+NBLOCKS*CHUNKS_PER_BLOCK*CHUNK_SIZE)) {
+    LOG(1, "[x] Bad chunk addr: %p\n", dst);
+    errno = E_BADCHUNK;
+    return -1;
+  }
+  checkpoint_drop();
+
+  uint32_t i, j;
+  flash_unlock();
+  for(i=0;i<n;i++) {
+    const uint32_t b=(dst+i-&blocks[0][0])/CHUNKS_PER_BLOCK;
+    const uint32_t c=(dst+i-&blocks[0][0])%CHUNKS_PER_BLOCK;
+    const ChunkType old=blocks[b][c].type;
+    // the type of a new chunk is programmed last, so that a write torn by
+    // a reset leaves a chunk reading as Empty, which stfs_init cleans up.
+    // when deleting the type goes first.
+    const uint32_t first=(old==Empty)?PROGRAM_WIDTH:0;
+    disable_irqs();
+#if STFS_PROGRAM_X32
+    for(j=0;j<sizeof(Chunk);j+=4) {
+      const uint32_t ofs=(first+j)%sizeof(Chunk);
+      uint32_t word, cur;
+      memcpy(&word, ((const uint8_t*) (src+i))+ofs, sizeof(word));
+      memcpy(&cur, ((const uint8_t*) (dst+i))+ofs, sizeof(cur));
+      // nothing to clear, e.g. the 0xff tail of a chunk
+      if((cur&word)==cur) continue;
+      flash_program_word((uintptr_t) (dst+i)+ofs, word);
+      flash_us+=PROGRAM_US;
+    }
+#else
+    (void) j;
+    flash_program((uintptr_t) (dst+i)+first, ((const uint8_t*) (src+i))+first, sizeof(Chunk)-first);
+    if(first) flash_program((uintptr_t) (dst+i), src+i, first);
+    flash_us+=sizeof(Chunk)*PROGRAM_US;
+#endif
+    enable_irqs();
+
+    if(old==Empty && c>=bstat[b].next) bstat[b].next=c+1;
+    if(LIVE(old)) bstat[b].live--;
+    else if(DEAD(old)) bstat[b].deleted--;
+    if(LIVE(blocks[b][c].type)) bstat[b].live++;
+    else if(DEAD(blocks[b][c].type)) bstat[b].deleted++;
+  }
+  flash_lock();
+
+  return 0;
+}
+
 static int write_chunk(void *dst, void *src, uint32_t size) {
   if(size!=sizeof(Chunk)) {
     LOG(1, "[x] Bad chunk size: %d\n", size);
     errno = E_BADCHUNK;
     return -1;
   }
-  if(((int)dst)%sizeof(Chunk)!=0 || // not aligned
-     ((int)dst)<FLASH_BASE ||       // outside of device
-     ((int)dst)+size>=(FLASH_BASE+NBLOCKS*CHUNKS_PER_BLOCK*CHUNK_SIZE)) {
-    LOG(1, "[x] Bad chunk addr: %d\n", dst);
-    errno = E_BADCHUNK;
-    return -1;
+  return write_chunks(dst, src, 1);
+}
+
+static void mark_deleted(const uint32_t b, const uint32_t c) {
+  Chunk chunk;
+  uint32_t i, word;
+  // words still erased hold nothing to wipe, leaving them saves programs
+  for(i=0;i<sizeof(chunk);i+=sizeof(word)) {
+    memcpy(&word, ((const uint8_t*) &blocks[b][c])+i, sizeof(word));
+    if(word!=0xffffffff) word=0;
+    memcpy(((uint8_t*) &chunk)+i, &word, sizeof(word));
+  }
+  chunk.type=Deleted;
+  write_chunk(&blocks[b][c], &chunk, sizeof(chunk));
+}
+
+static void write_header(const uint32_t b, const uint32_t erases) {
+  Chunk chunk;
+  memset(&chunk,0xff,sizeof(chunk));
+  chunk.type=Header;
+  chunk.header.magic=STFS_MAGIC;
+  chunk.header.erases=erases;
+  write_chunk(&blocks[b][0], &chunk, sizeof(chunk));
+  bstat[b].erases=erases;
+}
+
+// also finds the highest oid in use while looking at every chunk anyway
+static void bstat_build(void) {
+  uint32_t b, c;
+  memset(bstat, 0, sizeof(bstat));
+  oid_hw=1;
+  for(b=0;b<NBLOCKS;b++) {
+    if(HDR(b) && blocks[b][0].header.magic==STFS_MAGIC) {
+      bstat[b].erases=blocks[b][0].header.erases;
+    }
+    for(c=0;c<CHUNKS_PER_BLOCK;c++) {
+      const Chunk *chunk=&blocks[b][c];
+      STAT(touched, 1);
+      if(chunk->type==Empty) continue;
+      if(LIVE(chunk->type)) bstat[b].live++;
+      else if(DEAD(chunk->type)) bstat[b].deleted++;
+      if(chunk_oid(chunk)>oid_hw) oid_hw=chunk_oid(chunk);
+      bstat[b].next=c+1;
+    }
   }
+}
 
-  //memcpy(dst, src, size);
+// erases a block and writes its header with the erase count increased
+static void erase_block(const uint32_t b) {
+  checkpoint_drop();
   disable_irqs();
   flash_unlock();
-  flash_program((int) dst, src, size);
+  /* Erasing page*/
+  flash_erase_sector(STARTBLOCK+b, FLASH_CR_PROGRAM_X64);
   flash_lock();
   enable_irqs();
+  flash_us+=ERASE_US;
+  const uint32_t erases=bstat[b].erases+1;
+  memset(&bstat[b], 0, sizeof(bstat[b]));
+  write_header(b, erases);
+}
 
-  return 0;
+static int chunk_erased(const Chunk *chunk) {
+  const uint8_t *ptr=(const uint8_t*) chunk;
+  uint32_t i;
+  for(i=0;i<sizeof(Chunk);i++) {
+    if(ptr[i]!=0xff) return 0;
+  }
+  return 1;
 }
 
-int vacuum() {
-  uint32_t i, b,c, candidate_reclaim=0, used[NBLOCKS], unused[NBLOCKS], deleted[NBLOCKS];
+/* picks the block to vacuum. of the blocks reclaiming at least 90% of
+   what the best one would, the least erased one is taken to spread the
+   wear. when idle only deleted chunks count as reclaimable, and at
+   least an eighth of a block must be, to not wear the flash for
+   nothing. */
+static int vacuum_victim(const uint8_t idle) {
+  uint32_t b, reclaim[NBLOCKS], most=0;
   int candidate=-1;
-  for(i=0;i<NBLOCKS;i++) { used[i]=unused[i]=deleted[i]=0; }
-  //LOG(2, "[i] Block stats\n");
   for(b=0;b<NBLOCKS;b++) {
-    for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-      switch(blocks[b][c].type) {
-      case(Empty): { unused[b]++; break; }
-      case(Deleted): { deleted[b]++; break; }
-      default: { used[b]++; break; }
-      }
-    }
     if(b==reserved_block) continue;
-    if((unused[b]+deleted[b])>candidate_reclaim) {
-      LOG(1, "[i] old, new can: %d %d (%d>%d)\n", candidate, b, (unused[b]+deleted[b]),candidate_reclaim);
-      candidate=b;
-      candidate_reclaim=(unused[b]+deleted[b]);
-    } else {
-      char tmp;
-      randombytes_buf((void *) &tmp, sizeof(tmp));
-      tmp%=4;
-      if((unused[b]+deleted[b])>(candidate_reclaim*9)/10 && tmp==0) {
-      LOG(1, "[i] lucky old, new can: %d %d (%d>%d)\n", candidate, b, (unused[b]+deleted[b]),candidate_reclaim);
+    reclaim[b]=bstat[b].deleted;
+    if(!idle) reclaim[b]+=CHUNKS_PER_BLOCK-bstat[b].next;
+    if(reclaim[b]>most) most=reclaim[b];
+  }
+  if(most==0 || (idle && most<CHUNKS_PER_BLOCK/8)) return -1;
+  for(b=0;b<NBLOCKS;b++) {
+    if(b==reserved_block || reclaim[b]<(most*9)/10 || reclaim[b]==0) continue;
+    if(candidate<0 || bstat[b].erases<bstat[candidate].erases) {
+      LOG(1, "[i] old, new can: %d %d (%d, %d erases)\n", candidate, b, reclaim[b], bstat[b].erases);
       candidate=b;
-      candidate_reclaim=(unused[b]+deleted[b]);
-      }
     }
   }
-  //for(b=0;b<NBLOCKS;b++) {
-  //  LOG(2, "\t%d %4d %4d %4d\n", b, unused[b], used[b], deleted[b]);
-  //}
+  return candidate;
+}
+
+static int vacuum_start(const int candidate) {
   if(candidate<0) {
     // fail
     LOG(1, "[x] vacuum reserved: %d candidate: %d\n", reserved_block, candidate);
@@ -274,67 +896,301 @@ int vacuum() {
     errno = E_VAC;
     return -1;
   }
+  if(bstat[candidate].live>=CHUNKS_PER_BLOCK-bstat[reserved_block].next) {
+    // fail, the live chunks and the marker don't fit
+    LOG(1, "[x] vacuum candidate %d too full\n", candidate);
+    errno = E_VAC;
+    return -1;
+  }
   LOG(2, "[i] vacuuming from %d to %d\n", candidate, reserved_block);
-  i=0;
-  for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-    if(blocks[candidate][c].type==Inode || blocks[candidate][c].type==Data) {
-      write_chunk(&blocks[reserved_block][i++], &blocks[candidate][c], sizeof(Chunk));
+  // mark the destination, so that a vacuum interrupted by a reset can be
+  // resumed by stfs_init
+  Chunk chunk;
+  memset(&chunk,0xff,sizeof(chunk));
+  chunk.type=Vacuum;
+  chunk.vacuum.victim=candidate;
+  vac.mark=bstat[reserved_block].next;
+  if(write_chunk(&blocks[reserved_block][vac.mark], &chunk, sizeof(chunk))!=0) {
+    return -1;
+  }
+  vac.victim=candidate;
+  vac.src=0;
+  vac.dst=vac.mark+1;
+  return 0;
+}
+
+// moves at most max live chunks from the victim, when there's nothing
+// left to move erases the victim, which becomes the new reserved block
+static int vacuum_migrate(uint32_t max) {
+  const uint32_t v=vac.victim;
+  uint32_t i;
+  for(;vac.src<bstat[v].next && max>0;vac.src++) {
+    const uint32_t c=vac.src;
+    // extent data chunks move together with their extent chunk
+    if(blocks[v][c].type!=Inode && blocks[v][c].type!=Data && blocks[v][c].type!=Extent) continue;
+    const uint32_t k=(blocks[v][c].type==Extent)?blocks[v][c].extent.count:0;
+    // after a reset the last chunk might have been copied already
+    if(memcmp(&blocks[reserved_block][vac.dst-1], &blocks[v][c], sizeof(Chunk))!=0) {
+      if(vac.dst+k+1>CHUNKS_PER_BLOCK) {
+        // fail, the victim had more live chunks than counted
+        LOG(1, "[x] vacuum of %d doesn't fit\n", v);
+        errno = E_VAC;
+        return -1;
+      }
+      write_chunks(&blocks[reserved_block][vac.dst], &blocks[v][c-k], k+1);
+      vac.dst+=k+1;
+    }
+    if(blocks[v][c].type==Inode) {
+      index_move(v, c, reserved_block, vac.dst-1);
+      file_relink(&blocks[v][c], &blocks[reserved_block][vac.dst-1]);
+    } else map_set(v, c, reserved_block*CHUNKS_PER_BLOCK+vac.dst-1);
+    // the copy is live now, drop the original so that it isn't found twice
+    mark_deleted(v, c);
+    for(i=1;i<=k;i++) mark_deleted(v, c-i);
+    max-=(max>k)?k+1:max;
+  }
+  if(max==0) return 0;
+
+  erase_block(v);
+  mark_deleted(reserved_block, vac.mark);
+  reserved_block=v;
+  vac.victim=-1;
+  return 0;
+}
+
+// blocking vacuum, finishes a running vacuum or does a complete new one
+int vacuum() {
+  if(vac.victim<0 && vacuum_start(vacuum_victim(0))!=0) {
+    return -1;
+  }
+  while(vac.victim>=0) {
+    if(vacuum_migrate(CHUNKS_PER_BLOCK)!=0) return -1;
+  }
+  return 0;
+}
+
+// first free chunk in the lowest block having n
+static int alloc_chunk(uint32_t *block, uint32_t *chunk, const uint32_t n) {
+  uint32_t b;
+  for(b=0;b<NBLOCKS;b++) {
+    if(b==reserved_block || bstat[b].next+n>CHUNKS_PER_BLOCK) continue;
+    *block=b;
+    *chunk=bstat[b].next;
+    return 0;
+  }
+  return -1;
+}
+
+#if STFS_INDEX_SIZE > 0
+#define CHECKPOINT_ENTRIES ((CHUNK_SIZE-1)/sizeof(IndexEntry))
+#endif
+
+/* writes a checkpoint of the block counters, oid high-water mark and
+   inode index, so that the next stfs_init doesn't need to scan. its
+   chunks are counted as deleted in the counters it stores, so they are
+   right again once it's dropped. needs no running vacuum. */
+static void checkpoint_store(void) {
+  Chunk chunk;
+  uint32_t b, c, i, n=0, len=0xffff;
+#if STFS_INDEX_SIZE > 0
+  if(index_valid) {
+    len=index_len;
+    n=(len+CHECKPOINT_ENTRIES-1)/CHECKPOINT_ENTRIES;
+  }
+#endif
+  if(alloc_chunk(&b, &c, n+1)!=0) {
+    // not worth a vacuum, the next stfs_init scans
+    return;
+  }
+  STAT(checkpoints, n+1);
+  for(i=0;i<n;i++) {
+    memset(&chunk,0xff,sizeof(chunk));
+    chunk.type=CheckpointData;
+#if STFS_INDEX_SIZE > 0
+    const uint32_t k=(len-i*CHECKPOINT_ENTRIES>CHECKPOINT_ENTRIES)?CHECKPOINT_ENTRIES:len-i*CHECKPOINT_ENTRIES;
+    memcpy(chunk.ckdata.data, &inode_index[i*CHECKPOINT_ENTRIES], k*sizeof(IndexEntry));
+#endif
+    write_chunk(&blocks[b][c+i], &chunk, sizeof(chunk));
+  }
+  memset(&chunk,0xff,sizeof(chunk));
+  chunk.type=Checkpoint;
+  chunk.checkpoint.count=n;
+  chunk.checkpoint.reserved=reserved_block;
+  chunk.checkpoint.index_len=len;
+  chunk.checkpoint.oid_hw=oid_hw;
+  for(i=0;i<NBLOCKS;i++) {
+    chunk.checkpoint.blocks[i].live=bstat[i].live;
+    chunk.checkpoint.blocks[i].deleted=bstat[i].deleted+(i==b);
+    chunk.checkpoint.blocks[i].next=bstat[i].next+(i==b);
+    chunk.checkpoint.blocks[i].erases=bstat[i].erases;
+  }
+  write_chunk(&blocks[b][c+n], &chunk, sizeof(chunk));
+  ckpt=&blocks[b][c+n];
+  changes=0;
+  LOG(2, "[i] checkpoint at %d %d\n", b, c+n);
+}
+
+/* writes a checkpoint now, unless there is a valid one, so that the
+   next stfs_init is fast, call it before the device locks or shuts
+   down. */
+void stfs_checkpoint(void) {
+  if(ckpt!=NULL || vac.victim>=0) return;
+  checkpoint_store();
+}
+
+/* mounts from a valid checkpoint closing a block, if nothing was written
+   after it. blocks are filled from their start, so their first empty
+   chunks are found by bisecting, the checkpoint must be right before
+   one of them. returns -1 if the flash has to be scanned. */
+static int checkpoint_load(void) {
+  uint32_t b, lo, hi, next[NBLOCKS];
+  Chunk *chunk=NULL;
+  for(b=0;b<NBLOCKS;b++) {
+    for(lo=0,hi=CHUNKS_PER_BLOCK;lo<hi;) {
+      const uint32_t mid=(lo+hi)/2;
+      STAT(touched, 1);
+      if(blocks[b][mid].type==Empty) hi=mid;
+      else lo=mid+1;
+    }
+    next[b]=lo;
+    if(lo>0 && blocks[b][lo-1].type==Checkpoint &&
+       blocks[b][lo-1].checkpoint.valid==0xffffffff) {
+      chunk=&blocks[b][lo-1];
+    }
+  }
+  if(chunk==NULL) return -1;
+  const Checkpoint_t *cp=&chunk->checkpoint;
+  const uint32_t c=chunk-&blocks[0][0];
+  if(cp->reserved>=NBLOCKS || cp->count>c%CHUNKS_PER_BLOCK) return -1;
+  for(b=0;b<NBLOCKS;b++) {
+    // a torn write after the checkpoint
+    if(cp->blocks[b].next!=next[b]) return -1;
+    if(next[b]<CHUNKS_PER_BLOCK && !chunk_erased(&blocks[b][next[b]])) return -1;
+  }
+  for(lo=1;lo<=cp->count;lo++) {
+    if((chunk-lo)->type!=CheckpointData) return -1;
+  }
+#if STFS_INDEX_SIZE > 0
+  if(cp->index_len!=0xffff) {
+    if(cp->index_len>STFS_INDEX_SIZE ||
+       (cp->index_len+CHECKPOINT_ENTRIES-1)/CHECKPOINT_ENTRIES!=cp->count) {
+      // written with a larger index
+      return -1;
+    }
+    for(lo=0;lo<cp->count;lo++) {
+      const uint32_t k=(cp->index_len-lo*CHECKPOINT_ENTRIES>CHECKPOINT_ENTRIES)?CHECKPOINT_ENTRIES:cp->index_len-lo*CHECKPOINT_ENTRIES;
+      memcpy(&inode_index[lo*CHECKPOINT_ENTRIES], (chunk-cp->count+lo)->ckdata.data, k*sizeof(IndexEntry));
     }
+    index_len=cp->index_len;
+    index_valid=1;
+  } else {
+    index_len=0;
+    index_valid=0;
   }
-  // erase candidate
-  //memset(&blocks[candidate],0xff,CHUNKS_PER_BLOCK*CHUNK_SIZE);
+#endif
+  for(b=0;b<NBLOCKS;b++) {
+    bstat[b].live=cp->blocks[b].live;
+    bstat[b].deleted=cp->blocks[b].deleted;
+    bstat[b].next=cp->blocks[b].next;
+    bstat[b].erases=cp->blocks[b].erases;
+  }
+  oid_hw=cp->oid_hw;
+  reserved_block=cp->reserved;
+  ckpt=chunk;
+  return 0;
+}
 
-  disable_irqs();
-  flash_unlock();
-  /* Erasing page*/
-  flash_erase_sector(STARTBLOCK+candidate, FLASH_CR_PROGRAM_X64);
-  flash_lock();
-  enable_irqs();
+/* does a bounded amount of compaction, to be called when idle. returns 1
+   if there's more work to do. a new vacuum is started when less than
+   STFS_VACUUM_LOW chunks are free, or to move cold data off a block
+   that lags more than STFS_WEAR_DELTA erases behind. with nothing to do
+   for STFS_CHECKPOINT_IDLE calls a checkpoint is written, if the store
+   changed STFS_CHECKPOINT_CHANGES times since the last one. */
+int stfs_vacuum_step(void) {
+  if(vac.victim<0) {
+    uint32_t b, free=0, max=0;
+    int candidate=-1, coldest=-1;
+    for(b=0;b<NBLOCKS;b++) {
+      if(bstat[b].erases>max) max=bstat[b].erases;
+      if(b==reserved_block) continue;
+      free+=CHUNKS_PER_BLOCK-bstat[b].next;
+      if(coldest<0 || bstat[b].erases<bstat[coldest].erases) coldest=b;
+    }
+    if(free<STFS_VACUUM_LOW) candidate=vacuum_victim(1);
+    if(candidate<0 && max-bstat[coldest].erases>STFS_WEAR_DELTA) candidate=coldest;
+    if(candidate<0 || vacuum_start(candidate)!=0) {
+      if(ckpt==NULL && ++idle==STFS_CHECKPOINT_IDLE &&
+         changes>=STFS_CHECKPOINT_CHANGES) {
+        checkpoint_store();
+      }
+      return 0;
+    }
+    return 1;
+  }
+  if(vacuum_migrate(STFS_VACUUM_STEP)!=0) return 0;
+  return vac.victim>=0;
+}
 
-  reserved_block=candidate;
+// estimated worst case time in us spent in a single store of chunks,
+// including any vacuum it triggered, since stfs_init
+uint32_t stfs_max_latency(void) {
+  return max_latency;
+}
+
+// stores n chunks, consecutive as far as the free space of a block
+// allows, or all in one block if whole, as an extent must be
+static int store_chunks(Chunk *chunks, const uint32_t n, const uint8_t whole) {
+  const uint32_t start=flash_us;
+  uint32_t b, c, i, run, done;
+  for(done=0;done<n;done+=run) {
+    for(i=0;alloc_chunk(&b, &c, whole?n:1)!=0;i++) {
+          // no free chunk found try to vacuum, the 2nd time only if the
+          // 1st just finished a running vacuum which freed nothing
+          if(i>1 || vacuum()!=0) {
+            // failed vacuuming filesystem is full
+            LOG(1, "[!] device is full\n");
+            errno = E_FULL;
+            return -1;
+          }
+    }
+    run=CHUNKS_PER_BLOCK-c;
+    if(run>n-done) run=n-done;
+    if(write_chunks(&blocks[b][c], chunks+done, run)!=0) {
+      return -1;
+    }
+    for(i=0;i<run;i++) {
+      if(chunks[done+i].type==Inode) {
+        index_add(b, c+i);
+        file_relink(NULL, &blocks[b][c+i]);
+      } else if(chunks[done+i].type==Data || chunks[done+i].type==Extent) map_set(b, c+i, b*CHUNKS_PER_BLOCK+c+i);
+    }
+  }
+  if(flash_us-start>max_latency) max_latency=flash_us-start;
   return 0;
 }
 
 static int store_chunk(Chunk *chunk) {
-  uint32_t b=0, c=0;
-  if(find_chunk(Empty, 0, 0, 0, &b, &c)==NULL) {
-        // no no free chunk found try to vacuum
-        if(vacuum()!=0) {
-          // failed vacuuming filesystem is full
-          LOG(1, "[!] device is full\n");
-          errno = E_FULL;
-          return -1;
-        }
-        // vacuum successful
-        b=c=0;
-        if(find_chunk(Empty, 0, 0, 0, &b, &c)==NULL) {
-          // fail no empty chunk found - should be impossible,
-          // since we just vacuumed
-          LOG(1, "[!] has no free chunk! even after vacuuming!\n");
-          errno = E_FULL;
-          return -1;
-        }
-  }
-  return write_chunk(&blocks[b][c], chunk, sizeof(*chunk));
+  return store_chunks(chunk, 1, 0);
 }
 
 static uint8_t is_oid_available(const uint32_t oid) {
-  uint32_t b,c, fd;
+  uint32_t b,c, i;
   if (oid < 2) return 0;
-  for(fd=0;fd<MAX_OPEN_FILES;fd++) {
-    if(fdesc[fd].free==0 && fdesc[fd].ichunk.inode.oid == oid) return 0;
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    if(files[i].refs>0 && files[i].oid == oid) return 0;
   }
   for(b=0;b<NBLOCKS;b++) {
-    if(b==reserved_block) continue;
+    if(RESERVED(b)) continue;
     for(c=0;c<CHUNKS_PER_BLOCK;c++) {
-      if(blocks[b][c].type==Inode && blocks[b][c].inode.oid == oid) return 0;
-      if(blocks[b][c].type==Data && blocks[b][c].data.oid == oid) return 0;
+      STAT(touched, 1);
+      if(chunk_oid(&blocks[b][c]) == oid) return 0;
     }
   }
   return 1;
 }
 
-static uint32_t new_oid() {
+// searches a window of more oids than could be in use for a free one
+static uint32_t scan_new_oid() {
   uint32_t oid = current_oid_offset + 1 ;
   uint32_t i;
   for(i=0; i < OID_BLOCK_SIZE; i++) {
@@ -352,11 +1208,27 @@ static uint32_t new_oid() {
   return 0;
 }
 
+static uint32_t new_oid() {
+  // every oid above the highest in use is free, only when they run out
+  // fall back to searching
+  if(oid_hw < 0xFFFFFFFF-OID_BLOCK_SIZE) {
+    LOG(3,"[i] returning new oid %d\n", oid_hw+1);
+    return ++oid_hw;
+  }
+  return scan_new_oid();
+}
+
 static void del_chunk(const uint32_t b, const uint32_t c) {
-  Chunk chunk;
-  memset(&chunk,0,sizeof(chunk));
-  chunk.type=Deleted;
-  write_chunk(&blocks[b][c], &chunk, sizeof(chunk));
+  const uint32_t k=(blocks[b][c].type==Extent)?blocks[b][c].extent.count:0;
+  uint32_t i;
+  if(blocks[b][c].type==Inode) {
+    index_del(b, c);
+    file_relink(&blocks[b][c], NULL);
+  } else if(blocks[b][c].type==Data || blocks[b][c].type==Extent) map_set(b, c, NOCHUNK);
+  mark_deleted(b, c);
+  // the extent chunk goes first, a reset leaves orphaned data chunks
+  // which stfs_init drops
+  for(i=1;i<=k && i<=c;i++) mark_deleted(b, c-i);
 }
 
 
@@ -386,16 +1258,68 @@ int stfs_opendir(uint8_t *path, ReaddirCTX *ctx) {
   return 0;
 }
 
+// lists the directory of an inode returned by stfs_readdir, without
+// looking up its path again
+int stfs_opendir_at(const Inode_t *dir, ReaddirCTX *ctx) {
+  memset((uint8_t*) ctx,0,sizeof(*ctx));
+  if(dir->type!=Directory) {
+    errno = E_NOTDIR;
+    return -1;
+  }
+  ctx->oid=dir->oid;
+  return 0;
+}
+
+// continues after the entry at inode, which is in flash
+static void readdir_next(ReaddirCTX *ctx, const Inode_t *inode) {
+  const uint32_t loc=(const Chunk*) inode-&blocks[0][0]+1;
+  ctx->block=loc/CHUNKS_PER_BLOCK;
+  ctx->chunk=loc%CHUNKS_PER_BLOCK;
+}
+
 const Inode_t* stfs_readdir(ReaddirCTX *ctx) {
-  const Chunk *chunk=find_chunk(Inode, 0, ctx->oid, 0, &(ctx->block), &(ctx->chunk));
-  if(chunk==NULL) return NULL;
-  if(ctx->chunk+1>=CHUNKS_PER_BLOCK) {
-    ctx->block++;
+  const Inode_t *inode=NULL;
+  if(index_valid) {
+    if(index_children(ctx->oid, ctx->block*CHUNKS_PER_BLOCK+ctx->chunk, &inode, 1)==0) inode=NULL;
+  } else {
+    const Chunk *chunk=find_chunk(Inode, 0, ctx->oid, 0, &(ctx->block), &(ctx->chunk));
+    if(chunk!=NULL) inode=&chunk->inode;
+  }
+  if(inode==NULL) {
+    // stay at the end, without scanning again
+    ctx->block=NBLOCKS;
     ctx->chunk=0;
+    return NULL;
+  }
+  readdir_next(ctx, inode);
+  return inode;
+}
+
+static int name_cmp(const Inode_t *a, const Inode_t *b) {
+  const int r=memcmp(a->name, b->name, (a->name_len<b->name_len)?a->name_len:b->name_len);
+  if(r!=0) return r;
+  return a->name_len-b->name_len;
+}
+
+/* lists the next max entries of the directory of ctx in one pass over
+   the index, or in one sweep of the flash if the index is not in use.
+   with sorted the batch is ordered by name. returns the number of
+   entries, 0 at the end of the directory. as with stfs_readdir the
+   entries point into flash and are only valid until the next write. */
+uint32_t stfs_readdir_batch(ReaddirCTX *ctx, const Inode_t **ents, const uint32_t max, const int sorted) {
+  uint32_t n=0, i, j;
+  if(index_valid) {
+    n=index_children(ctx->oid, ctx->block*CHUNKS_PER_BLOCK+ctx->chunk, ents, max);
+    if(n>0) readdir_next(ctx, ents[n-1]);
   } else {
-    ctx->chunk++;
+    while(n<max && (ents[n]=stfs_readdir(ctx))!=NULL) n++;
+  }
+  for(i=1;sorted && i<n;i++) {
+    const Inode_t *inode=ents[i];
+    for(j=i;j>0 && name_cmp(ents[j-1], inode)>0;j--) ents[j]=ents[j-1];
+    ents[j]=inode;
   }
-  return &chunk->inode;
+  return n;
 }
 
 static uint8_t* split_path(uint8_t *path) {
@@ -451,18 +1375,12 @@ static int create_obj(uint8_t *path, Chunk *chunk) {
   }
 
   // check if object already exists
-  ReaddirCTX ctx={.oid=parent,.block=0,.chunk=0};
-  const Inode_t *inode;
-  const uint32_t fsize=strlen((char*) fname);
-  while((inode=stfs_readdir(&ctx))!=0) {
-    if(fsize==inode->name_len &&
-       memcmp(inode->name, fname, inode->name_len)==0) {
-      // fail parent has already a child named fname
-      LOG(1, "[x] '%s' has already a child %s\n", path, fname);
-      errno = E_EXISTS;
-      ret=-1;
-      goto exit;
-    }
+  if(find_inode_by_parent_fname(parent, fname, &b, &c)!=NULL) {
+    // fail parent has already a child named fname
+    LOG(1, "[x] '%s' has already a child %s\n", path, fname);
+    errno = E_EXISTS;
+    ret=-1;
+    goto exit;
   }
 
   LOG(3, "[i] parent inode: %x\n", parent);
@@ -548,26 +1466,24 @@ int stfs_geterrno(void) {
 
 int stfs_open(uint8_t *path, uint32_t oflag) {
   // oflag maybe: O_RDONLY O_RDWR O_WRONLY O_SYNC(caching?) O_EXCL
-  // oflags: O_APPEND O_CREAT O_TRUNC(seek)
+  // oflags: O_APPEND O_CREAT O_TRUNC(seek) O_REPLACE
 
-  // find free fdesc
-  uint32_t fd;
-  for(fd=0;fd<MAX_OPEN_FILES;fd++) {
-    if(fdesc[fd].free!=0) break;
-  }
-  if(fd>=MAX_OPEN_FILES) {
+  // find free fd and a free open file, in case it's not open already
+  uint32_t fd, i, free;
+  for(fd=0;fd<STFS_MAX_FDS && fds[fd].file<MAX_OPEN_FILES;fd++);
+  for(free=0;free<MAX_OPEN_FILES && files[free].refs>0;free++);
+  if(fd>=STFS_MAX_FDS || (oflag!=0 && free>=MAX_OPEN_FILES)) {
     // fail no free file descriptors available
     errno = E_NOFDS;
     return -1;
   }
 
-  memset(&fdesc[fd], 0xff, sizeof(STFS_File));
-
+  uint32_t b=0, c=0;
+  const Chunk *inode;
   if(oflag == O_CREAT) {
     // create file
 
     // check if file doesn't exist
-    uint32_t b=0, c=0;
     const uint32_t self=oid_by_path(path, &b, &c);
     if(self!=0) {
       LOG(1, "[x] path already exists '%s'\n", path);
@@ -576,38 +1492,28 @@ int stfs_open(uint8_t *path, uint32_t oflag) {
       return -1;
     }
 
-    if(create_obj(path, &fdesc[fd].ichunk)==-1) {
+    Chunk chunk;
+    memset(&chunk,0xff,sizeof(chunk));
+    if(create_obj(path, &chunk)==-1) {
       // fail
       LOG(1, "[x] create obj failed\n");
       return -1;
     }
-    uint32_t i;
-    for(i=0;i<MAX_OPEN_FILES;i++) {
-      if(i==fd ||fdesc[i].free!=0) continue;
-      if(fdesc[i].ichunk.inode.name_len == fdesc[fd].ichunk.inode.name_len &&
-         fdesc[i].ichunk.inode.parent == fdesc[fd].ichunk.inode.parent &&
-         memcmp(fdesc[i].ichunk.inode.name, fdesc[fd].ichunk.inode.name, fdesc[fd].ichunk.inode.name_len)==0) {
-        LOG(1, "[x] double open\n");
-        errno = E_FDREOPEN;
-        return -1;
-      }
-    }
-
-    fdesc[fd].idirty=1;
-    fdesc[fd].free=0;
-    fdesc[fd].fptr=0;
-    fdesc[fd].ichunk.type=Inode;
-    fdesc[fd].ichunk.inode.type=File;
-    fdesc[fd].ichunk.inode.size=0;
-    fdesc[fd].ichunk.inode.oid=new_oid();
+    chunk.type=Inode;
+    chunk.inode.type=File;
+    chunk.inode.legacy=0;
+    inode_set_size(&chunk.inode, 0);
+    chunk.inode.oid=new_oid();
 
-    if(store_chunk(&fdesc[fd].ichunk)==-1) {
+    if(store_chunk(&chunk)==-1) {
+      return -1;
+    }
+    if((inode=inode_by_oid(chunk.inode.oid))==NULL) {
+      // fail, just stored
+      errno = E_NOCHUNK;
       return -1;
     }
-
-    return fd;
   } else if(oflag == 0) {
-    uint32_t b=0, c=0;
     const uint32_t self=oid_by_path(path, &b, &c);
     if(self==0) {
       LOG(1, "[x] path not found '%s'\n", path);
@@ -620,35 +1526,200 @@ int stfs_open(uint8_t *path, uint32_t oflag) {
       // fail no such file
       return -1;
     }
-    fdesc[fd].idirty=0;
-    fdesc[fd].free=0;
-    fdesc[fd].fptr=0;
-    memcpy(&fdesc[fd].ichunk, &blocks[b][c], sizeof(Chunk));
+    inode=&blocks[b][c];
+  } else if(oflag == O_REPLACE) {
+    // the new contents get a new oid, whose inode only exists in RAM
+    // until stfs_close switches the path over to it
+    const uint32_t self=oid_by_path(path, &b, &c);
+    if(self==1 || (self!=0 && blocks[b][c].inode.type!=File)) {
+      LOG(1, "[x] cannot replace directory '%s'\n", path);
+      errno = E_WRONGOBJ;
+      return -1;
+    }
+    uint32_t d;
+    for(d=0;d<STFS_DIRTY_FILES && dirty[d].type!=Empty;d++);
+    if(d>=STFS_DIRTY_FILES || rtail.file!=0xff) {
+      // fail, too many files being written
+      errno = E_NOFDS;
+      return -1;
+    }
+    Chunk chunk;
+    memset(&chunk,0xff,sizeof(chunk));
+    if(self!=0) {
+      memcpy(&chunk, &blocks[b][c], sizeof(chunk));
+    } else if(create_obj(path, &chunk)==-1) {
+      // fail
+      LOG(1, "[x] create obj failed\n");
+      return -1;
+    }
+    chunk.type=Inode;
+    chunk.inode.type=File;
+    chunk.inode.legacy=0;
+    chunk.inode.codec=STFS_PLAIN;
+    inode_set_size(&chunk.inode, 0);
+    chunk.inode.oid=new_oid();
+    memcpy(&dirty[d], &chunk, sizeof(chunk));
+
+    i=free;
+    files[i].idirty=1;
+    files[i].replacing=1;
+    files[i].oid=chunk.inode.oid;
+    files[i].ichunk=&dirty[d];
+    memset(files[i].chunkmap, 0xff, sizeof(files[i].chunkmap));
+    rtail.file=i;
+    files[i].refs++;
+    fds[fd].file=i;
+    fds[fd].fptr=0;
     return fd;
+  } else {
+    return -1;
   }
-  return -1;
+
+  // an open file is shared by its fds
+  for(i=0;i<MAX_OPEN_FILES && (files[i].refs==0 || files[i].oid!=inode->inode.oid);i++);
+  if(i>=MAX_OPEN_FILES) {
+    if(free>=MAX_OPEN_FILES) {
+      // fail no free open files available
+      errno = E_NOFDS;
+      return -1;
+    }
+    i=free;
+    files[i].idirty=0;
+    files[i].replacing=0;
+    files[i].oid=inode->inode.oid;
+    files[i].ichunk=inode;
+    map_build(&files[i]);
+  }
+  files[i].refs++;
+  fds[fd].file=i;
+  fds[fd].fptr=0;
+  return fd;
+}
+
+// reads nbyte of the stored data of f from fptr on, returns 0 on success
+static int read_stored(const STFS_File *f, const uint32_t fptr, uint8_t *buf, const uint32_t nbyte) {
+  uint32_t read, b, c;
+  // one lookup per extent
+  for(read=0;read<nbyte && !f->ichunk->inode.legacy;) {
+    const uint32_t off=(fptr+read)%EXTENT_SIZE;
+    const uint32_t len=(nbyte-read>EXTENT_SIZE-off)?EXTENT_SIZE-off:nbyte-read;
+    Chunk *ext=(Chunk*) find_data(f, (fptr+read)/EXTENT_SIZE, &b, &c);
+    if(ext==NULL || extent_copy(ext, off, buf+read, NULL, len)!=0) {
+      errno = E_NOCHUNK;
+      return -1;
+    }
+    read+=len;
+  }
+  for(;read<nbyte;) {
+    uint32_t seq;
+    const Chunk *chunk;
+    seq=(fptr+read)/DATA_PER_CHUNK;
+    if((chunk=find_data(f, seq, &b, &c))!=NULL) {
+      uint32_t coff=(fptr+read)%DATA_PER_CHUNK;
+      memcpy(buf+read, chunk->data.data+coff, ((nbyte-read>DATA_PER_CHUNK)?(DATA_PER_CHUNK-coff):(nbyte-read)));
+      read+=((nbyte-read>(DATA_PER_CHUNK-coff))?(DATA_PER_CHUNK-coff):(nbyte-read));
+    } else {
+      errno = E_NOCHUNK;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// size of the contents of f, for compressed files from the lzg header
+static uint32_t file_size(const STFS_File *f) {
+  uint8_t hdr[7];
+  if(!COMPRESSED(&f->ichunk->inode)) return inode_size(&f->ichunk->inode);
+  if(inode_size(&f->ichunk->inode)<sizeof(hdr) || read_stored(f, 0, hdr, sizeof(hdr))!=0) return 0;
+  return LZG_DecodedSize(hdr, sizeof(hdr));
 }
 
 off_t stfs_lseek(uint32_t fildes, off_t offset, int whence) {
   VALIDFD(fildes);
-  uint32_t newfptr=fdesc[fildes].fptr;
+  const STFS_File *f=fd_file(fildes);
+  if(f==NULL) return -1;
+  uint32_t newfptr=fds[fildes].fptr;
   switch(whence) {
   case(SEEK_SET): {newfptr=offset; break;}
   case(SEEK_CUR): {newfptr+=offset; break;}
-  case(SEEK_END): {newfptr=fdesc[fildes].ichunk.inode.size+offset; break;}}
-  if(newfptr>fdesc[fildes].ichunk.inode.size) {
+  case(SEEK_END): {newfptr=file_size(f)+offset; break;}}
+  if(newfptr>file_size(f)) {
     // fail seek beyond eof
     LOG(1, "[x] cannot seek beyond eof set\n");
     errno = E_NOSEEKEOF;
     return -1;
   }
-  fdesc[fildes].fptr=newfptr;
+  fds[fildes].fptr=newfptr;
   return newfptr;
 }
 
 uint32_t stfs_size(uint32_t fildes) {
   VALIDFD(fildes);
-  return fdesc[fildes].ichunk.inode.size;
+  const STFS_File *f=fd_file(fildes);
+  if(f==NULL) return -1;
+  return file_size(f);
+}
+
+/* writes nbyte at fptr of f, which must not be beyond eof, extent
+   by extent. an extent is rewritten in place if that only needs to
+   clear bits, like when appending to its erased tail. otherwise the
+   old one is deleted before storing the new one, so that a full store
+   can be vacuumed. returns the number of bytes written. */
+static uint32_t write_extents(STFS_File *f, const uint32_t fptr, const uint8_t *buf, const uint32_t nbyte) {
+  Chunk chunks[STFS_EXTENT_CHUNKS];
+  const uint32_t size=inode_size(&f->ichunk->inode);
+  uint32_t written, b, c, i;
+  for(written=0;written<nbyte;) {
+    const uint32_t seq=(fptr+written)/EXTENT_SIZE, from=(fptr+written)%EXTENT_SIZE;
+    const uint32_t to=(nbyte-written>EXTENT_SIZE-from)?EXTENT_SIZE:from+nbyte-written;
+    uint32_t oldlen=0;
+    Chunk *old=NULL;
+    if(seq*EXTENT_SIZE<size) {
+      oldlen=(size-seq*EXTENT_SIZE>EXTENT_SIZE)?EXTENT_SIZE:size-seq*EXTENT_SIZE;
+      old=(Chunk*) find_data(f, seq, &b, &c);
+    }
+    const uint32_t n=extent_build(chunks, f->oid, seq, old, oldlen, buf+written, from, to);
+    if(old && old->extent.count==n-1) {
+      // can we update the extent, or have to del,create a new one?
+      const uint8_t *dst=(const uint8_t*) (old-(n-1)), *src=(const uint8_t*) chunks;
+      for(i=0;i<n*sizeof(Chunk) && (dst[i]&src[i])==src[i];i++);
+      if(i==n*sizeof(Chunk)) {
+        write_chunks(old-(n-1), chunks, n);
+        old=NULL;
+        written+=to-from;
+        continue;
+      }
+    }
+    if(old) del_chunk(b, c);
+    if(store_chunks(chunks, n, 1)==-1) {
+      // fail to store chunks
+      LOG(1, "failed to store extent\n");
+      break;
+    }
+    written+=to-from;
+  }
+  return written;
+}
+
+// appends to the file being replaced through rtail, see O_REPLACE
+static uint32_t write_staged(STFS_File *f, const uint32_t fptr, const uint8_t *buf, const uint32_t nbyte) {
+  Chunk chunks[STFS_EXTENT_CHUNKS];
+  uint32_t written;
+  for(written=0;written<nbyte;) {
+    const uint32_t seq=(fptr+written)/EXTENT_SIZE, from=(fptr+written)%EXTENT_SIZE;
+    const uint32_t to=(nbyte-written>EXTENT_SIZE-from)?EXTENT_SIZE:from+nbyte-written;
+    memcpy(rtail.buf+from, buf+written, to-from);
+    if(to==EXTENT_SIZE) {
+      const uint32_t n=extent_build(chunks, f->oid, seq, NULL, 0, rtail.buf, 0, EXTENT_SIZE);
+      if(store_chunks(chunks, n, 1)==-1) {
+        // fail to store chunks
+        LOG(1, "failed to store extent\n");
+        break;
+      }
+    }
+    written+=to-from;
+  }
+  return written;
 }
 
 ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte) {
@@ -658,14 +1729,25 @@ ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte) {
   if(nbyte<1) return 0;
   if(buf==NULL) return 0;
   VALIDFD(fildes)
-  if(fdesc[fildes].fptr+nbyte>MAX_FILE_SIZE) {
+  STFS_File *f=fd_file(fildes);
+  if(f==NULL) return -1;
+  const uint32_t fptr=fds[fildes].fptr;
+  if(COMPRESSED(&f->ichunk->inode)) {
+    // fail, only stfs_creplace writes compressed files
+    LOG(1, "[x] cannot write compressed file\n");
+    errno = E_WRONGOBJ;
+    return -1;
+  }
+  const uint32_t max=f->ichunk->inode.legacy?MAX_LEGACY_FILE_SIZE:MAX_FILE_SIZE;
+  if(fptr+nbyte>max) {
     // fail too big
-    LOG(1, "[x] too big, %d\n", fdesc[fildes].fptr+nbyte);
+    LOG(1, "[x] too big, %d\n", fptr+nbyte);
     errno = E_TOOBIG;
-    nbyte=MAX_FILE_SIZE-fdesc[fildes].fptr;
+    nbyte=max-fptr;
+    if(f->replacing) f->replacing=2;
   }
 
-  if(fdesc[fildes].fptr>fdesc[fildes].ichunk.inode.size) {
+  if(fptr>inode_size(&f->ichunk->inode)) {
     // due to lseek pointing behind eof there would be holes if we
     // write to this position.
     LOG(1, "[i] todo 0xff extend then append existing data\n");
@@ -673,25 +1755,42 @@ ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte) {
     errno = E_INVFP;
     return -1;
   }
+  if(f->replacing && fptr<inode_size(&f->ichunk->inode)) {
+    // fail, a file being replaced is only appended to
+    LOG(1, "[x] cannot overwrite file being replaced\n");
+    errno = E_INVFP;
+    f->replacing=2;
+    return -1;
+  }
+  // growing the file changes its inode
+  if(fptr+nbyte>inode_size(&f->ichunk->inode) && file_inode(f)==NULL) {
+    return -1;
+  }
 
   uint32_t written=0;
-  if(fdesc[fildes].fptr<=fdesc[fildes].ichunk.inode.size) {
+  if(f->replacing) {
+    written=write_staged(f, fptr, buf, nbyte);
+  } else if(!f->ichunk->inode.legacy) {
+    written=write_extents(f, fptr, buf, nbyte);
+  } else if(fptr<=f->ichunk->inode.size) {
     // append to end of file
     uint32_t b,c;
     Chunk chunk;
-    if(fdesc[fildes].fptr<fdesc[fildes].ichunk.inode.size) {
+    // new chunks are collected to be programmed together
+    Chunk staged[STFS_WRITE_BATCH];
+    uint32_t nstaged=0, unstaged=0;
+    if(fptr<f->ichunk->inode.size) {
       // we are overwriting some chunks, delete them all
       // this is most important for the case that the fs is full
       // then every chunk overwrite would trigger a full vacuum
-      uint32_t startseq=(fdesc[fildes].fptr)/DATA_PER_CHUNK;
-      uint32_t endseq=(fdesc[fildes].fptr+nbyte-1)/DATA_PER_CHUNK;
-      if(endseq>fdesc[fildes].ichunk.inode.size/DATA_PER_CHUNK)
-        endseq = fdesc[fildes].ichunk.inode.size/DATA_PER_CHUNK;
+      uint32_t startseq=(fptr)/DATA_PER_CHUNK;
+      uint32_t endseq=(fptr+nbyte-1)/DATA_PER_CHUNK;
+      if(endseq>f->ichunk->inode.size/DATA_PER_CHUNK)
+        endseq = f->ichunk->inode.size/DATA_PER_CHUNK;
       LOG(1,"[.] %d %d\n",startseq, endseq);
       uint32_t i;
       for(i=startseq;i<endseq;i++) {
-        b=c=0;
-        if(find_chunk(Data, fdesc[fildes].ichunk.inode.oid, 0, i, &b, &c)==NULL) {
+        if(find_data(f, i, &b, &c)==NULL) {
           continue;
           // fail, couldn't find chunk
           //LOG(1, "[x] couldn't find chunk to overwrite: %d\n", i);
@@ -708,18 +1807,17 @@ ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte) {
     for(written=0;written<nbyte;) {
       memset(&chunk,0xff,sizeof(chunk));
       chunk.type=Data;
-      chunk.data.oid=fdesc[fildes].ichunk.inode.oid;
-      chunk.data.seq=(fdesc[fildes].fptr+written)/DATA_PER_CHUNK;
+      chunk.data.oid=f->ichunk->inode.oid;
+      chunk.data.seq=(fptr+written)/DATA_PER_CHUNK;
 
       LOG(3,"[i] writing chunk %d\n", chunk.data.seq);
-      b=c=0;
-      const uint32_t towrite=((nbyte-written>DATA_PER_CHUNK-(fdesc[fildes].fptr+written)%DATA_PER_CHUNK)?
-                         DATA_PER_CHUNK-((fdesc[fildes].fptr+written)%DATA_PER_CHUNK):
+      const uint32_t towrite=((nbyte-written>DATA_PER_CHUNK-(fptr+written)%DATA_PER_CHUNK)?
+                         DATA_PER_CHUNK-((fptr+written)%DATA_PER_CHUNK):
                          (nbyte-written));
-      if(find_chunk(Data, chunk.data.oid, 0, chunk.data.seq, &b, &c)!=NULL) {
+      if(find_data(f, chunk.data.seq, &b, &c)!=NULL) {
         // found chunk, check if write is necessary, if so partial, or full?
         memcpy(chunk.data.data, &blocks[b][c].data.data, DATA_PER_CHUNK);
-        memcpy(chunk.data.data+((fdesc[fildes].fptr+written)%DATA_PER_CHUNK), ((uint8_t*) buf)+written,towrite);
+        memcpy(chunk.data.data+((fptr+written)%DATA_PER_CHUNK), ((uint8_t*) buf)+written,towrite);
         uint32_t i;
         // can we update the chunk, or have to del,create a new one?
         for(i=0;i<sizeof(Chunk);i++) {
@@ -730,11 +1828,8 @@ ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte) {
         if(i<sizeof(Chunk)) { // we have to create a new chunk
           del_chunk(b, c);
           //dump_chunk(&chunk);
-          if(store_chunk(&chunk)==-1) {
-            // fail to store chunk
-            LOG(1, "failed to store chunk\n");
-            goto exit;
-          }
+          if(nstaged==0) unstaged=written;
+          memcpy(&staged[nstaged++], &chunk, sizeof(chunk));
         } else { // we can update the chunk \o/
           //dump_chunk(&chunk);
           write_chunk(&blocks[b][c], &chunk, sizeof(chunk));
@@ -744,26 +1839,31 @@ ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte) {
         // prepare chunk for writing
         memcpy(chunk.data.data, ((uint8_t*) buf)+written, (nbyte-written>DATA_PER_CHUNK)?DATA_PER_CHUNK:(nbyte-written));
         //dump_chunk(&chunk);
-        if(store_chunk(&chunk)==-1) {
-          // fail to store chunk
+        if(nstaged==0) unstaged=written;
+        memcpy(&staged[nstaged++], &chunk, sizeof(chunk));
+        written+=(nbyte-written>DATA_PER_CHUNK)?DATA_PER_CHUNK:(nbyte-written);
+      }
+      if(nstaged==STFS_WRITE_BATCH || (nstaged>0 && written>=nbyte)) {
+        if(store_chunks(staged, nstaged, 0)==-1) {
+          // fail to store chunks
           LOG(1, "failed to store chunk\n");
+          written=unstaged;
           goto exit;
         }
-        written+=(nbyte-written>DATA_PER_CHUNK)?DATA_PER_CHUNK:(nbyte-written);
+        nstaged=0;
       }
     }
   }
  exit:
+  // a replacement missing some of its contents must not be switched to
+  if(written<nbyte && f->replacing) f->replacing=2;
   // update inode
-  if(written+fdesc[fildes].fptr>fdesc[fildes].ichunk.inode.size) {
+  if(written+fptr>inode_size(&f->ichunk->inode)) {
     // file grows update inode
-    fdesc[fildes].ichunk.inode.size=written+fdesc[fildes].fptr;
-  }
-  if(written>0) {
-    fdesc[fildes].idirty=1;
+    inode_set_size(file_inode(f), written+fptr);
   }
 
-  fdesc[fildes].fptr+=written;
+  fds[fildes].fptr+=written;
 
   return written;
 }
@@ -772,99 +1872,224 @@ ssize_t stfs_read(uint32_t fildes, void *buf, size_t nbyte) {
   if(nbyte<1) return 0;
   if(buf==NULL) return 0;
   VALIDFD(fildes)
-  uint32_t read=0;
-  uint32_t b,c;
-  if(nbyte+fdesc[fildes].fptr>fdesc[fildes].ichunk.inode.size) {
+  const STFS_File *f=fd_file(fildes);
+  if(f==NULL) return -1;
+  const uint32_t fptr=fds[fildes].fptr;
+  const uint32_t size=file_size(f);
+  if(nbyte+fptr>size) {
     // read only as much there is available, not beyond eof
-    nbyte=fdesc[fildes].ichunk.inode.size-fdesc[fildes].fptr;
-    LOG(3, "[i] changed nbyte to %d, size is %d\n",nbyte, fdesc[fildes].ichunk.inode.size);
+    nbyte=size-fptr;
+    LOG(3, "[i] changed nbyte to %d, size is %d\n",nbyte, size);
   }
-  for(read=0;read<nbyte;) {
-    uint32_t seq;
-    const Chunk *chunk;
-    seq=(fdesc[fildes].fptr+read)/DATA_PER_CHUNK;
-    b=c=0;
-    const uint32_t oid=fdesc[fildes].ichunk.inode.oid;
-    if((chunk=find_chunk(Data, oid, 0, seq, &b, &c))!=NULL) {
-      uint32_t coff=(fdesc[fildes].fptr+read)%DATA_PER_CHUNK;
-      memcpy(((uint8_t*) buf)+read, chunk->data.data+coff, ((nbyte-read>DATA_PER_CHUNK)?(DATA_PER_CHUNK-coff):(nbyte-read)));
-      read+=((nbyte-read>(DATA_PER_CHUNK-coff))?(DATA_PER_CHUNK-coff):(nbyte-read));
-    } else {
-      errno = E_NOCHUNK;
+  if(nbyte<1) return 0;
+  if(f->replacing) {
+    // fail, the tail is only in rtail until closed
+    errno = E_WRONGOBJ;
+    return -1;
+  }
+  if(COMPRESSED(&f->ichunk->inode)) {
+    // the whole stream is decoded for any part of it
+    uint8_t lzg[STFS_LZG_MAX], plain[STFS_LZG_MAX];
+    const uint32_t lsize=inode_size(&f->ichunk->inode);
+    if(lsize>sizeof(lzg) || size>sizeof(plain) ||
+       read_stored(f, 0, lzg, lsize)!=0 ||
+       LZG_Decode(lzg, lsize, plain, size)!=size) {
+      LOG(1, "[x] corrupt lzg stream\n");
+      errno = E_BADCHUNK;
       return -1;
     }
+    memcpy(buf, plain+fptr, nbyte);
+  } else if(read_stored(f, fptr, buf, nbyte)!=0) {
+    return -1;
   }
-  fdesc[fildes].fptr+=read;
-  return read;
+  fds[fildes].fptr+=nbyte;
+  return nbyte;
 }
 
-static void del_chunks(uint32_t oid) {
-  uint32_t b=0,c=0, n=0;
-  const Chunk *chunk=find_chunk(Data, oid, 0, 0xffff, &b, &c);
-  while(chunk) {
-    del_chunk(b, c);
-    b=c=0;
-    chunk=find_chunk(Data, oid, 0,0xffff, &b, &c);
-    n++;
+/* zero copy read: returns where the bytes at the fptr of fildes are in
+   the flash, how many follow there in len (at most a chunk's payload),
+   and moves the fptr past them. so a file is read segment by segment
+   without copying it, until NULL is returned at eof or on errors. the
+   pointers are valid until the store is changed. compressed files
+   can't be mapped. */
+const uint8_t* stfs_map(uint32_t fildes, uint32_t *len) {
+  *len=0;
+  if(validfd(fildes)!=0) return NULL;
+  const STFS_File *f=fd_file(fildes);
+  if(f==NULL) return NULL;
+  if(COMPRESSED(&f->ichunk->inode) || f->replacing) {
+    // fail, stored bytes aren't the contents
+    errno = E_WRONGOBJ;
+    return NULL;
+  }
+  const uint32_t fptr=fds[fildes].fptr, size=inode_size(&f->ichunk->inode);
+  if(fptr>=size) return NULL;
+  uint32_t b, c, avail;
+  const uint8_t *ptr;
+  if(!f->ichunk->inode.legacy) {
+    Chunk *ext=(Chunk*) find_data(f, fptr/EXTENT_SIZE, &b, &c);
+    ptr=(ext==NULL)?NULL:extent_at(ext, fptr%EXTENT_SIZE, &avail);
+  } else {
+    const Chunk *chunk=find_data(f, fptr/DATA_PER_CHUNK, &b, &c);
+    ptr=(chunk==NULL)?NULL:chunk->data.data+fptr%DATA_PER_CHUNK;
+    avail=DATA_PER_CHUNK-fptr%DATA_PER_CHUNK;
+  }
+  if(ptr==NULL) {
+    errno = E_NOCHUNK;
+    return NULL;
+  }
+  if(avail>size-fptr) avail=size-fptr;
+  fds[fildes].fptr+=avail;
+  *len=avail;
+  return ptr;
+}
+
+// deletes the data or extent chunks of oid from seq on, in one pass
+static void del_chunks(const uint32_t oid, const uint32_t seq) {
+  uint32_t b, c, n=0;
+  for(b=0;b<NBLOCKS;b++) {
+    if(RESERVED(b)) continue;
+    for(c=0;c<bstat[b].next;c++) {
+      const Chunk *chunk=&blocks[b][c];
+      STAT(touched, 1);
+      if((chunk->type==Data || chunk->type==Extent) &&
+         chunk_oid(chunk)==oid && chunk_seq(chunk)>=seq) {
+        del_chunk(b, c);
+        n++;
+      }
+    }
   }
   LOG(3,"[i] deleted %d chunks from oid %x\n",n, oid);
 }
 
+/* the second half of stfs_replace: deletes all chunks of the replaced
+   oid in one pass over the flash, then clears the replaces field of the
+   inode of oid, only a single word to program. */
+static void replace_done(const uint32_t oid, const uint32_t replaced) {
+  uint32_t b, c, nb=NBLOCKS, nc=0;
+  for(b=0;b<NBLOCKS;b++) {
+    if(RESERVED(b)) continue;
+    for(c=0;c<bstat[b].next;c++) {
+      const Chunk *chunk=&blocks[b][c];
+      STAT(touched, 1);
+      if(chunk_oid(chunk)==replaced) {
+        del_chunk(b, c);
+      } else if(chunk->type==Inode && chunk->inode.oid==oid) {
+        nb=b;
+        nc=c;
+      }
+    }
+  }
+  if(nb>=NBLOCKS) return;
+  Chunk chunk;
+  memcpy(&chunk, &blocks[nb][nc], sizeof(chunk));
+  chunk.inode.replaces=0;
+  write_chunk(&blocks[nb][nc], &chunk, sizeof(chunk));
+}
+
 int stfs_close(uint32_t fildes) {
   VALIDFD(fildes)
+  STFS_File *f=&files[fds[fildes].file];
+  fds[fildes].file=0xff;
+  // the last fd of the file stores its inode
+  if(--f->refs>0) return 0;
 
-  if(fdesc[fildes].idirty!=0) {
+  int ret=0;
+  if(f->replacing==2) {
+    // fail, a write failed, the old contents stay
+    del_chunks(f->oid, 0);
+    errno = E_SHORTWRT;
+    ret=-1;
+    goto exit;
+  }
+  if(f->idirty!=0) {
     // check if path is valid
     uint32_t b=0,c=0;
     const Chunk *chunk;
-    if(fdesc[fildes].ichunk.inode.parent!=1) {
-      chunk=find_chunk(Inode, fdesc[fildes].ichunk.inode.parent, 0,0, &b, &c);
+    if(f->ichunk->inode.parent!=1) {
+      chunk=find_chunk(Inode, f->ichunk->inode.parent, 0,0, &b, &c);
       while(chunk && chunk->inode.parent!=1) {
         b=c=0;
         chunk=find_chunk(Inode, chunk->inode.parent, 0,0, &b, &c);
       }
       if(!chunk) {
         LOG(1, "[x] null chunk while resolving path\n");
-        del_chunks(fdesc[fildes].ichunk.inode.oid);
+        del_chunks(f->ichunk->inode.oid, 0);
         errno = E_DANGLE;
-        return -1;
+        ret=-1;
+        goto exit;
       }
       if(chunk->inode.type!=0) {
         LOG(1, "[x] invalid path\n");
-        del_chunks(fdesc[fildes].ichunk.inode.oid);
+        del_chunks(f->ichunk->inode.oid, 0);
         errno = E_DANGLE;
-        return -1;
+        ret=-1;
+        goto exit;
       }
       if(chunk->inode.parent!=1) {
         LOG(1, "[x] while resolving path\n");
-        del_chunks(fdesc[fildes].ichunk.inode.oid);
+        del_chunks(f->ichunk->inode.oid, 0);
         errno = E_DANGLE;
-        return -1;
+        ret=-1;
+        goto exit;
       }
     }
+    if(f->replacing) {
+      // like stfs_replace, the inode switches over to the new contents,
+      // whatever is at the path by now is what gets replaced
+      uint8_t fname[sizeof(f->ichunk->inode.name)+1];
+      Inode_t *inode=file_inode(f);
+      memcpy(fname, inode->name, inode->name_len);
+      fname[inode->name_len]=0;
+      b=c=0;
+      chunk=find_inode_by_parent_fname(inode->parent, fname, &b, &c);
+      if(chunk!=NULL && chunk->inode.type!=File) {
+        LOG(1, "[x] cannot replace directory '%s'\n", fname);
+        del_chunks(f->oid, 0);
+        errno = E_WRONGOBJ;
+        ret=-1;
+        goto exit;
+      }
+      const uint32_t old=(chunk!=NULL)?chunk->inode.oid:0, size=inode_size(inode);
+      inode->replaces=old;
+      Chunk chunks[STFS_EXTENT_CHUNKS];
+      const uint32_t n=extent_build(chunks, f->oid, size/EXTENT_SIZE, NULL, 0, rtail.buf, 0, size%EXTENT_SIZE);
+      if((size%EXTENT_SIZE>0 && store_chunks(chunks, n, 1)==-1) ||
+         store_chunk((Chunk*) f->ichunk)==-1) {
+        // fail to store chunk, drop the new contents
+        LOG(1, "failed to store chunk\n");
+        del_chunks(f->oid, 0);
+        ret=-1;
+        goto exit;
+      }
+      if(old!=0) replace_done(f->oid, old);
+      goto exit;
+    }
     // need to update inode chunk
     //LOG(3, "[i] tentatively updating inode\n");
     b=c=0;
-    chunk=find_chunk(Inode, fdesc[fildes].ichunk.inode.oid, 0,0, &b, &c);
+    chunk=find_chunk(Inode, f->ichunk->inode.oid, 0,0, &b, &c);
     if(chunk==NULL || chunk->inode.type!=File) { // if inode is dir, then file
                                                  // has been unlinked and a dir instead created
                                                  // between open and close
       // inode has been deleted, also delete all chunks
-      del_chunks(fdesc[fildes].ichunk.inode.oid);
-    } else if(memcmp(chunk,&fdesc[fildes].ichunk, sizeof(*chunk))!=0) {
+      del_chunks(f->ichunk->inode.oid, 0);
+    } else if(memcmp(chunk,f->ichunk, sizeof(*chunk))!=0) {
       // invalidate old chunk
       LOG(3, "[i] deleting old inode at %d %d\n", b, c);
       del_chunk(b, c);
       // write new chunk
-      store_chunk(&fdesc[fildes].ichunk);
+      store_chunk((Chunk*) f->ichunk);
     }
   }
 
-  fdesc[fildes].free=1;
-  fdesc[fildes].idirty=0;
-  fdesc[fildes].fptr=0;
-
-  return 0;
+ exit:
+  if(f->idirty) ((Chunk*) f->ichunk)->type=Empty;
+  if(f->replacing) rtail.file=0xff;
+  f->idirty=0;
+  f->replacing=0;
+  f->ichunk=NULL;
+  return ret;
 }
 
 int stfs_unlink(uint8_t *path) {
@@ -897,12 +2122,7 @@ int stfs_unlink(uint8_t *path) {
   del_chunk(b, c);
 
   // del data chunks
-  const Chunk*chunk;
-  b=c=0;
-  while((chunk=find_chunk(Data, oid, 0, 0xffff, &b, &c))!=NULL) {
-    LOG(3, "[i] deleting data chunk %d %d\n", b,c);
-    del_chunk(b, c);
-  }
+  del_chunks(oid, 0);
   return 0;
 }
 
@@ -929,28 +2149,55 @@ int stfs_truncate(uint8_t *path, uint32_t length) {
     errno = E_WRONGOBJ;
     return -1;
   }
-  if(blocks[b][c].inode.size<length) {
+  if(COMPRESSED(&blocks[b][c].inode)) {
+    // fail, only stfs_creplace writes compressed files
+    LOG(1, "[x] cannot truncate compressed file '%s'\n", path);
+    errno = E_WRONGOBJ;
+    return -1;
+  }
+  if(inode_size(&blocks[b][c].inode)<length) {
     // fail
     LOG(1, "[x] path '%s' is too short\n", path);
     errno = E_NOEXT;
     return -1;
   }
 
-  // store new inode
   Chunk nchunk;
   memcpy(&nchunk, &blocks[b][c], sizeof(Chunk));
-  nchunk.inode.size=length;
-  store_chunk(&nchunk);
-
-  uint32_t oid=blocks[b][c].inode.oid;
+  inode_set_size(&nchunk.inode, length);
+  const uint32_t oid=nchunk.inode.oid;
 
-  // del inode chunk
+  // del inode chunk, before storing the new one which might vacuum it
   LOG(3, "[i] deleting inode chunk %d %d\n", b,c);
   del_chunk(b, c);
+  // store new inode
+  store_chunk(&nchunk);
 
-  // del data chunks
   const Chunk*chunk;
-  uint32_t seq=length/DATA_PER_CHUNK;
+  uint32_t seq;
+  if(!nchunk.inode.legacy) {
+    // the extent the file now ends in is rebuilt without the rest
+    seq=length/EXTENT_SIZE;
+    if(length%EXTENT_SIZE>0) {
+      Chunk chunks[STFS_EXTENT_CHUNKS];
+      b=c=0;
+      Chunk *old=(Chunk*) find_chunk(Extent, oid, 0, seq, &b, &c);
+      if(old==NULL) {
+        LOG(1, "[x] no extent to truncate from found\n");
+        errno = E_NOCHUNK;
+        return -1;
+      }
+      const uint32_t n=extent_build(chunks, oid, seq, old, length%EXTENT_SIZE, NULL, 0, 0);
+      del_chunk(b, c);
+      if(store_chunks(chunks, n, 1)==-1) return -1;
+      seq++;
+    }
+    del_chunks(oid, seq);
+    return 0;
+  }
+
+  // del data chunks
+  seq=length/DATA_PER_CHUNK;
   if(length%DATA_PER_CHUNK>0) {
     Chunk dchunk;
     b=c=0;
@@ -973,36 +2220,260 @@ int stfs_truncate(uint8_t *path, uint32_t length) {
   return 0;
 }
 
-int stfs_init() {
-  // check if at least one block is empty for migration
-  uint32_t b, free, rcan, i;
-  for(b=0,free=0;b<NBLOCKS;b++) {
-    if(blocks[b][0].type==Empty) free++;
+// stores buf as the contents of path with the given codec, see stfs_replace()
+static int replace(uint8_t *path, const void *buf, size_t nbyte, const uint8_t codec) {
+  if(nbyte>MAX_FILE_SIZE) {
+    // fail too big
+    LOG(1, "[x] too big, %d\n", nbyte);
+    errno = E_TOOBIG;
+    return -1;
   }
-  if(free==0) {
-    // fail no empty blocks
+  uint32_t b=0, c=0;
+  const uint32_t old=oid_by_path(path, &b, &c);
+  if(old==1 || (old!=0 && blocks[b][c].inode.type!=File)) {
+    LOG(1, "[x] cannot replace directory '%s'\n", path);
+    errno = E_WRONGOBJ;
     return -1;
   }
 
-  randombytes_buf((void *) &rcan, sizeof(rcan));
-  rcan%=free;
-  for(b=0,i=0;b<NBLOCKS;b++) {
-    if(blocks[b][0].type==Empty) {
-      if(i++==rcan) {
-        reserved_block=b;
-        break;
-      }
+  Chunk inode;
+  memset(&inode,0xff,sizeof(inode));
+  if(old==0) {
+    if(create_obj(path, &inode)==-1) {
+      // fail
+      LOG(1, "[x] create obj failed\n");
+      return -1;
+    }
+    inode.inode.replaces=0;
+  } else {
+    memcpy(&inode, &blocks[b][c], sizeof(inode));
+    inode.inode.replaces=old;
+  }
+  inode.type=Inode;
+  inode.inode.type=File;
+  inode.inode.legacy=0;
+  inode.inode.codec=codec;
+  inode_set_size(&inode.inode, nbyte);
+  inode.inode.oid=new_oid();
+
+  // the new contents, unreachable until the inode is written
+  Chunk chunks[STFS_EXTENT_CHUNKS];
+  uint32_t seq;
+  for(seq=0;seq*EXTENT_SIZE<nbyte;seq++) {
+    const uint32_t len=(nbyte-seq*EXTENT_SIZE>EXTENT_SIZE)?EXTENT_SIZE:nbyte-seq*EXTENT_SIZE;
+    const uint32_t n=extent_build(chunks, inode.inode.oid, seq, NULL, 0,
+                                  ((const uint8_t*) buf)+seq*EXTENT_SIZE, 0, len);
+    if(store_chunks(chunks, n, 1)==-1) {
+      // fail to store chunks, drop what has been written
+      LOG(1, "failed to store extent\n");
+      replace_done(0, inode.inode.oid);
+      return -1;
     }
   }
-  if(b>=NBLOCKS) {
-    // fail no empty blocks
+  if(store_chunk(&inode)==-1) {
+    // fail to store chunk
+    LOG(1, "failed to store chunk\n");
+    replace_done(0, inode.inode.oid);
     return -1;
   }
-  memset(fdesc,0xff,sizeof(fdesc));
+  if(old!=0) replace_done(inode.inode.oid, old);
+  return 0;
+}
+
+/* writes buf as the new contents of the file at path, creating it if
+   needed, legacy files are turned into extent ones. unlike overwriting
+   it with stfs_write this is atomic: the data goes to a new oid, and
+   the single chunk switching over to it is the new inode, which names
+   the oid it replaces. a reset before that leaves the old contents,
+   after it stfs_init deletes them. */
+int stfs_replace(uint8_t *path, const void *buf, size_t nbyte) {
+  return replace(path, buf, nbyte, STFS_PLAIN);
+}
+
+/* like stfs_replace, but stores the contents lzg compressed if that
+   takes fewer bytes, which it does for text like peer names or configs,
+   but never for encrypted data. the file can be read, but not written
+   by stfs_write. at most STFS_LZG_MAX bytes. */
+int stfs_creplace(uint8_t *path, const void *buf, size_t nbyte) {
+  if(nbyte>STFS_LZG_MAX) {
+    // fail too big
+    LOG(1, "[x] too big to compress, %d\n", nbyte);
+    errno = E_TOOBIG;
+    return -1;
+  }
+  uint8_t lzg[STFS_LZG_MAX];
+  lzg_encoder_config_t cfg;
+  LZG_InitEncoderConfig(&cfg);
+  cfg.level=LZG_LEVEL_1; // smallest hash table on the stack
+  // fails unless it is smaller than the plain contents
+  const uint32_t lsize=(nbyte>0)?LZG_Encode(buf, nbyte, lzg, nbyte-1, &cfg):0;
+  if(lsize==0) return replace(path, buf, nbyte, STFS_PLAIN);
+  return replace(path, lzg, lsize, STFS_LZG);
+}
+
+/* repairs what resets leave behind, which would otherwise only be found
+   when used: inodes whose directory is gone, and their children, and
+   data no file owns. that is data of unlinked files or files whose
+   inode wasn't stored by stfs_close, and data beyond the size of a file
+   that was written but not closed. returns the number of chunks
+   dropped. */
+static uint32_t fsck(void) {
+  uint32_t b, c, n, dropped=0, last=0;
+  const Chunk *inode=NULL;
+  do {
+    for(n=0,b=0;b<NBLOCKS;b++) {
+      if(RESERVED(b)) continue;
+      for(c=0;c<bstat[b].next;c++) {
+        if(blocks[b][c].type!=Inode || blocks[b][c].inode.parent==1) continue;
+        STAT(touched, 1);
+        const Chunk *parent=inode_by_oid(blocks[b][c].inode.parent);
+        if(parent!=NULL && parent->inode.type==Directory) continue;
+        LOG(1, "[i] dropping orphaned inode %x\n", blocks[b][c].inode.oid);
+        del_chunk(b, c);
+        n++;
+      }
+    }
+    dropped+=n;
+    // the children of dropped directories are orphans now
+  } while(n>0);
+  for(b=0;b<NBLOCKS;b++) {
+    if(RESERVED(b)) continue;
+    for(c=0;c<bstat[b].next;c++) {
+      const Chunk *chunk=&blocks[b][c];
+      STAT(touched, 1);
+      if(chunk->type!=Data && chunk->type!=Extent) continue;
+      // the chunks of a file mostly come in runs
+      if(chunk_oid(chunk)!=last) {
+        last=chunk_oid(chunk);
+        inode=inode_by_oid(last);
+      }
+      const uint32_t unit=(chunk->type==Data)?DATA_PER_CHUNK:EXTENT_SIZE;
+      if(inode!=NULL && inode->inode.type==File &&
+         (inode->inode.legacy!=0)==(chunk->type==Data) &&
+         chunk_seq(chunk)*unit<inode_size(&inode->inode)) continue;
+      LOG(1, "[i] dropping orphaned data %d %d of %x\n", b, c, last);
+      del_chunk(b, c);
+      dropped++;
+    }
+  }
+  return dropped;
+}
+
+int stfs_init() {
+  uint32_t b, free, rcan, i, run;
+  memset(fds,0xff,sizeof(fds));
+  memset(files,0,sizeof(files));
+  memset(dirty,0xff,sizeof(dirty));
+  rtail.file=0xff;
+  vac.victim=-1;
+  max_latency=0;
+  ckpt=NULL;
+  idle=0;
+  if(checkpoint_load()==0) {
+    LOG(1, "[i] mounted from checkpoint\n");
+    return 0;
+  }
+  bstat_build();
+  // resume a vacuum interrupted by a reset
+  for(b=0;b<NBLOCKS;b++) {
+    const Chunk *mark=&blocks[b][HDR(b)];
+    if(mark->type==Vacuum &&
+       mark->vacuum.victim<NBLOCKS &&
+       mark->vacuum.victim!=b) {
+      LOG(1, "[i] resuming vacuum from %d to %d\n", mark->vacuum.victim, b);
+      reserved_block=b;
+      vac.victim=mark->vacuum.victim;
+      vac.mark=HDR(b);
+      vac.src=0;
+      vac.dst=bstat[b].next;
+      // a copy torn by the reset is redone in place, its chunks only
+      // hold bits of the same contents
+      while(blocks[b][vac.dst-1].type==ExtentData) vac.dst--;
+      break;
+    }
+  }
+  // blocks are written in order, so a write torn by a reset can only be
+  // at the first chunk reading as Empty, which can't be used anymore
+  for(b=0;b<NBLOCKS;b++) {
+    if(vac.victim>=0 && b==reserved_block) continue;
+    if(bstat[b].next<CHUNKS_PER_BLOCK && !chunk_erased(&blocks[b][bstat[b].next])) {
+      LOG(1, "[i] dropping torn chunk %d %d\n", b, bstat[b].next);
+      mark_deleted(b, bstat[b].next);
+    }
+  }
+  // extent data chunks without their extent chunk after them were being
+  // written or deleted when a reset came
+  for(b=0;b<NBLOCKS;b++) {
+    if(vac.victim>=0 && b==reserved_block) continue;
+    for(i=0,run=0;i<=bstat[b].next;i++) {
+      if(i<bstat[b].next && blocks[b][i].type==ExtentData) {
+        run++;
+        continue;
+      }
+      const uint32_t k=(i<bstat[b].next && blocks[b][i].type==Extent)?blocks[b][i].extent.count:0;
+      for(;run>k;run--) {
+        LOG(1, "[i] dropping orphaned extent data %d %d\n", b, i-run);
+        mark_deleted(b, i-run);
+      }
+      run=0;
+    }
+  }
+  if(vac.victim<0) {
+    // check if at least one block is empty for migration
+    for(b=0,free=0;b<NBLOCKS;b++) {
+      if(bstat[b].next==HDR(b)) free++;
+    }
+    if(free==0) {
+      // a reset might have left only garbage in the empty block
+      for(b=0;b<NBLOCKS && bstat[b].live>0;b++);
+      if(b>=NBLOCKS) {
+        // fail no empty blocks
+        return -1;
+      }
+      LOG(1, "[i] erasing block %d without live chunks\n", b);
+      erase_block(b);
+      free=1;
+    }
+
+    randombytes_buf((void *) &rcan, sizeof(rcan));
+    rcan%=free;
+    for(b=0,i=0;b<NBLOCKS;b++) {
+      if(bstat[b].next==HDR(b)) {
+        if(i++==rcan) {
+          reserved_block=b;
+          break;
+        }
+      }
+    }
+    if(b>=NBLOCKS) {
+      // fail no empty blocks
+      return -1;
+    }
+  }
+  index_build();
+  // finish replacing files when a reset came after switching the inode
+  for(b=0;b<NBLOCKS;b++) {
+    if(RESERVED(b)) continue;
+    for(i=0;i<bstat[b].next;i++) {
+      const Inode_t *inode=&blocks[b][i].inode;
+      if(blocks[b][i].type!=Inode || inode->replaces==0 || inode->replaces==0xffffffff) continue;
+      LOG(1, "[i] finishing replace of %x by %x\n", inode->replaces, inode->oid);
+      replace_done(inode->oid, inode->replaces);
+    }
+  }
+  fsck();
   return 0;
 }
 
 void stfs_format(void) {
+  uint32_t b, erases[NBLOCKS];
+  ckpt=NULL;
+  // keep the erase counts
+  bstat_build();
+  for(b=0;b<NBLOCKS;b++) erases[b]=bstat[b].erases;
+#ifdef STFS_INLINE_TESTS
+  for(b=0;b<NBLOCKS;b++) flash_erase_sector(STARTBLOCK+b, FLASH_CR_PROGRAM_X64);
+#else
   int i;
   disable_irqs();
   flash_unlock();
@@ -1029,4 +2500,1318 @@ void stfs_format(void) {
 
   flash_lock();
   enable_irqs();
+#endif // STFS_INLINE_TESTS
+  for(b=0;b<NBLOCKS;b++) write_header(b, erases[b]+1);
+}
+
+#ifdef STFS_INLINE_TESTS
+/* host side tests, run against the simulated flash */
+
+#define TEST(cond) if(!(cond)) { \
+    fprintf(stderr, "[x] %s:%d test failed: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  }
+
+static void test_writefile(const char *fname, const uint32_t size) {
+  uint8_t path[80], buf[512];
+  int fd;
+  randombytes_buf(buf, sizeof(buf));
+  snprintf((char*) path, sizeof(path), "%s", fname);
+  if((fd=stfs_open(path, 0))==-1) {
+    fd=stfs_open(path, O_CREAT);
+  }
+  TEST(fd>=0);
+  TEST(stfs_write(fd, buf, size)==size);
+  TEST(stfs_close(fd)==0);
+}
+
+// every inode on flash must be found by the index and by a scan at
+// the same location, and nothing else must be in the index
+static void check_index(void) {
+  uint32_t b, c, n=0, ib, ic, sb, sc;
+  uint8_t name[33];
+  for(b=0;b<NBLOCKS;b++) {
+    if(RESERVED(b)) continue;
+    for(c=0;c<CHUNKS_PER_BLOCK && blocks[b][c].type!=Empty;c++) {
+      if(blocks[b][c].type!=Inode) continue;
+      const Inode_t *inode=&blocks[b][c].inode;
+      n++;
+      memcpy(name, inode->name, inode->name_len);
+      name[inode->name_len]=0;
+      TEST(scan_inode_by_parent_fname(inode->parent, name, &sb, &sc)!=NULL);
+      TEST(sb==b && sc==c);
+#if STFS_INDEX_SIZE > 0
+      if(!index_valid) continue;
+      TEST(index_find(inode->parent, name, inode->name_len, &ib, &ic)!=NULL);
+      TEST(ib==b && ic==c);
+#else
+      (void) ib; (void) ic;
+#endif // STFS_INDEX_SIZE > 0
+      TEST(scan_inode_by_parent_fname(inode->parent, (uint8_t*) "nosuchfile", &sb, &sc)==NULL);
+      TEST(find_inode_by_parent_fname(inode->parent, (uint8_t*) "nosuchfile", &sb, &sc)==NULL);
+    }
+  }
+#if STFS_INDEX_SIZE > 0
+  if(index_valid) TEST(n==index_len);
+#endif // STFS_INDEX_SIZE > 0
+}
+
+static void test_index_fill(const uint32_t peers) {
+  char path[80];
+  uint32_t i, j;
+  snprintf(path, sizeof(path), "/keys");
+  TEST(stfs_mkdir((uint8_t*) path)==0);
+  for(i=0;i<peers;i++) {
+    snprintf(path, sizeof(path), "/keys/peer%03d", i);
+    TEST(stfs_mkdir((uint8_t*) path)==0);
+    for(j=0;j<2;j++) {
+      snprintf(path, sizeof(path), "/keys/peer%03d/key%d", i, j);
+      test_writefile(path, 200);
+    }
+  }
+}
+
+static void test_index(void) {
+  char path[80];
+  uint32_t i, r;
+  stfs_format();
+  TEST(stfs_init()==0);
+  const uint32_t erases=sim_erases;
+  test_index_fill(100);
+  check_index();
+  // churn so that inodes get deleted, rewritten and vacuumed
+  for(r=0;r<64;r++) {
+    for(i=r%3;i<100;i+=3) {
+      snprintf(path, sizeof(path), "/keys/peer%03d/key%d", i, r&1);
+      if(r%4==3) {
+        TEST(stfs_unlink((uint8_t*) path)==0);
+      } else {
+        test_writefile(path, 100+(r*37)%400);
+      }
+    }
+    check_index();
+  }
+  // a remount must rebuild the same index
+  TEST(stfs_init()==0);
+  check_index();
+  TEST(sim_erases>erases);
+  printf("[i] index: ok, %d vacuums\n", sim_erases-erases);
+}
+
+// listing /keys/<peer>/ for all peers, as ekid2key does: with a sweep
+// of the flash per directory as stfs_readdir did vs. from the index and
+// in batches. entries must come in flash order, sorted batches by name.
+static void test_readdir(void) {
+  const Inode_t *ents[64], *inode, *peer;
+  const Chunk *chunk;
+  uint8_t path[80];
+  ReaddirCTX pctx, kctx;
+  uint32_t i, n, b, c, old, new, keys;
+  stfs_format();
+  TEST(stfs_init()==0);
+  test_index_fill(60);
+  snprintf((char*) path, sizeof(path), "/keys");
+  TEST(stfs_opendir(path, &pctx)==0);
+  stats.touched=0;
+  for(b=c=0;(chunk=find_chunk(Inode, 0, pctx.oid, 0, &b, &c))!=NULL;c++) {
+    uint32_t kb=0, kc=0;
+    while(find_chunk(Inode, 0, chunk->inode.oid, 0, &kb, &kc)!=NULL) kc++;
+  }
+  old=stats.touched;
+  stats.touched=0;
+  for(n=0,keys=0;(peer=stfs_readdir(&pctx))!=NULL;n++) {
+    TEST(peer->parent==pctx.oid && peer->type==Directory);
+    TEST(stfs_opendir_at(peer, &kctx)==0);
+    for(inode=NULL;(i=stfs_readdir_batch(&kctx, ents, 64, 0))>0;) {
+      for(;i>0;i--,keys++) {
+        TEST(ents[i-1]->parent==peer->oid);
+        if(inode!=NULL) TEST(ents[i-1]<inode);
+        inode=ents[i-1];
+      }
+    }
+  }
+  new=stats.touched;
+  TEST(n==60 && keys==120);
+  printf("[i] readdir %d dirs: %8d chunks touched before, %6d now\n", n, old, new);
+  TEST(new<old || !index_valid);
+  // a whole directory in one sorted batch, and the same in small ones
+  TEST(stfs_opendir(path, &pctx)==0);
+  TEST(stfs_readdir_batch(&pctx, ents, 64, 1)==60);
+  for(i=1;i<60;i++) TEST(name_cmp(ents[i-1], ents[i])<0);
+  TEST(stfs_readdir_batch(&pctx, ents, 64, 1)==0);
+  TEST(stfs_opendir(path, &pctx)==0);
+  for(n=0;(i=stfs_readdir_batch(&pctx, ents, 7, 1))>0;n+=i) {
+    TEST(i==7 || n+i==60);
+  }
+  TEST(n==60);
+  // entries can be unlinked while listing
+  snprintf((char*) path, sizeof(path), "/keys/peer007/");
+  TEST(stfs_opendir(path, &kctx)==0);
+  for(n=0;(inode=stfs_readdir(&kctx))!=NULL;n++) {
+    snprintf((char*) path, sizeof(path), "/keys/peer007/%.*s", inode->name_len, inode->name);
+    TEST(stfs_unlink(path)==0);
+  }
+  TEST(n==2);
+  snprintf((char*) path, sizeof(path), "/keys/peer007");
+  TEST(stfs_rmdir(path)==0);
+  check_index();
+  printf("[i] readdir: ok\n");
+}
+
+// chunks touched per byte read: one find_chunk per seq as stfs_read did
+// before the chunk map vs. open+read using the map
+static void bench_read(const uint32_t size) {
+  static uint8_t data[MAX_FILE_SIZE], buf[MAX_FILE_SIZE];
+  uint8_t path[]="/bench";
+  uint32_t seq, b, c, old, new;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  // some unrelated files in front, as on a used store
+  test_index_fill(30);
+  randombytes_buf(data, size);
+  TEST((fd=stfs_open(path, O_CREAT))>=0);
+  TEST(stfs_write(fd, data, size)==size);
+  TEST(stfs_close(fd)==0);
+  TEST((fd=stfs_open(path, 0))>=0);
+  stats.touched=0;
+  for(seq=0;seq*EXTENT_SIZE<size;seq++) {
+    b=c=0;
+    TEST(find_chunk(Extent, files[fds[fd].file].oid, 0, seq, &b, &c)!=NULL);
+  }
+  old=stats.touched;
+  TEST(stfs_close(fd)==0);
+  stats.touched=0;
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_read(fd, buf, size)==size);
+  TEST(stfs_close(fd)==0);
+  new=stats.touched;
+  TEST(memcmp(data, buf, size)==0);
+  printf("[i] read %5d bytes: %8d chunks touched before (%.1f/byte), %6d with map (%.2f/byte)\n",
+         size, old, (float) old/size, new, (float) new/size);
+  TEST(new<old);
+}
+
+// an open file must still read and write correctly after its chunks
+// were moved by a vacuum or rewritten by another fd
+static void test_chunkmap(void) {
+  static uint8_t data[20000], buf[20000];
+  uint8_t path[]="/big";
+  uint32_t r, erases;
+  int fd, fd2;
+  stfs_format();
+  TEST(stfs_init()==0);
+  randombytes_buf(data, sizeof(data));
+  TEST((fd=stfs_open(path, O_CREAT))>=0);
+  TEST(stfs_write(fd, data, sizeof(data))==sizeof(data));
+  TEST(stfs_close(fd)==0);
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST((fd2=stfs_open(path, 0))>=0);
+  // overwrite the middle through the 2nd fd
+  const uint32_t ofs=DATA_PER_CHUNK*40, len=DATA_PER_CHUNK*20+17;
+  randombytes_buf(data+ofs, len);
+  TEST(stfs_lseek(fd2, ofs, SEEK_SET)==ofs);
+  TEST(stfs_write(fd2, data+ofs, len)==len);
+  TEST(stfs_close(fd2)==0);
+  erases=sim_erases;
+  test_index_fill(2);
+  for(r=0;sim_erases<erases+2;r++) {
+    test_writefile("/churn", 100+(r*37)%400);
+  }
+  TEST(stfs_read(fd, buf, sizeof(buf))==sizeof(buf));
+  TEST(memcmp(data, buf, sizeof(buf))==0);
+  // and append after the vacuums
+  randombytes_buf(data, 1000);
+  TEST(stfs_write(fd, data, 1000)==1000);
+  TEST(stfs_lseek(fd, sizeof(buf), SEEK_SET)==sizeof(buf));
+  TEST(stfs_read(fd, buf, 1000)==1000);
+  TEST(memcmp(data, buf, 1000)==0);
+  TEST(stfs_close(fd)==0);
+  printf("[i] chunkmap: ok, %d vacuums\n", sim_erases-erases);
+}
+
+// small files with known contents are recreated at random, running
+// steps of the idle vacuum after each
+#define VFILES 24
+static uint8_t vdata[VFILES][512];
+static uint32_t vsize[VFILES];
+static int vbusy=-1; // file being saved, unknown state after a reset
+
+static void check_vfiles(void) {
+  uint8_t path[16], buf[512];
+  uint32_t i;
+  int fd;
+  for(i=0;i<VFILES;i++) {
+    if(vsize[i]==0) continue;
+    snprintf((char*) path, sizeof(path), "/v%02d", i);
+    TEST((fd=stfs_open(path, 0))>=0);
+    TEST(stfs_read(fd, buf, sizeof(buf))==vsize[i]);
+    TEST(memcmp(buf, vdata[i], vsize[i])==0);
+    TEST(stfs_close(fd)==0);
+  }
+}
+
+static void vacuum_churn(const uint32_t rounds, const uint32_t steps) {
+  uint8_t path[16];
+  uint32_t r, i, j;
+  int fd;
+  for(r=0;r<rounds;r++) {
+    i=rand()%VFILES;
+    snprintf((char*) path, sizeof(path), "/v%02d", i);
+    vbusy=i;
+    if(vsize[i]) TEST(stfs_unlink(path)==0);
+    vsize[i]=1+rand()%sizeof(vdata[i]);
+    randombytes_buf(vdata[i], vsize[i]);
+    TEST((fd=stfs_open(path, O_CREAT))>=0);
+    TEST(stfs_write(fd, vdata[i], vsize[i])==vsize[i]);
+    TEST(stfs_close(fd)==0);
+    vbusy=-1;
+    for(j=0;j<steps;j++) stfs_vacuum_step();
+  }
+}
+
+static uint32_t vacuum_run(const uint32_t steps) {
+  static uint8_t big[60000];
+  uint8_t path[16];
+  uint32_t i;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(vsize, 0, sizeof(vsize));
+  test_index_fill(100);
+  for(i=0;i<6;i++) {
+    snprintf((char*) path, sizeof(path), "/big%d", i);
+    TEST((fd=stfs_open(path, O_CREAT))>=0);
+    TEST(stfs_write(fd, big, sizeof(big))==sizeof(big));
+    TEST(stfs_close(fd)==0);
+  }
+  const uint32_t erases=sim_erases;
+  vacuum_churn(2000, steps);
+  check_vfiles();
+  check_index();
+  TEST(sim_erases-erases>=4);
+  return stfs_max_latency();
+}
+
+static void test_vacuum(void) {
+  const uint32_t blocking=vacuum_run(0);
+  const uint32_t incremental=vacuum_run(4);
+  TEST(incremental<ERASE_US);
+
+  // reset while migrating
+  while(vac.victim<0 || vac.src==0) vacuum_churn(1, 1);
+  TEST(stfs_init()==0);
+  TEST(vac.victim>=0);
+  check_vfiles();
+  check_index();
+  // reset after copying a chunk but before deleting the original
+  while(blocks[vac.victim][vac.src].type!=Inode && blocks[vac.victim][vac.src].type!=Data) vac.src++;
+  write_chunk(&blocks[reserved_block][vac.dst], &blocks[vac.victim][vac.src], sizeof(Chunk));
+  TEST(stfs_init()==0);
+  while(stfs_vacuum_step());
+  TEST(vac.victim<0);
+  check_vfiles();
+  check_index();
+  vacuum_churn(100, 4);
+  check_vfiles();
+  // and after erasing the victim but before deleting the marker
+  const uint32_t dst=reserved_block;
+  TEST(vacuum()==0);
+  blocks[dst][vac.mark].type=Vacuum;
+  blocks[dst][vac.mark].vacuum.victim=reserved_block;
+  TEST(stfs_init()==0);
+  while(stfs_vacuum_step());
+  check_vfiles();
+  check_index();
+  printf("[i] vacuum: ok, max store latency %dms blocking, %dms incremental\n",
+         blocking/1000, incremental/1000);
+}
+
+// the block counters must match the flash at all times
+static void check_bstat(void) {
+  uint32_t b, c, live, deleted, next;
+  for(b=0;b<NBLOCKS;b++) {
+    for(c=0,live=0,deleted=0,next=0;c<CHUNKS_PER_BLOCK;c++) {
+      if(LIVE(blocks[b][c].type)) live++;
+      else if(DEAD(blocks[b][c].type)) deleted++;
+      if(blocks[b][c].type!=Empty) next=c+1;
+    }
+    TEST(bstat[b].live==live);
+    TEST(bstat[b].deleted==deleted);
+    TEST(bstat[b].next==next);
+  }
+}
+
+static void test_bstat(void) {
+  uint8_t path[16];
+  uint32_t r, i;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  check_bstat();
+  memset(vsize, 0, sizeof(vsize));
+  test_index_fill(100);
+  check_bstat();
+  const uint32_t erases=sim_erases;
+  for(r=0;r<5000;r++) {
+    i=rand()%VFILES;
+    snprintf((char*) path, sizeof(path), "/v%02d", i);
+    switch(rand()%8) {
+    case 0: { // unlink
+      if(vsize[i]==0) continue;
+      TEST(stfs_unlink(path)==0);
+      vsize[i]=0;
+      break;
+    }
+    case 1: { // truncate
+      if(vsize[i]==0) continue;
+      vsize[i]=1+rand()%vsize[i];
+      TEST(stfs_truncate(path, vsize[i])==0);
+      break;
+    }
+    case 2: { // append
+      if(vsize[i]==0 || vsize[i]==sizeof(vdata[i])) continue;
+      const uint32_t len=1+rand()%(sizeof(vdata[i])-vsize[i]);
+      randombytes_buf(vdata[i]+vsize[i], len);
+      TEST((fd=stfs_open(path, 0))>=0);
+      TEST(stfs_lseek(fd, vsize[i], SEEK_SET)==vsize[i]);
+      TEST(stfs_write(fd, vdata[i]+vsize[i], len)==len);
+      TEST(stfs_close(fd)==0);
+      vsize[i]+=len;
+      break;
+    }
+    case 3: { stfs_vacuum_step(); break; }
+    case 4: { if(rand()%16==0) TEST(vacuum()==0); break; }
+    case 5: { if(rand()%64==0) TEST(stfs_init()==0); break; }
+    default: { vacuum_churn(1, 0); break; }
+    }
+    check_bstat();
+  }
+  check_vfiles();
+  check_index();
+  TEST(sim_erases>erases);
+  printf("[i] block counters: ok, %d vacuums\n", sim_erases-erases);
+}
+
+// a few small files saved over and over next to a lot of cold data, as
+// the ratchet states next to the keys. the headers must count every
+// erase, and the cold blocks must be recycled too.
+static void test_wear(void) {
+  static uint8_t big[60000];
+  uint8_t path[16];
+  uint32_t b, i, min, max, erases[NBLOCKS];
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  for(b=0;b<NBLOCKS;b++) erases[b]=bstat[b].erases;
+  stfs_format(); // keeps the counts
+  memset(sim_wear, 0, sizeof(sim_wear));
+  TEST(stfs_init()==0);
+  for(b=0;b<NBLOCKS;b++) {
+    TEST(blocks[b][0].type==Header && blocks[b][0].header.erases==++erases[b]);
+  }
+  memset(vsize, 0, sizeof(vsize));
+  for(i=0;i<6;i++) {
+    snprintf((char*) path, sizeof(path), "/cold%d", i);
+    TEST((fd=stfs_open(path, O_CREAT))>=0);
+    TEST(stfs_write(fd, big, sizeof(big))==sizeof(big));
+    TEST(stfs_close(fd)==0);
+  }
+  for(i=0;i<100;i++) {
+    vacuum_churn(200, 4);
+    if(i%10==0) TEST(stfs_init()==0);
+  }
+  check_vfiles();
+  check_index();
+  for(b=0,min=~0,max=0;b<NBLOCKS;b++) {
+    TEST(bstat[b].erases==erases[b]+sim_wear[b]);
+    TEST(blocks[b][0].type==Header && blocks[b][0].header.erases==bstat[b].erases);
+    if(bstat[b].erases<min) min=bstat[b].erases;
+    if(bstat[b].erases>max) max=bstat[b].erases;
+  }
+  TEST(max-min<=STFS_WEAR_DELTA+2);
+  printf("[i] wear: ok, erase counts %d..%d\n", min, max);
+}
+
+// the power fails at random points while files are saved and the store
+// is compacted. after each reset the store must mount and be consistent,
+// only the file being saved may be lost.
+static void test_powerloss(void) {
+  static uint8_t big[60000];
+  uint8_t path[16];
+  static uint32_t resets, resumed;
+  uint32_t trial, b, c;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(vsize, 0, sizeof(vsize));
+  test_index_fill(100);
+  for(trial=0;trial<4;trial++) {
+    snprintf((char*) path, sizeof(path), "/big%d", trial);
+    TEST((fd=stfs_open(path, O_CREAT))>=0);
+    TEST(stfs_write(fd, big, sizeof(big))==sizeof(big));
+    TEST(stfs_close(fd)==0);
+  }
+  for(trial=0;trial<500;trial++) {
+    if(setjmp(sim_reset)==0) {
+      sim_powerfail=1+rand()%20000;
+      vacuum_churn(1000, 2);
+    } else {
+      resets++;
+    }
+    sim_powerfail=0;
+    TEST(stfs_init()==0);
+    check_bstat();
+    if(vac.victim>=0) resumed++;
+    while(vac.victim>=0) TEST(stfs_vacuum_step() || vac.victim<0);
+    check_index();
+    if(vbusy>=0) {
+      snprintf((char*) path, sizeof(path), "/v%02d", vbusy);
+      if(oid_by_path(path, &b, &c)!=0) TEST(stfs_unlink(path)==0);
+      vsize[vbusy]=0;
+      vbusy=-1;
+    }
+    check_vfiles();
+  }
+  vacuum_churn(500, 2);
+  check_vfiles();
+  check_index();
+  printf("[i] power loss: ok, %d resets, %d vacuums resumed\n", resets, resumed);
+}
+
+static void check_file(uint8_t *path, const uint8_t *data, const uint32_t size) {
+  static uint8_t buf[MAX_FILE_SIZE];
+  int fd;
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_read(fd, buf, sizeof(buf))==size);
+  TEST(memcmp(buf, data, size)==0);
+  TEST(stfs_close(fd)==0);
+}
+
+// replacing must leave either the old or the new contents whenever the
+// power fails, and cost no more than overwriting
+static void test_replace(void) {
+  static uint8_t old[2000], new[2000];
+  uint8_t path[]="/ax";
+  static uint32_t resets, olds, programs[2];
+  uint32_t i, b, c, size=sizeof(old);
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(vsize, 0, sizeof(vsize));
+  test_index_fill(100);
+  randombytes_buf(old, sizeof(old));
+  TEST(stfs_replace(path, old, 650)==0);
+  check_file(path, old, 650);
+  // shrinking drops the tail
+  TEST(stfs_replace(path, old, 100)==0);
+  check_file(path, old, 100);
+  TEST(stfs_replace(path, old, size)==0);
+  check_file(path, old, size);
+  // directories can't be replaced
+  uint8_t dir[]="/dir";
+  TEST(stfs_mkdir(dir)==0);
+  TEST(stfs_replace(dir, old, 10)==-1);
+  TEST(stfs_open(dir, O_REPLACE)==-1);
+
+  // replacing through an fd, the old contents stay until the close
+  TEST((fd=stfs_open(path, O_REPLACE))>=0);
+  for(i=0;i<650;i+=256) TEST(stfs_write(fd, new+i, (650-i<256)?650-i:256)==((650-i<256)?650-i:256));
+  check_file(path, old, size);
+  TEST(stfs_close(fd)==0);
+  check_file(path, new, 650);
+  check_vfiles();
+  // and of new files
+  uint8_t npath[]="/new";
+  TEST((fd=stfs_open(npath, O_REPLACE))>=0);
+  TEST(stfs_write(fd, old, 300)==300);
+  TEST(stfs_close(fd)==0);
+  check_file(npath, old, 300);
+  TEST(stfs_unlink(npath)==0);
+  // only one at a time, write only, and a failed write keeps the old
+  // contents
+  TEST((fd=stfs_open(path, O_REPLACE))>=0);
+  TEST(stfs_open(npath, O_REPLACE)==-1);
+  TEST(stfs_write(fd, old, 100)==100);
+  TEST(stfs_lseek(fd, 0, SEEK_SET)==0);
+  TEST(stfs_read(fd, new, 10)==-1);
+  TEST(stfs_write(fd, old, 10)==-1);
+  TEST(stfs_close(fd)==-1);
+  check_file(path, new, 650);
+  check_vfiles();
+  TEST(stfs_replace(path, old, size)==0);
+
+  for(i=0;i<200;i++) {
+    randombytes_buf(new, sizeof(new));
+    programs[0]-=stats.programs;
+    TEST((fd=stfs_open(path, 0))>=0);
+    TEST(stfs_write(fd, new, 650)==650);
+    TEST(stfs_close(fd)==0);
+    programs[0]+=stats.programs;
+    randombytes_buf(new, sizeof(new));
+    programs[1]-=stats.programs;
+    TEST(stfs_replace(path, new, 650)==0);
+    programs[1]+=stats.programs;
+    stfs_vacuum_step();
+  }
+  check_file(path, new, 650);
+  memcpy(old, new, sizeof(old));
+  size=650;
+
+  for(i=0;i<500;i++) {
+    const uint32_t nsize=1+rand()%sizeof(new);
+    randombytes_buf(new, nsize);
+    if(setjmp(sim_reset)==0) {
+      sim_powerfail=1+rand()%((nsize/2+200)*4/PROGRAM_WIDTH);
+      if(i&1) {
+        TEST(stfs_replace(path, new, nsize)==0);
+      } else {
+        uint32_t off;
+        TEST((fd=stfs_open(path, O_REPLACE))>=0);
+        for(off=0;off<nsize;off+=272) {
+          const uint32_t n=(nsize-off<272)?nsize-off:272;
+          TEST(stfs_write(fd, new+off, n)==(int) n);
+        }
+        TEST(stfs_close(fd)==0);
+      }
+      stfs_vacuum_step();
+    } else {
+      resets++;
+    }
+    sim_powerfail=0;
+    TEST(stfs_init()==0);
+    check_bstat();
+    while(vac.victim>=0) TEST(stfs_vacuum_step() || vac.victim<0);
+    check_index();
+    check_vfiles();
+    TEST((fd=stfs_open(path, 0))>=0);
+    // the old contents might be as long as the new ones
+    const int fresh=(stfs_size(fd)==nsize && stfs_read(fd, old, sizeof(old))==nsize && memcmp(old, new, nsize)==0);
+    TEST(stfs_close(fd)==0);
+    if(!fresh) {
+      olds++;
+      continue;
+    }
+    size=nsize;
+    memcpy(old, new, size);
+    check_file(path, old, size);
+  }
+  // nothing left over of the replaced files
+  for(b=0;b<NBLOCKS;b++) {
+    for(c=0;c<bstat[b].next;c++) {
+      TEST(blocks[b][c].type!=Inode || blocks[b][c].inode.replaces==0 ||
+           blocks[b][c].inode.replaces==0xffffffff);
+    }
+  }
+  printf("[i] replace: ok, %d resets, %d kept the old contents, programs per 650B save %d overwriting, %d replacing\n",
+         resets, olds, programs[0]/200, programs[1]/200);
+}
+
+// flash operations per byte written, for a new file and for small files
+// being rewritten (including the vacuums that causes)
+static void bench_program(const uint32_t size, const uint32_t rewrites) {
+  static uint8_t data[MAX_FILE_SIZE];
+  uint8_t path[]="/bench";
+  uint32_t i, bytes=size, erases;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  if(rewrites) test_index_fill(100);
+  memset(&stats, 0, sizeof(stats));
+  erases=sim_erases;
+  TEST((fd=stfs_open(path, O_CREAT))>=0);
+  TEST(stfs_write(fd, data, size)==size);
+  TEST(stfs_close(fd)==0);
+  for(i=0;i<rewrites;i++) {
+    TEST(stfs_unlink(path)==0);
+    TEST((fd=stfs_open(path, O_CREAT))>=0);
+    randombytes_buf(data, size);
+    TEST(stfs_write(fd, data, size)==size);
+    TEST(stfs_close(fd)==0);
+    bytes+=size;
+  }
+  printf("[i] write %5dB x%-4d %.3f unlocks, %.3f irq offs, %.2f programs /byte, %d erases\n",
+         size, rewrites+1, (float) stats.unlocks/bytes, (float) stats.irqoffs/bytes,
+         (float) stats.programs/bytes, sim_erases-erases);
+}
+
+// the traffic of pitchfork on its store: new keys of 72B under
+// /keys/<peer>/, the axolotl context of a peer (~650B encrypted) saved
+// over with every message, listing the keys of a peer, and the idle
+// vacuum steps between commands. measured per operation: host time,
+// programs, chunks touched and the estimated worst case flash time.
+#define WL_PEERS 32
+#define WL_KEYS 16
+static void bench_workload(void) {
+  enum { NEWKEY, RATCHET, LIST, IDLE, PAUSE, LOCK, WL_OPS };
+  static const char *names[WL_OPS]={ "new key", "ratchet save", "list keys", "idle vacuum", "pause", "lock" };
+  static struct {
+    uint32_t n, programs, touched, worst;
+    clock_t time;
+  } ops[WL_OPS];
+  static uint32_t keys[WL_PEERS];
+  uint8_t path[80], buf[650];
+  uint32_t r, p, op, i, n, programs, touched, us, checkpoints;
+  clock_t start;
+  ReaddirCTX ctx;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(ops, 0, sizeof(ops));
+  memset(keys, 0, sizeof(keys));
+  checkpoints=stats.checkpoints;
+  snprintf((char*) path, sizeof(path), "/keys");
+  TEST(stfs_mkdir(path)==0);
+  snprintf((char*) path, sizeof(path), "/ax");
+  TEST(stfs_mkdir(path)==0);
+  for(p=0;p<WL_PEERS;p++) {
+    snprintf((char*) path, sizeof(path), "/keys/%032x", p);
+    TEST(stfs_mkdir(path)==0);
+  }
+  for(r=0;r<20000;r++) {
+    p=rand()%WL_PEERS;
+    i=rand()%8;
+    op=(i<2)?NEWKEY:(i<7)?RATCHET:LIST;
+    if(r%4==3) op=IDLE;
+    // the user walks away now and then, and locks the device
+    if(r%20==19) op=PAUSE;
+    if(r%1000==999) op=LOCK;
+    programs=stats.programs;
+    touched=stats.touched;
+    us=flash_us;
+    start=clock();
+    switch(op) {
+    case NEWKEY: {
+      // keep the last WL_KEYS keys of a peer
+      if(keys[p]>=WL_KEYS) {
+        snprintf((char*) path, sizeof(path), "/keys/%032x/%032x", p, keys[p]-WL_KEYS);
+        TEST(stfs_unlink(path)==0);
+      }
+      snprintf((char*) path, sizeof(path), "/keys/%032x/%032x", p, keys[p]++);
+      randombytes_buf(buf, 72);
+      TEST((fd=stfs_open(path, O_CREAT))>=0);
+      TEST(stfs_write(fd, buf, 72)==72);
+      TEST(stfs_close(fd)==0);
+      break;
+    }
+    case RATCHET: { // as write_enc, a header and 256B segments with macs
+      snprintf((char*) path, sizeof(path), "/ax/%032x", p);
+      randombytes_buf(buf, sizeof(buf));
+      TEST((fd=stfs_open(path, O_REPLACE))>=0);
+      for(i=0;i<sizeof(buf);i+=n) {
+        n=(i==0)?28:(sizeof(buf)-i<272)?sizeof(buf)-i:272;
+        TEST(stfs_write(fd, buf+i, n)==(int) n);
+      }
+      TEST(stfs_close(fd)==0);
+      break;
+    }
+    case LIST: {
+      snprintf((char*) path, sizeof(path), "/keys/%032x", p);
+      TEST(stfs_opendir(path, &ctx)==0);
+      for(i=0;stfs_readdir(&ctx)!=NULL;i++);
+      TEST(i==(keys[p]<WL_KEYS?keys[p]:WL_KEYS));
+      break;
+    }
+    case IDLE: {
+      stfs_vacuum_step();
+      break;
+    }
+    case PAUSE: {
+      for(i=0;i<STFS_CHECKPOINT_IDLE;i++) stfs_vacuum_step();
+      break;
+    }
+    case LOCK: {
+      stfs_checkpoint();
+      break;
+    }
+    }
+    ops[op].time+=clock()-start;
+    ops[op].n++;
+    ops[op].programs+=stats.programs-programs;
+    ops[op].touched+=stats.touched-touched;
+    if(flash_us-us>ops[op].worst) ops[op].worst=flash_us-us;
+  }
+  check_index();
+  for(op=0;op<WL_OPS;op++) {
+    printf("[i] %-12s %5d ops %8.0f ops/s %7.1f programs/op %8.1f touched/op, worst %4dms\n",
+           names[op], ops[op].n,
+           ops[op].time?(double) ops[op].n*CLOCKS_PER_SEC/ops[op].time:0.0,
+           (double) ops[op].programs/ops[op].n, (double) ops[op].touched/ops[op].n,
+           ops[op].worst/1000);
+  }
+  printf("[i] checkpoints %5.2f chunks/op written or dropped\n",
+         (double) (stats.checkpoints-checkpoints)/r);
+}
+
+// creates thousands of files, counting the chunks touched per create,
+// and what the windowed oid search alone would have touched
+static void test_oids(void) {
+  uint8_t path[32];
+  uint32_t d, f, old=0, new=0, worst=0, offset;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  for(d=0;d<40;d++) {
+    snprintf((char*) path, sizeof(path), "/d%02d", d);
+    TEST(stfs_mkdir(path)==0);
+    for(f=0;f<50;f++) {
+      offset=current_oid_offset;
+      stats.touched=0;
+      scan_new_oid();
+      old+=stats.touched;
+      current_oid_offset=offset;
+
+      snprintf((char*) path, sizeof(path), "/d%02d/f%02d", d, f);
+      stats.touched=0;
+      TEST((fd=stfs_open(path, O_CREAT))>=0);
+      new+=stats.touched;
+      if(stats.touched>worst) worst=stats.touched;
+      TEST(stfs_close(fd)==0);
+    }
+  }
+  const uint32_t hw=oid_hw;
+  TEST(stfs_init()==0);
+  TEST(oid_hw==hw);
+  // wrapping around falls back to the search, which must not hand out
+  // any oid in use
+  oid_hw=0xFFFFFFFF-OID_BLOCK_SIZE;
+  for(f=0;f<50;f++) {
+    snprintf((char*) path, sizeof(path), "/d00/w%02d", f);
+    TEST((fd=stfs_open(path, O_CREAT))>=0);
+    TEST(stfs_close(fd)==0);
+  }
+  for(d=0;d<NBLOCKS;d++) {
+    for(f=0;f<bstat[d].next;f++) {
+      const Chunk *chunk=&blocks[d][f];
+      uint32_t b=0, c=0;
+      if(chunk->type!=Inode) continue;
+      TEST(find_chunk(Inode, chunk->inode.oid, 0, 0, &b, &c)==chunk);
+    }
+  }
+  printf("[i] oids: ok, chunks touched per create %d with searching for an oid, %d now (worst %d)\n",
+         (old+new)/2000, new/2000, worst);
+}
+
+// files beyond 64KB are written, overwritten, appended to and truncated
+// across extent boundaries, files of older firmwares are still stored
+// in data chunks and must keep working. the power fails while big files
+// are saved and the orphaned extents must be dropped on mount.
+static void test_extents(void) {
+  static uint8_t data[200000], buf[200000];
+  uint8_t path[]="/huge", lpath[]="/legacy", path2[16];
+  static uint32_t resets;
+  uint32_t trial, b, c, n;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  randombytes_buf(data, sizeof(data));
+  TEST((fd=stfs_open(path, O_CREAT))>=0);
+  TEST(stfs_write(fd, data, 150000)==150000);
+  TEST(stfs_size(fd)==150000);
+  // overwrite across an extent boundary, then append
+  randombytes_buf(data+EXTENT_SIZE*3-100, 5000);
+  TEST(stfs_lseek(fd, EXTENT_SIZE*3-100, SEEK_SET)==EXTENT_SIZE*3-100);
+  TEST(stfs_write(fd, data+EXTENT_SIZE*3-100, 5000)==5000);
+  TEST(stfs_lseek(fd, 0, SEEK_END)==150000);
+  TEST(stfs_write(fd, data+150000, 50000)==50000);
+  TEST(stfs_close(fd)==0);
+  check_file(path, data, sizeof(data));
+  n=0;
+  for(b=0;b<NBLOCKS;b++) n+=bstat[b].live;
+  printf("[i] extents: %d bytes in %d chunks, %.1f%% payload (data chunks %.1f%%)\n",
+         (int) sizeof(data), n, sizeof(data)*100.0/(n*sizeof(Chunk)), DATA_PER_CHUNK*100.0/sizeof(Chunk));
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_lseek(fd, 123456, SEEK_SET)==123456);
+  TEST(stfs_read(fd, buf, 1000)==1000);
+  TEST(memcmp(buf, data+123456, 1000)==0);
+  TEST(stfs_close(fd)==0);
+  TEST(stfs_truncate(path, 70000)==0);
+  check_file(path, data, 70000);
+  TEST(stfs_truncate(path, EXTENT_SIZE*2)==0);
+  check_file(path, data, EXTENT_SIZE*2);
+  // the size must survive a remount
+  TEST(stfs_init()==0);
+  check_file(path, data, EXTENT_SIZE*2);
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_lseek(fd, 0, SEEK_END)==EXTENT_SIZE*2);
+  TEST(stfs_write(fd, data+EXTENT_SIZE*2, sizeof(data)-EXTENT_SIZE*2)==sizeof(data)-EXTENT_SIZE*2);
+  TEST(stfs_close(fd)==0);
+  check_file(path, data, sizeof(data));
+  TEST(stfs_unlink(path)==0);
+  check_bstat();
+
+  // as stored by an older firmware
+  TEST((fd=stfs_open(lpath, O_CREAT))>=0);
+  file_inode(&files[fds[fd].file])->legacy=1;
+  TEST(stfs_write(fd, data, 70000)==MAX_LEGACY_FILE_SIZE);
+  TEST(stfs_close(fd)==0);
+  n=oid_by_path(lpath, &b, &c);
+  b=c=0;
+  TEST(find_chunk(Data, n, 0, 0, &b, &c)!=NULL);
+  check_file(lpath, data, MAX_LEGACY_FILE_SIZE);
+  randombytes_buf(data+DATA_PER_CHUNK*10, 3000);
+  TEST((fd=stfs_open(lpath, 0))>=0);
+  TEST(stfs_lseek(fd, DATA_PER_CHUNK*10, SEEK_SET)==DATA_PER_CHUNK*10);
+  TEST(stfs_write(fd, data+DATA_PER_CHUNK*10, 3000)==3000);
+  TEST(stfs_close(fd)==0);
+  check_file(lpath, data, MAX_LEGACY_FILE_SIZE);
+  TEST(stfs_truncate(lpath, 5000)==0);
+  check_file(lpath, data, 5000);
+  // replacing turns it into an extent file
+  TEST(stfs_replace(lpath, data, 90000)==0);
+  check_file(lpath, data, 90000);
+  TEST(oid_by_path(lpath, &b, &c)!=0);
+  TEST(blocks[b][c].inode.legacy==0);
+  TEST(stfs_unlink(lpath)==0);
+  check_bstat();
+
+  // power loss while big files are saved and the store is compacted
+  memset(vsize, 0, sizeof(vsize));
+  for(trial=0;trial<200;trial++) {
+    snprintf((char*) path2, sizeof(path2), "/x%d", trial%3);
+    if(setjmp(sim_reset)==0) {
+      sim_powerfail=1+rand()%(60000*4/PROGRAM_WIDTH);
+      if(oid_by_path(path2, &b, &c)!=0) TEST(stfs_unlink(path2)==0);
+      TEST((fd=stfs_open(path2, O_CREAT))>=0);
+      TEST(stfs_write(fd, data, 80000+trial*97)==80000+trial*97);
+      TEST(stfs_close(fd)==0);
+      vacuum_churn(50, 2);
+    } else {
+      resets++;
+    }
+    sim_powerfail=0;
+    TEST(stfs_init()==0);
+    while(vac.victim>=0) TEST(stfs_vacuum_step() || vac.victim<0);
+    check_bstat();
+    check_index();
+    for(b=0;b<NBLOCKS;b++) {
+      if(RESERVED(b)) continue;
+      for(c=1,n=0;c<bstat[b].next;c++) {
+        // payload chunks are always followed by their extent chunk
+        if(blocks[b][c].type==ExtentData) n++;
+        else if(blocks[b][c].type==Extent) {
+          TEST(blocks[b][c].extent.count==n);
+          n=0;
+        } else if(blocks[b][c].type!=Deleted) TEST(n==0);
+        if(blocks[b][c].type==Deleted) n=0;
+      }
+    }
+    if(vbusy>=0) {
+      snprintf((char*) path2, sizeof(path2), "/v%02d", vbusy);
+      if(oid_by_path(path2, &b, &c)!=0) TEST(stfs_unlink(path2)==0);
+      vsize[vbusy]=0;
+      vbusy=-1;
+    }
+    check_vfiles();
+  }
+  // a file either has all its bytes, or is missing or short if the
+  // power failed while it was written
+  for(trial=0;trial<3;trial++) {
+    snprintf((char*) path2, sizeof(path2), "/x%d", trial);
+    if(oid_by_path(path2, &b, &c)==0) continue;
+    TEST((fd=stfs_open(path2, 0))>=0);
+    n=stfs_read(fd, buf, sizeof(buf));
+    TEST(memcmp(buf, data, n)==0);
+    TEST(stfs_close(fd)==0);
+  }
+  printf("[i] extents: ok, %d resets\n", resets);
+}
+
+// what resets leave behind must be dropped by stfs_init, and nothing
+// else: the data of a file unlinked after its inode, the tree below a
+// directory removed with children and a file written but not closed
+static void test_fsck(void) {
+  static uint8_t data[5000];
+  uint8_t path[40];
+  uint32_t b, c, oids[4], oid, i;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  randombytes_buf(data, sizeof(data));
+  snprintf((char*) path, sizeof(path), "/a");
+  TEST(stfs_mkdir(path)==0);
+  snprintf((char*) path, sizeof(path), "/a/b");
+  TEST(stfs_mkdir(path)==0);
+  test_writefile("/a/b/f", 500);
+  test_writefile("/a/g", 100);
+  test_writefile("/x", 400);
+  const char *tree[4]={ "/a", "/a/b", "/a/b/f", "/a/g" };
+  for(i=0;i<4;i++) {
+    snprintf((char*) path, sizeof(path), "%s", tree[i]);
+    TEST((oids[i]=oid_by_path(path, &b, &c))!=0);
+  }
+  snprintf((char*) path, sizeof(path), "/keep");
+  TEST((fd=stfs_open(path, O_CREAT))>=0);
+  TEST(stfs_write(fd, data, sizeof(data))==sizeof(data));
+  TEST(stfs_close(fd)==0);
+  snprintf((char*) path, sizeof(path), "/x");
+  TEST((oid=oid_by_path(path, &b, &c))!=0);
+  del_chunk(b, c);
+  snprintf((char*) path, sizeof(path), "/a");
+  TEST(oid_by_path(path, &b, &c)!=0);
+  del_chunk(b, c);
+  snprintf((char*) path, sizeof(path), "/new");
+  TEST((fd=stfs_open(path, O_CREAT))>=0);
+  TEST(stfs_write(fd, data, sizeof(data))==sizeof(data));
+  b=c=0;
+  TEST(find_chunk(Extent, oid, 0, 0xffff, &b, &c)!=NULL);
+
+  TEST(stfs_init()==0);
+  snprintf((char*) path, sizeof(path), "/keep");
+  check_file(path, data, sizeof(data));
+  for(i=0;i<4;i++) TEST(inode_by_oid(oids[i])==NULL);
+  for(i=2;i<4;i++) {
+    b=c=0;
+    TEST(find_chunk(Extent, oids[i], 0, 0xffff, &b, &c)==NULL);
+  }
+  b=c=0;
+  TEST(find_chunk(Extent, oid, 0, 0xffff, &b, &c)==NULL);
+  snprintf((char*) path, sizeof(path), "/new");
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_size(fd)==0);
+  b=c=0;
+  TEST(find_chunk(Extent, files[fds[fd].file].oid, 0, 0xffff, &b, &c)==NULL);
+  TEST(stfs_close(fd)==0);
+  TEST(fsck()==0);
+  check_bstat();
+  check_index();
+  printf("[i] fsck: ok\n");
+}
+
+// a store left idle mounts from a checkpoint, which must hold what a
+// scan would find, until anything changes. an idle store only writes a
+// new one after enough changes. resets while writing or dropping it
+// must leave a store that mounts either way.
+static void test_checkpoint(void) {
+  static uint16_t live[NBLOCKS], deleted[NBLOCKS], next[NBLOCKS];
+  static uint32_t resets, loaded;
+  uint32_t i, b, trial, fast, full, hw, reserved;
+  stfs_format();
+  TEST(stfs_init()==0);
+  test_index_fill(40);
+  for(i=0;i<STFS_CHECKPOINT_IDLE;i++) TEST(stfs_vacuum_step()==0);
+  TEST(ckpt!=NULL);
+  for(b=0;b<NBLOCKS;b++) {
+    live[b]=bstat[b].live;
+    deleted[b]=bstat[b].deleted;
+    next[b]=bstat[b].next;
+  }
+  hw=oid_hw;
+  reserved=reserved_block;
+  stats.touched=0;
+  TEST(stfs_init()==0);
+  fast=stats.touched;
+  TEST(ckpt!=NULL);
+  for(b=0;b<NBLOCKS;b++) {
+    TEST(bstat[b].live==live[b] && bstat[b].deleted==deleted[b] && bstat[b].next==next[b]);
+  }
+  TEST(oid_hw==hw && reserved_block==reserved);
+  check_bstat();
+  check_index();
+  // any change drops it
+  test_writefile("/keys/peer000/key0", 300);
+  TEST(ckpt==NULL);
+  stats.touched=0;
+  TEST(stfs_init()==0);
+  full=stats.touched;
+  TEST(ckpt==NULL);
+  check_bstat();
+  check_index();
+  printf("[i] checkpoint: mount touching %d chunks, %d scanning\n", fast, full);
+  TEST(fast<full);
+  // a few changes aren't worth a new one when idle, only when locking
+  for(i=0;i<STFS_CHECKPOINT_IDLE;i++) TEST(stfs_vacuum_step()==0);
+  TEST(ckpt==NULL);
+  stfs_checkpoint();
+  TEST(ckpt!=NULL);
+  for(trial=0;trial<300;trial++) {
+    if(setjmp(sim_reset)==0) {
+      sim_powerfail=1+rand()%(500*4/PROGRAM_WIDTH);
+      // as after enough changes for an idle one
+      if(trial%3==0) changes=STFS_CHECKPOINT_CHANGES;
+      if(trial%3==2) stfs_checkpoint();
+      else for(i=0;i<STFS_CHECKPOINT_IDLE;i++) stfs_vacuum_step();
+      if(trial%2) test_writefile("/keys/peer001/key1", 100+trial);
+    } else {
+      resets++;
+    }
+    sim_powerfail=0;
+    TEST(stfs_init()==0);
+    if(ckpt!=NULL) loaded++;
+    while(vac.victim>=0) TEST(stfs_vacuum_step() || vac.victim<0);
+    check_bstat();
+    check_index();
+    TEST(fsck()==0);
+  }
+  printf("[i] checkpoint: ok, %d resets, %d mounts from a checkpoint\n", resets, loaded);
+}
+
+static void test_fds(void) {
+  static uint8_t data[3000], buf[3000];
+  uint8_t path[16];
+  int fd[STFS_MAX_FDS+1], i;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(vsize, 0, sizeof(vsize));
+  test_index_fill(30);
+  randombytes_buf(data, sizeof(data));
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    snprintf((char*) path, sizeof(path), "/f%d", i);
+    TEST(stfs_replace(path, data, 1000+i)==0);
+  }
+
+  // a file opened twice is shared, each fd with its own position
+  snprintf((char*) path, sizeof(path), "/f0");
+  TEST((fd[0]=stfs_open(path, 0))>=0);
+  TEST((fd[1]=stfs_open(path, 0))>=0);
+  TEST(fds[fd[0]].file==fds[fd[1]].file);
+  TEST(stfs_read(fd[0], buf, 100)==100);
+  TEST(stfs_lseek(fd[1], 0, SEEK_END)==1000);
+  TEST(stfs_write(fd[1], data+1000, 500)==500);
+  TEST(stfs_size(fd[0])==1500);
+  TEST(stfs_read(fd[0], buf+100, sizeof(buf))==1400);
+  TEST(memcmp(buf, data, 1500)==0);
+  TEST(stfs_close(fd[1])==0);
+  TEST(stfs_close(fd[0])==0);
+  check_file(path, data, 1500);
+  // so is creating a file already open
+  TEST((fd[0]=stfs_open(path, 0))>=0);
+  TEST(stfs_open(path, O_CREAT)==-1 && stfs_geterrno()==E_EXISTS);
+  TEST(stfs_close(fd[0])==0);
+
+  // readers use the inode in the flash, all fds fit on the open files
+  for(i=0;i<STFS_MAX_FDS;i++) {
+    snprintf((char*) path, sizeof(path), "/f%d", i%MAX_OPEN_FILES);
+    TEST((fd[i]=stfs_open(path, 0))>=0);
+    TEST(files[fds[fd[i]].file].ichunk>=&blocks[0][0] &&
+         files[fds[fd[i]].file].ichunk<=&blocks[NBLOCKS-1][CHUNKS_PER_BLOCK-1]);
+  }
+  TEST(stfs_open(path, 0)==-1 && stfs_geterrno()==E_NOFDS);
+  // and follow it when vacuumed
+  TEST(vacuum()==0);
+  for(i=0;i<STFS_MAX_FDS;i++) {
+    TEST(files[fds[fd[i]].file].ichunk->type==Inode);
+    TEST(stfs_read(fd[i], buf, sizeof(buf))==((i%MAX_OPEN_FILES)?1000+i%MAX_OPEN_FILES:1500));
+    TEST(memcmp(buf, data, 1000)==0);
+  }
+  for(i=0;i<STFS_MAX_FDS;i++) TEST(stfs_close(fd[i])==0);
+  for(i=0;i<MAX_OPEN_FILES;i++) TEST(files[i].refs==0);
+  for(i=0;i<STFS_DIRTY_FILES;i++) TEST(dirty[i].type==Empty);
+
+  // only files growing need a copy of their inode
+  for(i=0;i<MAX_OPEN_FILES;i++) {
+    snprintf((char*) path, sizeof(path), "/f%d", i);
+    TEST((fd[i]=stfs_open(path, 0))>=0);
+    TEST(stfs_write(fd[i], data+1, 10)==10);
+    TEST(stfs_lseek(fd[i], 0, SEEK_END)>0);
+    TEST(stfs_write(fd[i], data, 10)==((i<STFS_DIRTY_FILES)?10:-1));
+  }
+  TEST(stfs_geterrno()==E_NOFDS);
+  for(i=0;i<MAX_OPEN_FILES;i++) TEST(stfs_close(fd[i])==0);
+  memcpy(buf, data+1, 10);
+  memcpy(buf+10, data+10, 1490);
+  memcpy(buf+1500, data, 10);
+  snprintf((char*) path, sizeof(path), "/f0");
+  check_file(path, buf, 1510);
+
+  // truncating moves the inode of readers, unlinking leaves them without
+  TEST((fd[0]=stfs_open(path, 0))>=0);
+  TEST(stfs_truncate(path, 200)==0);
+  TEST(stfs_size(fd[0])==200);
+  TEST(stfs_unlink(path)==0);
+  TEST(stfs_read(fd[0], buf, 10)==-1 && stfs_geterrno()==E_NOTFOUND);
+  TEST(stfs_close(fd[0])==0);
+  TEST(stfs_close(fd[0])==-1 && stfs_geterrno()==E_NOTOPEN);
+  check_bstat();
+  check_vfiles();
+
+  printf("[i] fds: ok, %d fds on %d files in %dB of RAM, %d fds took %dB before\n",
+         STFS_MAX_FDS, MAX_OPEN_FILES, (int) (sizeof(fds)+sizeof(files)+sizeof(dirty)),
+         MAX_OPEN_FILES, (int) (MAX_OPEN_FILES*(sizeof(Chunk)+8+sizeof(files[0].chunkmap))));
+}
+
+static void test_map(void) {
+  static uint8_t data[5000], buf[5000];
+  uint8_t path[16], lpath[16];
+  const uint8_t *ptr;
+  uint32_t len, n, segs;
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(vsize, 0, sizeof(vsize));
+  randombytes_buf(data, sizeof(data));
+  snprintf((char*) path, sizeof(path), "/map");
+  snprintf((char*) lpath, sizeof(lpath), "/lmap");
+  TEST(stfs_replace(path, data, sizeof(data))==0);
+  TEST((fd=stfs_open(lpath, O_CREAT))>=0);
+  file_inode(&files[fds[fd].file])->legacy=1;
+  TEST(stfs_write(fd, data, 3000)==3000);
+  TEST(stfs_close(fd)==0);
+
+  // the segments of both kinds of files from anywhere, in order
+  TEST((fd=stfs_open(path, 0))>=0);
+  for(n=0, segs=0;(ptr=stfs_map(fd, &len))!=NULL;n+=len, segs++) {
+    TEST(len>0 && len<=EXTENT_DATA);
+    TEST(ptr>(const uint8_t*) &blocks[0][0] && ptr<(const uint8_t*) &blocks[NBLOCKS-1][CHUNKS_PER_BLOCK-1]+CHUNK_SIZE);
+    memcpy(buf+n, ptr, len);
+  }
+  TEST(n==sizeof(data) && memcmp(buf, data, n)==0);
+  TEST(stfs_lseek(fd, EXTENT_SIZE-5, SEEK_SET)==EXTENT_SIZE-5);
+  TEST((ptr=stfs_map(fd, &len))!=NULL && len==5 && memcmp(ptr, data+EXTENT_SIZE-5, 5)==0);
+  TEST((ptr=stfs_map(fd, &len))!=NULL && memcmp(ptr, data+EXTENT_SIZE, len)==0);
+  TEST(stfs_read(fd, buf, 10)==10 && memcmp(buf, data+EXTENT_SIZE+len, 10)==0);
+  TEST(stfs_close(fd)==0);
+  TEST((fd=stfs_open(lpath, 0))>=0);
+  TEST(stfs_lseek(fd, 100, SEEK_SET)==100);
+  for(n=100;(ptr=stfs_map(fd, &len))!=NULL;n+=len) {
+    TEST(len<=DATA_PER_CHUNK && memcmp(ptr, data+n, len)==0);
+  }
+  TEST(n==3000);
+  TEST(stfs_close(fd)==0);
+
+  // but not compressed or closed files
+  memset(buf, 'a', sizeof(buf));
+  TEST(stfs_creplace(path, buf, 1000)==0);
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_map(fd, &len)==NULL && len==0 && stfs_geterrno()==E_WRONGOBJ);
+  TEST(stfs_close(fd)==0);
+  TEST(stfs_map(fd, &len)==NULL && stfs_geterrno()==E_NOTOPEN);
+  check_bstat();
+
+  printf("[i] map: ok, %d bytes in %d segments without copies\n", (int) sizeof(data), (int) segs);
+}
+
+static uint32_t live_chunks(void) {
+  uint32_t b, n=0;
+  for(b=0;b<NBLOCKS;b++) n+=bstat[b].live;
+  return n;
+}
+
+static void test_lzg(void) {
+  static const char *names[]={"alice", "bob", "carol", "dave", "eve", "mallory", "trent", "peggy"};
+  static const char *hex="0123456789abcdef";
+  static const char *kinds[]={"peers", "cfg", "keylist", "encrypted"};
+  static uint8_t data[4][STFS_LZG_MAX], buf[STFS_LZG_MAX];
+  uint32_t size[4], i, j, k, chunks[2], programs[2];
+  uint8_t path[16];
+  clock_t t[2];
+  int fd;
+  stfs_format();
+  TEST(stfs_init()==0);
+  memset(vsize, 0, sizeof(vsize));
+  test_index_fill(30);
+
+  // text like objects: peer names, a config, an exported key list, and
+  // encrypted data
+  for(i=0, size[0]=0;i<60;i++) {
+    size[0]+=snprintf((char*) data[0]+size[0], sizeof(data[0])-size[0], "%s-%s%d\n",
+                      names[rand()%8], names[rand()%8], rand()%100);
+  }
+  for(i=0, size[1]=0;i<30;i++) {
+    size[1]+=snprintf((char*) data[1]+size[1], sizeof(data[1])-size[1], "%s.%s=%d\n",
+                      kinds[i%3], names[i%8], rand()%1000);
+  }
+  for(i=0, size[2]=0;size[2]+48<sizeof(data[2]);i++) {
+    size[2]+=snprintf((char*) data[2]+size[2], sizeof(data[2])-size[2], "%-8s ", names[i%8]);
+    for(k=0;k<32;k++) data[2][size[2]++]=hex[rand()%16];
+    data[2][size[2]++]='\n';
+  }
+  randombytes_buf(data[3], size[3]=sizeof(data[3]));
+
+  for(i=0;i<4;i++) {
+    for(j=0;j<2;j++) {
+      snprintf((char*) path, sizeof(path), "/%s%d", j?"lzg":"plain", i);
+      chunks[j]=live_chunks();
+      programs[j]=stats.programs;
+      TEST((j?stfs_creplace(path, data[i], size[i]):stfs_replace(path, data[i], size[i]))==0);
+      chunks[j]=live_chunks()-chunks[j];
+      programs[j]=stats.programs-programs[j];
+      check_file(path, data[i], size[i]);
+      // saving and loading, mostly the codec, the flash is simulated
+      t[j]=clock();
+      for(k=0;k<200;k++) {
+        TEST((j?stfs_creplace(path, data[i], size[i]):stfs_replace(path, data[i], size[i]))==0);
+        TEST((fd=stfs_open(path, 0))>=0);
+        TEST(stfs_read(fd, buf, sizeof(buf))==size[i]);
+        TEST(stfs_close(fd)==0);
+        stfs_vacuum_step();
+      }
+      t[j]=clock()-t[j];
+    }
+    TEST((fd=stfs_open(path, 0))>=0);
+    // encrypted data is kept plain
+    TEST(i!=3 || files[fds[fd].file].ichunk->inode.codec==STFS_PLAIN);
+    TEST(i==3 || files[fds[fd].file].ichunk->inode.codec==STFS_LZG);
+    TEST(stfs_size(fd)==size[i]);
+    TEST(chunks[1]<=chunks[0]);
+    printf("[i] lzg %-9s %4dB: %2d chunks %4d programs plain, %2d chunks %4d programs compressed (%3d%%), save+load %4.0fus plain %4.0fus compressed\n",
+           kinds[i], size[i], chunks[0], programs[0], chunks[1], programs[1], chunks[1]*100/chunks[0],
+           t[0]*1e6/CLOCKS_PER_SEC/200, t[1]*1e6/CLOCKS_PER_SEC/200);
+    TEST(stfs_close(fd)==0);
+  }
+
+  // partial reads and seeking work on the uncompressed contents
+  snprintf((char*) path, sizeof(path), "/lzg0");
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(stfs_lseek(fd, 100, SEEK_SET)==100);
+  TEST(stfs_read(fd, buf, 50)==50);
+  TEST(memcmp(buf, data[0]+100, 50)==0);
+  TEST(stfs_read(fd, buf, sizeof(buf))==size[0]-150);
+  TEST(memcmp(buf, data[0]+150, size[0]-150)==0);
+  TEST(stfs_lseek(fd, -10, SEEK_END)==size[0]-10);
+  // but not writing, other than replacing it
+  TEST(stfs_write(fd, buf, 10)==-1 && stfs_geterrno()==E_WRONGOBJ);
+  TEST(stfs_close(fd)==0);
+  TEST(stfs_truncate(path, 10)==-1 && stfs_geterrno()==E_WRONGOBJ);
+  TEST(stfs_creplace(path, buf, STFS_LZG_MAX+1)==-1 && stfs_geterrno()==E_TOOBIG);
+  TEST(stfs_creplace(path, data[1], 0)==0);
+  check_file(path, data[1], 0);
+  TEST(stfs_replace(path, data[1], size[1])==0);
+  TEST((fd=stfs_open(path, 0))>=0);
+  TEST(files[fds[fd].file].ichunk->inode.codec==STFS_PLAIN);
+  TEST(stfs_write(fd, data[0], 10)==10);
+  TEST(stfs_close(fd)==0);
+  memcpy(buf, data[1], size[1]);
+  memcpy(buf, data[0], 10);
+  check_file(path, buf, size[1]);
+
+  // and survive a remount and vacuuming
+  TEST(stfs_creplace(path, data[0], size[0])==0);
+  TEST(stfs_init()==0);
+  TEST(vacuum()==0);
+  check_bstat();
+  check_vfiles();
+  check_file(path, data[0], size[0]);
+  printf("[i] lzg: ok\n");
+}
+
+// `./stfs bench` skips the tests and only runs the benchmarks
+int main(int argc, char **argv) {
+  srand(0);
+  if(argc>1 && strlen(argv[1])==5 && memcmp(argv[1],"bench",5)==0) goto bench;
+  test_index();
+  test_readdir();
+  test_chunkmap();
+  test_vacuum();
+  test_bstat();
+  test_wear();
+  test_oids();
+  test_powerloss();
+  test_replace();
+  test_extents();
+  test_fsck();
+  test_checkpoint();
+  test_lzg();
+  test_fds();
+  test_map();
+  printf("[i] all tests passed\n");
+bench:
+  bench_read(30000);
+  bench_read(200000);
+  bench_program(4096, 0);
+  bench_program(60000, 0);
+  bench_program(400, 2000);
+  bench_workload();
+  return 0;
 }
+#endif // STFS_INLINE_TESTS
@@ -9,11 +9,107 @@
 #define NBLOCKS 6
 #define STARTBLOCK 6
 #define DATA_PER_CHUNK (CHUNK_SIZE-7)
-#define MAX_FILE_SIZE 65535
-#define MAX_OPEN_FILES 4
+#define MAX_FILE_SIZE (512*1024)
+// files of Data chunks, as written by older versions, have 16 bit sizes
+#define MAX_LEGACY_FILE_SIZE 65535
 #define MAX_DIR_SIZE 32
 
+// files open at the same time, a file opened by more than one fd is
+// open once, sharing its chunk map (see STFS_CHUNKMAP_SIZE)
+#ifndef MAX_OPEN_FILES
+#define MAX_OPEN_FILES 4
+#endif
+// fds, 8 bytes each
+#ifndef STFS_MAX_FDS
+#define STFS_MAX_FDS 8
+#endif
+// open files whose inode changed, it's kept in RAM (128B each) until the
+// last fd is closed. the inode of the others is read from the flash.
+#ifndef STFS_DIRTY_FILES
+#define STFS_DIRTY_FILES 2
+#endif
+
+// max number of inodes in the in-RAM lookup index (8 bytes each), when
+// exceeded lookups fall back to scanning the flash, 0 disables the index
+#ifndef STFS_INDEX_SIZE
+#define STFS_INDEX_SIZE 256
+#endif
+
+// files are stored in extents of up to this many chunks: data chunks
+// with only a type byte, followed by an extent chunk naming the file.
+// they are written as a whole, so this many chunks are taken from stack.
+#ifndef STFS_EXTENT_CHUNKS
+#define STFS_EXTENT_CHUNKS 8
+#endif
+#define EXTENT_DATA (CHUNK_SIZE-1)
+#define EXTENT_TAIL (CHUNK_SIZE-10)
+#define EXTENT_SIZE ((STFS_EXTENT_CHUNKS-1)*EXTENT_DATA+EXTENT_TAIL)
+
+// number of extents (or data chunks of legacy files) per open file whose
+// location is kept in RAM (2 bytes each, ~1KB for a max size file),
+// beyond that they are looked up by scanning the flash
+#ifndef STFS_CHUNKMAP_SIZE
+#define STFS_CHUNKMAP_SIZE ((MAX_LEGACY_FILE_SIZE+DATA_PER_CHUNK-1)/DATA_PER_CHUNK)
+#endif
+
+// stfs_vacuum_step() starts compacting a block when less than
+// STFS_VACUUM_LOW chunks are free and migrates at most STFS_VACUUM_STEP
+// live chunks per call, the blocking vacuum is only done when full
+#ifndef STFS_VACUUM_LOW
+#define STFS_VACUUM_LOW (CHUNKS_PER_BLOCK/2)
+#endif
+#ifndef STFS_VACUUM_STEP
+#define STFS_VACUUM_STEP 8
+#endif
+
+// when the least erased block lags more than this many erases behind
+// the most erased one, its (cold) data is moved by an idle vacuum
+#ifndef STFS_WEAR_DELTA
+#define STFS_WEAR_DELTA 16
+#endif
+
+// new chunks stfs_write collects to program in one go, each takes 128B
+// of stack
+#ifndef STFS_WRITE_BATCH
+#define STFS_WRITE_BATCH 8
+#endif
+
+// program the flash 32 bits at a time, needs a supply of 2.7-3.6V,
+// otherwise set to 0 to program bytewise
+#ifndef STFS_PROGRAM_X32
+#define STFS_PROGRAM_X32 1
+#endif
+
+// an idle stfs_vacuum_step() writes a checkpoint after this many calls
+// in a row without any change to the store, stfs_init mounts from it
+// without scanning the flash until the next change
+#ifndef STFS_CHECKPOINT_IDLE
+#define STFS_CHECKPOINT_IDLE 1000
+#endif
+
+// ... but only once the store was programmed this many times since the
+// last checkpoint, a checkpoint costs up to ~20 chunks, and the next
+// change another program to drop it. stfs_checkpoint() writes one
+// regardless, when the device locks.
+#ifndef STFS_CHECKPOINT_CHANGES
+#define STFS_CHECKPOINT_CHANGES 1024
+#endif
+
+// files written by stfs_creplace are compressed if that saves space, up
+// to this size. reading or writing one takes about twice this plus 1KB
+// of stack.
+#ifndef STFS_LZG_MAX
+#define STFS_LZG_MAX 1024
+#endif
+
+#define STFS_MAGIC 0x53465453 // "STFS"
+
 #define O_CREAT 64
+// writes go to a new file that replaces the one at path when closed, see
+// stfs_replace(). if a write fails the old contents stay. the new file
+// can only be appended to, not read until closed, and only one can be
+// open at a time.
+#define O_REPLACE 512
 
 #define E_NOFDS     0
 #define E_EXISTS    1
@@ -47,6 +143,12 @@ typedef enum {
   Deleted          = 0x00,
   Inode            = 0xAA,
   Data             = 0xCC,
+  Vacuum           = 0x55,
+  Header           = 0x33,
+  Extent           = 0x66,
+  ExtentData       = 0x99,
+  Checkpoint       = 0x3C,
+  CheckpointData   = 0xC3,
   Empty            = 0xff
 } ChunkType;
 
@@ -55,15 +157,22 @@ typedef enum {
   File               = 0x01,
 } InodeType;
 
+// codec of the data of a file
+#define STFS_PLAIN 0xff
+#define STFS_LZG   0x01
+
 typedef struct Inode_Struct {
   InodeType type :1;
   unsigned int name_len :6;
-  int padding: 1;
+  int legacy: 1; // file of Data chunks, as written by older versions
   uint16_t size;
   uint32_t parent;
   uint32_t oid;
   uint8_t name[32];
-  uint8_t data[CHUNK_SIZE - 44];
+  uint32_t replaces; // oid of the file being replaced, 0 or 0xffffffff if none
+  uint16_t size_hi;  // upper half of the size, unless legacy
+  uint8_t codec;     // STFS_PLAIN, or STFS_LZG: size is that of the lzg stream
+  uint8_t data[CHUNK_SIZE - 51];
 } __attribute((packed)) Inode_t;
 
 typedef struct Data_Struct {
@@ -72,11 +181,65 @@ typedef struct Data_Struct {
   uint8_t data[CHUNK_SIZE-7];
 } __attribute((packed)) Data_t;
 
+// closes a run of count ExtentData chunks right before it in the same
+// block, together they hold the bytes of file oid from seq*EXTENT_SIZE
+// on: EXTENT_DATA in each data chunk, then up to EXTENT_TAIL in here.
+typedef struct Extent_Struct {
+  uint8_t count;
+  uint32_t oid;
+  uint32_t seq;
+  uint8_t data[EXTENT_TAIL];
+} __attribute((packed)) Extent_t;
+
+typedef struct ExtentData_Struct {
+  uint8_t data[EXTENT_DATA];
+} __attribute((packed)) ExtentData_t;
+
+// first chunk after the header of a block while live chunks of victim
+// are migrated into it, deleted when the victim has been erased
+typedef struct Vacuum_Struct {
+  uint8_t victim;
+} __attribute((packed)) Vacuum_t;
+
+// first chunk of every block, written after erasing it
+typedef struct Header_Struct {
+  uint32_t magic;
+  uint32_t erases;
+} __attribute((packed)) Header_t;
+
+// the state stfs_init would find scanning the flash, at the end of a
+// block after count CheckpointData chunks holding the inode index. valid
+// is cleared by the first change after writing it.
+typedef struct Checkpoint_Struct {
+  uint8_t pad[3];
+  uint32_t valid;     // 0xffffffff while the checkpoint can be mounted
+  uint8_t count;
+  uint8_t reserved;   // reserved block
+  uint16_t index_len; // 0xffff if the index was not in use
+  uint32_t oid_hw;
+  struct {
+    uint16_t live;
+    uint16_t deleted;
+    uint16_t next;
+    uint32_t erases;
+  } __attribute((packed)) blocks[NBLOCKS];
+} __attribute((packed)) Checkpoint_t;
+
+typedef struct CheckpointData_Struct {
+  uint8_t data[CHUNK_SIZE-1];
+} __attribute((packed)) CheckpointData_t;
+
 typedef struct Chunk_Struct {
   ChunkType type :8;
   union {
     Inode_t inode;
     Data_t data;
+    Extent_t extent;
+    ExtentData_t extdata;
+    Vacuum_t vacuum;
+    Header_t header;
+    Checkpoint_t checkpoint;
+    CheckpointData_t ckdata;
   };
 } __attribute((packed)) Chunk;
 
@@ -86,29 +249,45 @@ typedef struct {
   uint32_t chunk;
 } ReaddirCTX;
 
+// an open file, shared by all the fds opening it
 typedef struct {
-  char free :1;
-  char idirty :1;
-  char padding :6;
-  Chunk ichunk;
-  uint32_t fptr;
+  uint8_t refs;         // fds, 0 if unused
+  uint8_t idirty;       // ichunk is a changed copy, stored by the last close
+  uint8_t replacing;    // opened with O_REPLACE, 2 once a write failed
+  uint32_t oid;
+  const Chunk *ichunk;  // the inode in flash, NULL while there is none
+  uint16_t chunkmap[STFS_CHUNKMAP_SIZE]; // seq -> block*CHUNKS_PER_BLOCK+chunk
+                                         // of the Data or Extent chunk
 } STFS_File;
 
+typedef struct {
+  uint8_t file;         // index of the STFS_File, 0xff if unused
+  uint32_t fptr;
+} STFS_Fd;
+
 int stfs_opendir(uint8_t *path, ReaddirCTX *ctx);
+int stfs_opendir_at(const Inode_t *dir, ReaddirCTX *ctx);
 const Inode_t* stfs_readdir(ReaddirCTX *ctx);
+uint32_t stfs_readdir_batch(ReaddirCTX *ctx, const Inode_t **ents, const uint32_t max, const int sorted);
 int stfs_mkdir(uint8_t *path);
 int stfs_rmdir(uint8_t *path);
 int stfs_open(uint8_t *path, uint32_t oflag);
 off_t stfs_lseek(uint32_t fildes, off_t offset, int whence);
 ssize_t stfs_write(uint32_t fildes, const void *buf, size_t nbyte);
 ssize_t stfs_read(uint32_t fildes, void *buf, size_t nbyte);
+const uint8_t* stfs_map(uint32_t fildes, uint32_t *len);
 int stfs_close(uint32_t fildes);
 int stfs_unlink(uint8_t *path);
 int stfs_truncate(uint8_t *path, uint32_t length);
+int stfs_replace(uint8_t *path, const void *buf, size_t nbyte);
+int stfs_creplace(uint8_t *path, const void *buf, size_t nbyte);
 int stfs_init();
 int stfs_geterrno(void);
 
 uint32_t stfs_size(uint32_t fildes);
 void stfs_format(void);
+int stfs_vacuum_step(void);
+void stfs_checkpoint(void);
+uint32_t stfs_max_latency(void);
 
 #endif //STFS_H
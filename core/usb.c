@@ -9,6 +9,7 @@
   */
 
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
 #include "stm32f.h"
@@ -112,6 +113,52 @@ static const char *usb_strings[] = {
 /* Buffer to be used for control requests. */
 uint8_t usbd_control_buffer[128];
 
+/**
+  * @brief  txq: transfers queued for the data out end point, sent a
+  *         packet at a time from its transfer complete callback
+  */
+static USB_Tx txq[USB_TXQ_LEN];
+static volatile unsigned char txq_head = 0;
+static volatile unsigned char txq_len = 0;
+static volatile unsigned char tx_busy = 0;
+
+/**
+  * @brief  tx_next: writes the next packet of the oldest queued transfer
+  *         called from the usb irq, or with it disabled
+  * @param  None
+  * @retval None
+  */
+static void tx_next(void) {
+  while(txq_len>0) {
+    USB_Tx *t = &txq[txq_head];
+    if(t->sent<t->size || t->zlp) {
+      const unsigned int len = (t->size-t->sent<64) ? t->size-t->sent : 64;
+      // a zlp also writes 0, tx_busy is only clear when the fifo is idle
+      if(usbd_ep_write_packet(usbd_dev, USB_CRYPTO_EP_DATA_OUT, t->buf+t->sent, len) == 0 && len>0)
+        return; // fifo busy, retried when it completes
+      t->sent+=len;
+      if(len==0) t->zlp=0;
+      tx_busy=1;
+      return;
+    }
+    txq_head = (txq_head+1) % USB_TXQ_LEN;
+    txq_len--;
+  }
+}
+
+/**
+  * @brief  usb tx complete callback for the data out end point
+  * @param  usbd_dev: pointer to usbd (libopencm3 style)
+  * @param  ep: end point (libopencm3 style)
+  * @retval None
+  */
+static void tx_done(usbd_device *usbd_dev, uint8_t ep) {
+  (void)usbd_dev;
+  (void)ep;
+  tx_busy=0;
+  tx_next();
+}
+
 /**
   * @brief  usb set config callback as per libopencm3
   */
@@ -121,7 +168,7 @@ void usb_set_config(usbd_device *usbd_dev, uint16_t wValue) {
 	usbd_ep_setup(usbd_dev, USB_CRYPTO_EP_CTRL_IN, USB_ENDPOINT_ATTR_BULK, 64, handle_ctl);
 	usbd_ep_setup(usbd_dev, USB_CRYPTO_EP_CTRL_OUT, USB_ENDPOINT_ATTR_BULK, 64, NULL);
 	usbd_ep_setup(usbd_dev, USB_CRYPTO_EP_DATA_IN, USB_ENDPOINT_ATTR_BULK, 64, handle_data);
-	usbd_ep_setup(usbd_dev, USB_CRYPTO_EP_DATA_OUT, USB_ENDPOINT_ATTR_BULK, 64, NULL);
+	usbd_ep_setup(usbd_dev, USB_CRYPTO_EP_DATA_OUT, USB_ENDPOINT_ATTR_BULK, 64, tx_done);
 }
 
 /**
@@ -157,7 +204,8 @@ void usb_init(void) {
 }
 
 /**
-  * @brief  usb_write: wraps usb_ep_write for led and retry handling
+  * @brief  usb_write: wraps usb_ep_write for led and retry handling,
+  *         responses on the data out end point go through usb_tx
   * @param  src: pkt to send
   * @param  len: len of packet
   * @param  retries: number of retries, or 0 if send until succeed.
@@ -188,3 +236,71 @@ unsigned int usb_read(unsigned char* dst) {
   return len;
 }
 
+/**
+  * @brief  usb_tx: queues a transfer on the data out end point, the
+  *         transfer complete callback sends it. transfers fitting a
+  *         packet are copied, larger ones must stay untouched until
+  *         usb_tx_pending() drops below the number queued after them
+  * @param  buf: data to send
+  * @param  size: size of buf
+  * @param  zlp: end a transfer of full packets with a zero length one
+  * @retval 0 on success, -1 if the queue is full
+  */
+int usb_tx(const unsigned char* buf, const unsigned int size, const int zlp) {
+  int ret = -1;
+  irq_disable(NVIC_OTG_FS_IRQ);
+  if(txq_len<USB_TXQ_LEN) {
+    USB_Tx *t = &txq[(txq_head+txq_len) % USB_TXQ_LEN];
+    if(size<=sizeof(t->pkt)) {
+      memcpy(t->pkt, buf, size);
+      buf = t->pkt;
+    }
+    t->buf = buf;
+    t->size = size;
+    t->sent = 0;
+    t->zlp = (zlp && size%64==0);
+    txq_len++;
+    if(!tx_busy) tx_next();
+    ret = 0;
+  }
+  irq_enable(NVIC_OTG_FS_IRQ);
+  return ret;
+}
+
+/**
+  * @brief  usb_tx_pending: number of queued transfers not yet sent
+  * @param  None
+  * @retval number of transfers
+  */
+int usb_tx_pending(void) {
+  return txq_len;
+}
+
+/**
+  * @brief  usb_tx_queued: checks if a transfer from a buffer is still
+  *         queued, a buffer is free to reuse once it is not
+  * @param  buf: start of the buffer
+  * @param  size: size of buf
+  * @retval 1 if a queued transfer starts in buf, 0 otherwise
+  */
+int usb_tx_queued(const unsigned char* buf, const unsigned int size) {
+  int i, ret = 0;
+  irq_disable(NVIC_OTG_FS_IRQ);
+  for(i=0;i<txq_len && ret==0;i++) {
+    const USB_Tx *t = &txq[(txq_head+i) % USB_TXQ_LEN];
+    if(t->buf>=buf && t->buf<buf+size) ret = 1;
+  }
+  irq_enable(NVIC_OTG_FS_IRQ);
+  return ret;
+}
+
+/**
+  * @brief  usb_tx_flush: drops all queued transfers
+  * @param  None
+  * @retval None
+  */
+void usb_tx_flush(void) {
+  irq_disable(NVIC_OTG_FS_IRQ);
+  txq_len = 0;
+  irq_enable(NVIC_OTG_FS_IRQ);
+}
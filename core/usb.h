@@ -19,10 +19,27 @@ extern usbd_device *usbd_dev;
 #define USB_CRYPTO_EP_CTRL_OUT 0x81
 #define USB_CRYPTO_EP_DATA_OUT 0x82
 
+// transfers the data out end point can have queued
+#ifndef USB_TXQ_LEN
+#define USB_TXQ_LEN 4
+#endif
+
+typedef struct {
+  const unsigned char *buf;
+  unsigned int size;
+  unsigned int sent;  // bytes written to the fifo
+  unsigned char zlp;  // a zero length packet ends the transfer
+  unsigned char pkt[64]; // copy of transfers fitting a packet
+} USB_Tx;
+
 void usb_init(void);
 void usb_start(void);
 void usb_write(const unsigned char* src, const char len, unsigned int retries, unsigned char ep);
 unsigned int usb_read(unsigned char* dst);
+int usb_tx(const unsigned char* buf, const unsigned int size, const int zlp);
+int usb_tx_pending(void);
+int usb_tx_queued(const unsigned char* buf, const unsigned int size);
+void usb_tx_flush(void);
 
 void OTG_FS_IRQHandler(void);
 
@@ -35,8 +35,7 @@ int get_user(UserRecord* userrec) {
 
 static int default_sphincs_key() {
   uint8_t pk[PQCRYPTO_PUBLICKEYBYTES],
-    _sk[crypto_secretbox_ZEROBYTES+PQCRYPTO_SECRETKEYBYTES],
-    *sk=_sk+crypto_secretbox_ZEROBYTES,
+    sk[PQCRYPTO_SECRETKEYBYTES],
     keyid[STORAGE_ID_LEN];
   randombytes_buf((void *) sk, PQCRYPTO_SECRETKEYBYTES);
   pqcrypto_sign_public_key(pk, sk);
@@ -54,15 +53,16 @@ static int default_sphincs_key() {
   if(fd<0) {
     return -1;
   } else {
-    if(cwrite(fd, _sk, PQCRYPTO_SECRETKEYBYTES, 1)==-1) return -1;
+    const int ret=cwrite(fd, sk, sizeof(sk));
+    memset(sk,0,sizeof(sk));
+    if(ret==-1) return -1;
   }
   return 0;
 }
 
 static int default_lt_key() {
   uint8_t pk[crypto_scalarmult_curve25519_BYTES],
-    _sk[crypto_secretbox_ZEROBYTES+crypto_scalarmult_curve25519_BYTES],
-    *sk=_sk+crypto_secretbox_ZEROBYTES,
+    sk[crypto_scalarmult_curve25519_BYTES],
     keyid[STORAGE_ID_LEN];
   randombytes_buf((void *) sk, crypto_scalarmult_curve25519_BYTES);
   //crypto_scalarmult_curve25519_base(pk, sk);
@@ -82,7 +82,9 @@ static int default_lt_key() {
   if(fd<0) {
     return -1;
   } else {
-    if(cwrite(fd, _sk, crypto_scalarmult_curve25519_BYTES,1)==-1) return -1;
+    const int ret=cwrite(fd, sk, sizeof(sk));
+    memset(sk,0,sizeof(sk));
+    if(ret==-1) return -1;
   }
   return 0;
 }
@@ -107,16 +109,10 @@ int new_user(UserRecord* rec, unsigned char* name, unsigned char name_len) {
   uint8_t cfgdir[]="/cfg";
   uint8_t fname[]="/cfg/user";
   stfs_mkdir(cfgdir); // just in case
-  stfs_unlink(fname); // just in case
-  int fd;
-  if((fd=stfs_open(fname, 64))==-1) {
-    return -1;
-  }
-  if(stfs_write(fd, (void*) rec, USER_META_SIZE+name_len)!=USER_META_SIZE+name_len) {
-    // short write
+  // plaintext, the name compresses, the salt doesn't
+  if(stfs_creplace(fname, (void*) rec, USER_META_SIZE+name_len)!=0) {
     return -1;
   }
-  if(stfs_close(fd)==-1) return -1;
 
   // add long-term key automatically
   if(0!=default_lt_key()) {
@@ -0,0 +1,373 @@
+#include <stdint.h>
+#include <string.h>
+#include "crypto_secretbox.h"
+#include "crypto_generichash.h"
+#include "randombytes_pitchfork.h"
+#include "pbkdf2_generichash.h"
+#include "stfs.h"
+#include "pf_store.h"
+#include "master.h"
+#include "archive.h"
+
+// top dirs whose files are encrypted with the master key, these are
+// exported decrypted, as the master key doesn't leave the device.
+static const char *sealed_dirs[]={"/lt", "/ax", "/sph", "/keys", "/pub", "/prekeys", "/peers"};
+
+static int sealed(const uint8_t *path) {
+  uint32_t i, len;
+  for(i=0;i<sizeof(sealed_dirs)/sizeof(sealed_dirs[0]);i++) {
+    len=strlen(sealed_dirs[i]);
+    if(memcmp(path, sealed_dirs[i], len)==0 && path[len]=='/') return 1;
+  }
+  return 0;
+}
+
+static void derive(PF_Archive *a, const uint8_t *salt, const uint8_t *pass, const uint32_t passlen) {
+  pbkdf2_generichash(a->key, pass, passlen, salt);
+}
+
+void archive_clear(PF_Archive *a) {
+  if(a->fd!=-1) {
+    if(a->kind==PF_ARCHIVE_SEALED) memset(a->strm.buf,0,sizeof(a->strm.buf));
+    stfs_close(a->fd);
+  }
+  if(a->rec!=NULL) memset(a->rec,0,a->recmax);
+  memset(a,0,sizeof(PF_Archive));
+  a->fd=-1;
+}
+
+/*        ----===== export =====----        */
+
+// writes the header of the archive to hdr, scratch holds a record header
+// or a piece of a file at a time, it must fit the sealed files written
+// before segments, which are read whole.
+void archive_export_start(PF_Archive *a, uint8_t *hdr, const uint8_t *pass, const uint32_t passlen, uint8_t *scratch, const uint32_t scratchlen) {
+  uint8_t *salt=hdr+PF_ARCHIVE_MAGIC_LEN;
+  memset(a,0,sizeof(PF_Archive));
+  a->fd=-1;
+  a->rec=scratch;
+  a->recmax=scratchlen;
+  memcpy(hdr, PF_ARCHIVE_MAGIC, PF_ARCHIVE_MAGIC_LEN);
+  randombytes_buf((void *) salt, PF_ARCHIVE_SALT_LEN);
+  randombytes_buf((void *) a->nonce, crypto_secretbox_NONCEBYTES);
+  memcpy(salt+PF_ARCHIVE_SALT_LEN, a->nonce, crypto_secretbox_NONCEBYTES);
+  derive(a, salt, pass, passlen);
+}
+
+static uint32_t rec_header(uint8_t *out, const uint8_t kind, const uint8_t *path, const uint32_t pathlen, const uint32_t size) {
+  out[0]=kind;
+  out[1]=pathlen;
+  memcpy(out+2, path, pathlen);
+  out[2+pathlen]=size;
+  out[3+pathlen]=size>>8;
+  out[4+pathlen]=size>>16;
+  out[5+pathlen]=size>>24;
+  return 6+pathlen;
+}
+
+static int rec_close(PF_Archive *a) {
+  const int ret=stfs_close(a->fd);
+  a->fd=-1;
+  memset(&a->strm,0,sizeof(a->strm));
+  return (ret==-1)?-1:0;
+}
+
+// opens the file at a->path and starts its record, the data follows
+// from rec_data, returns -1 on errors
+static int rec_file(PF_Archive *a, const uint32_t pathlen) {
+  const uint32_t hlen=2+pathlen+4;
+  int size, n;
+  a->kind=PF_ARCHIVE_FILE;
+  if(sealed(a->path)) {
+    a->kind=PF_ARCHIVE_SEALED;
+    if(cstream_open(&a->strm, a->path)==0) {
+      a->fd=a->strm.fd;
+      size=cstream_size(&a->strm);
+      // the first segment goes with the header, if it doesn't open, the
+      // file is a single secretbox whose nonce starts with the magic
+      if((n=cstream_read(&a->strm, a->rec+hlen))>=0) {
+        a->left=size-n;
+        a->reclen=rec_header(a->rec, PF_ARCHIVE_SEALED, a->path, pathlen, size)+n;
+        return 0;
+      }
+      if(rec_close(a)!=0 || n!=-2) return -1;
+    }
+    // a single secretbox, only small keys were written like this
+    if((size=cread(a->path, a->rec+hlen, a->recmax-hlen))<0) return -1;
+    a->reclen=rec_header(a->rec, PF_ARCHIVE_SEALED, a->path, pathlen, size)+size;
+    return 0;
+  }
+  if((a->fd=stfs_open(a->path, 0))==-1) return -1;
+  if((size=stfs_size(a->fd))<0) return -1;
+  a->left=size;
+  a->reclen=rec_header(a->rec, PF_ARCHIVE_FILE, a->path, pathlen, size);
+  return 0;
+}
+
+// reads the next piece of the file of the record into a->rec, a segment
+// at a time if it is sealed, returns -1 on errors
+static int rec_data(PF_Archive *a) {
+  int n;
+  if(a->kind==PF_ARCHIVE_SEALED) n=cstream_read(&a->strm, a->rec);
+  else n=stfs_read(a->fd, a->rec, MIN(a->left, a->recmax));
+  if(n<=0 || (uint32_t) n>a->left) return -1;
+  a->left-=n;
+  a->reclen=n;
+  return 0;
+}
+
+// walks the store depth first, reading the next entry into a->rec.
+// returns 1 if there is one, 0 at the end, -1 on errors.
+static int next_record(PF_Archive *a) {
+  const Inode_t *inode;
+  a->recoff=0;
+  a->reclen=0;
+  if(a->depth==0) {
+    uint8_t root[]="/", cfg[]="/cfg";
+    if(stfs_opendir(root, &a->dirs[0])!=0) return -1;
+    a->plen[0]=0;
+    a->depth=1;
+    // /cfg goes first, the master key of the restored store is
+    // derived from the salt in /cfg/user
+    if(stfs_opendir(cfg, &a->dirs[1])==0) {
+      memcpy(a->path, cfg, sizeof(cfg));
+      a->plen[a->depth++]=sizeof(cfg)-1;
+      a->reclen=rec_header(a->rec, PF_ARCHIVE_DIR, a->path, sizeof(cfg)-1, 0);
+      return 1;
+    }
+  }
+  for(;;) {
+    if((inode=stfs_readdir(&a->dirs[a->depth-1]))==NULL) {
+      if(--a->depth==0) return 0;
+      continue;
+    }
+    if(a->depth==1 && inode->name_len==3 && memcmp(inode->name, "cfg", 3)==0) continue;
+    // the flag of an interrupted restore isn't part of the store
+    if(a->plen[a->depth-1]==4 && memcmp(a->path, "/cfg", 4)==0 &&
+       inode->name_len==sizeof(PF_ARCHIVE_RESTORING)-6 &&
+       memcmp(inode->name, PF_ARCHIVE_RESTORING+5, inode->name_len)==0) continue;
+    break;
+  }
+  const uint32_t plen=a->plen[a->depth-1];
+  if(inode->name_len<1 || plen+1+inode->name_len>PF_ARCHIVE_PATH_MAX) return -1;
+  a->path[plen]='/';
+  memcpy(a->path+plen+1, inode->name, inode->name_len);
+  const uint32_t pathlen=plen+1+inode->name_len;
+  a->path[pathlen]=0;
+  if(inode->type!=Directory) {
+    if(rec_file(a, pathlen)!=0) return -1;
+    return 1;
+  }
+  // the store has no dirs deeper than this
+  if(a->depth>=PF_ARCHIVE_DEPTH || stfs_opendir_at(inode, &a->dirs[a->depth])!=0) return -1;
+  a->plen[a->depth++]=pathlen;
+  a->reclen=rec_header(a->rec, PF_ARCHIVE_DIR, a->path, pathlen, 0);
+  return 1;
+}
+
+// fills chunk with the next chunk of the archive: a mac and up to
+// PF_ARCHIVE_CHUNK bytes of ciphertext. returns its size, 0 after the
+// last one, which is always shorter than BUF_SIZE, and -1 on errors.
+int archive_export_next(PF_Archive *a, uint8_t *chunk) {
+  uint8_t *plain=chunk+crypto_secretbox_MACBYTES, nonce[crypto_secretbox_NONCEBYTES];
+  uint32_t len=0, n;
+  int ret=0;
+  if(a->done>1) return 0;
+  while(len<PF_ARCHIVE_CHUNK) {
+    if(a->recoff<a->reclen) {
+      n=MIN(a->reclen-a->recoff, PF_ARCHIVE_CHUNK-len);
+      memcpy(plain+len, a->rec+a->recoff, n);
+      a->recoff+=n;
+      len+=n;
+      continue;
+    }
+    memset(a->rec,0,a->reclen);
+    a->reclen=a->recoff=0;
+    // the rest of the file of the record, then the next record
+    if(a->left>0) ret=rec_data(a);
+    else if(a->fd!=-1) ret=rec_close(a);
+    else if(a->done) break;
+    else if((ret=next_record(a))==0) a->done=1;
+    if(ret<0) {
+      memset(chunk,0,len+crypto_secretbox_MACBYTES);
+      return -1;
+    }
+  }
+  // a full chunk is never the last, if the records end with it, an
+  // empty one follows
+  const int final=(len<PF_ARCHIVE_CHUNK);
+  pf_stream_nonce(nonce, a->nonce, a->seq++, final);
+  crypto_secretbox_detached(plain, chunk, plain, len, nonce, a->key);
+  if(final) a->done=2;
+  return crypto_secretbox_MACBYTES+len;
+}
+
+/*        ----===== import =====----        */
+
+int archive_import_start(PF_Archive *a, const uint8_t *hdr, const uint8_t *pass, const uint32_t passlen) {
+  memset(a,0,sizeof(PF_Archive));
+  a->fd=-1;
+  if(memcmp(hdr, PF_ARCHIVE_MAGIC, PF_ARCHIVE_MAGIC_LEN)!=0) return -1;
+  memcpy(a->nonce, hdr+PF_ARCHIVE_MAGIC_LEN+PF_ARCHIVE_SALT_LEN, crypto_secretbox_NONCEBYTES);
+  derive(a, hdr+PF_ARCHIVE_MAGIC_LEN, pass, passlen);
+  return 0;
+}
+
+// creates the entry of the record header in a->hdr, the first pass
+// only checks it
+static int rec_start(PF_Archive *a) {
+  const uint32_t pathlen=a->hdr[1];
+  memcpy(a->path, a->hdr+2, pathlen);
+  a->path[pathlen]=0;
+  a->left=a->hdr[2+pathlen] | a->hdr[3+pathlen]<<8 | a->hdr[4+pathlen]<<16 | a->hdr[5+pathlen]<<24;
+  a->kind=a->hdr[0];
+  a->hlen=0;
+  if(a->path[0]!='/') return -1;
+  if(a->kind==PF_ARCHIVE_DIR) {
+    if(a->left!=0) return -1;
+    if(!a->verified) return 0;
+    // made for the restore flag
+    if(memcmp(a->path, "/cfg", 5)==0) return 0;
+    return stfs_mkdir(a->path);
+  }
+  if(a->kind!=PF_ARCHIVE_FILE && a->kind!=PF_ARCHIVE_SEALED) return -1;
+  a->inrec=1;
+  if(!a->verified) return 0;
+  if((a->fd=stfs_open(a->path, O_CREAT))==-1) return -1;
+  if(a->kind==PF_ARCHIVE_SEALED && cstream_create(&a->strm, a->fd)!=0) {
+    a->fd=-1;
+    return -1;
+  }
+  return 0;
+}
+
+static int rec_write(PF_Archive *a, const uint8_t *data, const uint32_t len) {
+  if(!a->verified) {
+    // only checking
+  } else if(a->kind==PF_ARCHIVE_SEALED) {
+    if(cstream_write(&a->strm, data, len)!=0) {
+      a->fd=-1;
+      return -1;
+    }
+  } else if(stfs_write(a->fd, data, len)!=(int) len) return -1;
+  a->left-=len;
+  return 0;
+}
+
+static int rec_end(PF_Archive *a) {
+  int ret;
+  a->inrec=0;
+  if(!a->verified) return 0;
+  if(a->kind==PF_ARCHIVE_SEALED) ret=cstream_close(&a->strm);
+  else ret=stfs_close(a->fd);
+  a->fd=-1;
+  if(ret!=0) return -1;
+  // the master key is derived from the salt of the user, the files
+  // restored after this one are encrypted with the restored salt
+  if(memcmp(a->path, "/cfg/user", 10)==0) erase_master_key();
+  return 0;
+}
+
+static int import_records(PF_Archive *a, const uint8_t *plain, uint32_t len) {
+  uint32_t n;
+  while(len>0) {
+    if(!a->inrec) {
+      // record header, the path length is in its second byte
+      const uint32_t need=(a->hlen<2)?2:(uint32_t) 2+a->hdr[1]+4;
+      if(a->hlen>=2 && (a->hdr[1]<1 || a->hdr[1]>PF_ARCHIVE_PATH_MAX)) return -1;
+      n=MIN(len, need-a->hlen);
+      memcpy(a->hdr+a->hlen, plain, n);
+      a->hlen+=n;
+      plain+=n;
+      len-=n;
+      if(a->hlen<2 || a->hlen<(uint32_t) 2+a->hdr[1]+4) continue;
+      if(rec_start(a)!=0) return -1;
+    } else {
+      n=MIN(len, a->left);
+      if(rec_write(a, plain, n)!=0) return -1;
+      plain+=n;
+      len-=n;
+    }
+    if(a->inrec && a->left==0 && rec_end(a)!=0) return -1;
+  }
+  return 0;
+}
+
+// hashes the mac of a chunk into the macs of the pass
+static void hash_mac(PF_Archive *a, const uint8_t *mac) {
+  uint8_t buf[sizeof(a->macs)+crypto_secretbox_MACBYTES];
+  memcpy(buf, a->macs, sizeof(a->macs));
+  memcpy(buf+sizeof(a->macs), mac, crypto_secretbox_MACBYTES);
+  crypto_generichash(a->macs, sizeof(a->macs), buf, sizeof(buf), NULL, 0);
+}
+
+// wipes the store for the restore, and flags it until it is done
+static int restore_start(PF_Archive *a) {
+  uint8_t cfg[]="/cfg", flag[]=PF_ARCHIVE_RESTORING;
+  int fd;
+  stfs_format();
+  stfs_init();
+  erase_master_key();
+  a->formatted=1;
+  if(stfs_mkdir(cfg)!=0 || (fd=stfs_open(flag, O_CREAT))==-1) return -1;
+  return stfs_close(fd);
+}
+
+// 1 if a restore was interrupted and the store is incomplete, 0 if not
+int archive_restoring(void) {
+  uint8_t flag[]=PF_ARCHIVE_RESTORING;
+  const int fd=stfs_open(flag, 0);
+  if(fd==-1) return 0;
+  stfs_close(fd);
+  return 1;
+}
+
+// authenticates and restores a chunk of the archive, decrypting it in
+// place. the first pass over the archive only checks it, the store is
+// only replaced in the second, once all of it checked out, a chunk of
+// it can't be replayed under another seq or key. the second pass must
+// start with the first chunk of the first, and its macs must hash the
+// same at the end. returns 0 on success, 1 at the end of the first
+// pass, -1 on errors, -2 if the chunk is forged or truncated. once the
+// second pass wiped the store, an error or a stop loses it, the flag
+// then reports the restore at boot.
+int archive_import(PF_Archive *a, uint8_t *chunk, const uint32_t len, const int final) {
+  uint8_t *plain=chunk+crypto_secretbox_MACBYTES, nonce[crypto_secretbox_NONCEBYTES];
+  if(a->done) return -1;
+  if(len<crypto_secretbox_MACBYTES || len>BUF_SIZE || (final && len==BUF_SIZE) || (!final && len!=BUF_SIZE)) return -2;
+  const uint32_t n=len-crypto_secretbox_MACBYTES;
+  pf_stream_nonce(nonce, a->nonce, a->seq, final);
+  if(crypto_secretbox_open_detached(plain, plain, chunk, n, nonce, a->key)!=0) return -2;
+  if(a->seq==0 && !a->verified) memcpy(a->first, chunk, crypto_secretbox_MACBYTES);
+  else if(a->seq==0 && memcmp(a->first, chunk, crypto_secretbox_MACBYTES)!=0) {
+    memset(plain,0,n);
+    return -2;
+  }
+  hash_mac(a, chunk);
+  a->seq++;
+  if(a->verified && !a->formatted && restore_start(a)!=0) {
+    memset(plain,0,n);
+    return -1;
+  }
+  int ret=import_records(a, plain, n);
+  memset(plain,0,n);
+  if(ret!=0) return -1;
+  if(final) {
+    a->done=1;
+    // the last record must be complete
+    if(a->inrec || a->hlen!=0) return -2;
+    if(!a->verified) {
+      // now restore it
+      memcpy(a->digest, a->macs, sizeof(a->macs));
+      memset(a->macs,0,sizeof(a->macs));
+      a->verified=1;
+      a->done=0;
+      a->seq=0;
+      return 1;
+    }
+    if(memcmp(a->digest, a->macs, sizeof(a->macs))!=0) return -2;
+    uint8_t flag[]=PF_ARCHIVE_RESTORING;
+    if(stfs_unlink(flag)!=0) return -1;
+  }
+  return 0;
+}
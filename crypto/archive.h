@@ -0,0 +1,68 @@
+#ifndef archive_h
+#define archive_h
+
+#include <stdint.h>
+#include "stfs.h"
+#include "pf_store.h"
+#include "pitchfork.h"
+
+// a keystore archive is a header of the magic, the salt of the archive
+// key and a nonce, followed by chunks of a mac and up to
+// PF_ARCHIVE_CHUNK bytes of ciphertext. all but the last chunk are full.
+// the plaintext is a sequence of records of a kind, the length of the
+// path, the path, the length of the data (32 bit le) and the data.
+// an archive is restored in two passes over it, the first one only
+// checks it, the store is replaced in the second. the flag is in the
+// store while it is replaced, an interrupted restore leaves it behind.
+#define PF_ARCHIVE_MAGIC "PFA1"
+#define PF_ARCHIVE_MAGIC_LEN 4
+#define PF_ARCHIVE_SALT_LEN 32
+#define PF_ARCHIVE_HEADER (PF_ARCHIVE_MAGIC_LEN+PF_ARCHIVE_SALT_LEN+crypto_secretbox_NONCEBYTES)
+#define PF_ARCHIVE_CHUNK (BUF_SIZE-crypto_secretbox_MACBYTES)
+#define PF_ARCHIVE_PATH_MAX 80
+#define PF_ARCHIVE_RESTORING "/cfg/restoring"
+#define PF_ARCHIVE_RECHDR_MAX (2+PF_ARCHIVE_PATH_MAX+4)
+// levels of dirs below the root, /keys/<peer>/<keyid> is the deepest
+#define PF_ARCHIVE_DEPTH 3
+
+typedef enum {
+  PF_ARCHIVE_DIR = 'd',
+  PF_ARCHIVE_FILE = 'f',      // stored as is
+  PF_ARCHIVE_SEALED = 'e',    // decrypted, encrypted again when restored
+} PF_ArchiveKind;
+
+typedef struct {
+  uint8_t key[crypto_secretbox_KEYBYTES];
+  uint8_t nonce[crypto_secretbox_NONCEBYTES];
+  uint32_t seq;
+  uint8_t done;
+  uint8_t path[PF_ARCHIVE_PATH_MAX+1];
+  // exporting: the dirs being walked, and the record header or the next
+  // piece of its file in the scratch buf
+  ReaddirCTX dirs[PF_ARCHIVE_DEPTH];
+  uint8_t plen[PF_ARCHIVE_DEPTH];
+  uint8_t depth;
+  uint8_t *rec;
+  uint32_t recmax, reclen, recoff;
+  // restoring: the header of the current record, and the passes done
+  uint8_t hdr[PF_ARCHIVE_RECHDR_MAX];
+  uint32_t hlen;
+  uint8_t verified, formatted, inrec;
+  // the mac of the first chunk and a hash of all macs of the first
+  // pass, the second one has to be the same archive
+  uint8_t first[crypto_secretbox_MACBYTES], digest[32], macs[32];
+  // the file of the current record, and the bytes of it left
+  uint32_t left;
+  uint8_t kind;
+  int fd;
+  PF_Stream strm;
+} PF_Archive;
+
+void archive_export_start(PF_Archive *a, uint8_t *hdr, const uint8_t *pass, const uint32_t passlen, uint8_t *scratch, const uint32_t scratchlen);
+int archive_export_next(PF_Archive *a, uint8_t *chunk);
+int archive_import_start(PF_Archive *a, const uint8_t *hdr, const uint8_t *pass, const uint32_t passlen);
+int archive_import(PF_Archive *a, uint8_t *chunk, const uint32_t len, const int final);
+void archive_clear(PF_Archive *a);
+int archive_restoring(void);
+
+#endif // archive_h
@@ -76,11 +76,9 @@ static int getdents(uint8_t *path) {
     case BrPub: // /pub/peerid
     case BrKeys: { // /*/peerid/keyid
       // resolve peer
-      uint8_t peerpath[]="/peers/                                ";
-      memcpy(peerpath+7,inode->name, inode->name_len);
       int retries=3, len=0;
       uint8_t cpeer[PEER_NAME_MAX];
-      while((len=cread(peerpath, cpeer, sizeof(cpeer)))==-2 && retries-->=0) {
+      while((len=peer_name(inode->name, inode->name_len, cpeer))==-2 && retries-->=0) {
         erase_master_key();
         get_master_key("bad key");
       }
@@ -550,10 +548,8 @@ static void pubqr(uint8_t *verifier) {
                      (uint8_t*) "PITCHFORK!!5! Key Verifier", 26); // "MK")
 
   // resolve peer name
-  uint8_t peerpath[]="/peers/                                ";
-  memcpy(peerpath+7,outbuf+5, 32);
   uint8_t cpeer[PEER_NAME_MAX];
-  while((len=cread(peerpath, cpeer, sizeof(cpeer)))==-2 && retries-->=0) {
+  while((len=peer_name(outbuf+5, 32, cpeer))==-2 && retries-->=0) {
     erase_master_key();
     get_master_key("bad key");
   }
@@ -643,10 +639,13 @@ static void changepass() {
 
 static void delete() {
   disp_clear();
+  keycache_forget(outbuf);
+  peer_name_forget(outbuf);
   if(0!=stfs_unlink(outbuf)) {
     disp_print(0,DISPLAY_HEIGHT/2-4,"delete failed");
     mDelay(200);
   }
+  keyid_cache_drop();
 
   // go back from file to parent dir
   parentdir();
@@ -27,7 +27,6 @@
 
 #define VERIFIER_SIZE 16
 
-extern unsigned char outbuf[crypto_secretbox_ZEROBYTES+BUF_SIZE];
 extern MenuCtx appctx;
 
 static size_t peers=0;
@@ -18,6 +18,7 @@
 #include "display.h"
 #include "stm32f.h"
 #include "widgets.h"
+#include "pf_store.h"
 #include "pitchfork.h"
 #include "systimer.h"
 #include "user.h"
@@ -92,6 +93,9 @@ unsigned char* get_master_key(char *msg) {
 
 void erase_master_key(void) {
   memset(masterkey,0, sizeof(masterkey));
+  keyid_cache_drop();
+  keycache_clear();
+  peer_names_drop();
   pitchfork_hot=0;
 }
 
@@ -102,6 +106,8 @@ void expire_master_key(void) {
      modus == PITCHFORK_CMD_STOP ) {
 
     erase_master_key();
+    // the next boot mounts without scanning the flash
+    stfs_checkpoint();
     gui_refresh=1;
   }
 }
@@ -0,0 +1,458 @@
+/* index logic of the ring of input buffers of the data endpoint */
+/* test with `make pf-ring-test`, or by hand: `gcc -DPF_RING_INLINE_TESTS -o pf_ring pf_ring.c && ./pf_ring` */
+
+#include "pf_ring.h"
+
+/**
+  * @brief  ring_reset: empties the first n bufs and starts over
+  * @param  r: the ring
+  * @param  n: number of bufs
+  * @retval None
+  */
+void ring_reset(PF_Ring *r, const unsigned char n) {
+  unsigned int i;
+  for(i=0;i<n;i++) {
+    r->bufs[i].size = 0;
+    r->bufs[i].state = INPUT;
+  }
+  r->head = 0;
+  r->tail = 0;
+  r->sending = 0;
+}
+
+/**
+  * @brief  ring_next: tries to move input to the next buffer in the ring
+  * @param  r: the ring
+  * @param  len: number of bufs in the ring
+  * @retval index of the new input buffer, or -1 if it is still in use
+  */
+int ring_next(PF_Ring *r, const unsigned char len) {
+  Buffer *bufs = r->bufs;
+  const unsigned char next = (r->head+1) % len;
+  if(bufs[next].state == INPUT && bufs[next].size==0) {
+    if(bufs[r->head].state == INPUT)
+      bufs[r->head].state = OUTPUT;
+    r->head = next;
+    return r->head;
+  }
+  return -1;
+}
+
+/**
+  * @brief  ring_head: the buf to read the next packet into
+  * @param  r: the ring
+  * @param  len: number of bufs in the ring
+  * @retval the input buf, or NULL if all are in use
+  */
+Buffer* ring_head(PF_Ring *r, const unsigned char len) {
+  if(r->bufs[r->head].state != INPUT && ring_next(r, len) == -1) {
+    return 0;
+  }
+  return &r->bufs[r->head];
+}
+
+/**
+  * @brief  ring_rx: accounts a packet read into the input buf, a short
+  *         one ends the input, a full buf is handed to the mainloop
+  * @param  r: the ring
+  * @param  len: number of bufs in the ring
+  * @param  n: size of the packet
+  * @param  full: size of a full buf, with a short packet at its end
+  *         unless a multiple of 64
+  * @retval 0, or -1 if the input must be throttled until a buf is free
+  */
+int ring_rx(PF_Ring *r, const unsigned char len, const int n, const int full) {
+  Buffer *buf = &r->bufs[r->head];
+  buf->size+=n;
+  if(n<64 && buf->size!=full) {
+    // short buffer read finish off reading
+    buf->state = CLOSED;
+    ring_next(r, len);
+  } else if(buf->size >= full) {
+    // buffer full mark it and try to switch to the next buffer
+    buf->state = OUTPUT;
+    if(ring_next(r, len) == -1) return -1;
+  }
+  return 0;
+}
+
+/**
+  * @brief  ring_ready: the buf at tail, if it is ready to be processed
+  * @param  r: the ring
+  * @retval the buf, or NULL if there is nothing to do
+  */
+Buffer* ring_ready(const PF_Ring *r) {
+  Buffer *buf = &r->bufs[r->tail];
+  if(buf->state==SENDING || // all bufs are still being sent
+     !(((buf->state!=INPUT) && (buf->size>0)) ||
+       ((buf->state==CLOSED) && (buf->size==0)))) {
+    return 0;
+  }
+  return buf;
+}
+
+/**
+  * @brief  ring_done: moves tail past the buf just processed, a
+  *         sending one is freed by ring_reclaim once sent
+  * @param  r: the ring
+  * @param  len: number of bufs in the ring
+  * @retval 1 if a buf was freed, 0 otherwise
+  */
+int ring_done(PF_Ring *r, const unsigned char len) {
+  Buffer *buf = &r->bufs[r->tail];
+  if(buf->state == SENDING) {
+    r->sending++;
+    r->tail = (r->tail+1) % len;
+    return 0;
+  }
+  // if the irq handler is still at this full buf (and nak'ed), the
+  // input goes on in it, so tail stays
+  if(r->tail != r->head) r->tail = (r->tail+1) % len;
+  buf->size=0;
+  buf->state=INPUT;
+  return 1;
+}
+
+/**
+  * @brief  ring_reclaim: frees the sending bufs whose output has been
+  *         sent, the usb tx queue sends them in order
+  * @param  r: the ring
+  * @param  len: number of bufs in the ring
+  * @param  pending: transfers still queued
+  * @retval number of bufs freed
+  */
+int ring_reclaim(PF_Ring *r, const unsigned char len, const int pending) {
+  int freed=0;
+  while(r->sending>pending) {
+    const unsigned char i = (r->tail+len-r->sending) % len;
+    // the irq handler moves on from a full buf once the next is free,
+    // freeing it before would put the next input ahead of older bufs
+    if(i == r->head) break;
+    r->bufs[i].size=0;
+    r->bufs[i].state=INPUT;
+    r->sending--;
+    freed++;
+  }
+  return freed;
+}
+
+#ifdef PF_RING_INLINE_TESTS
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TEST(cond) if(!(cond)) { \
+    fprintf(stderr, "[x] %s:%d test failed: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  }
+
+#define MSG_MAX (12*BUF_SIZE)
+
+static Buffer bufs[PF_BUFS];
+static PF_Ring ring = { bufs, 0, 0, 0 };
+
+/* a host model of pitchfork.c: the usb irq receives a message in
+   packets, the mainloop processes the bufs either in place, queueing
+   them for sending like encrypt_block, or into outbuf like the ops with
+   a ring of PF_BUFS-1, and the usb irq sends the queued ones. the
+   output is the input xor 0x5a. */
+static struct {
+  uint8_t msg[MSG_MAX], out[MSG_MAX];
+  uint32_t size, rx, outlen;
+  int done, ended, blocked, inplace;
+  unsigned char len;
+  Buffer *txq[PF_BUFS+1];
+  int txlen;
+  uint32_t naks, bufs;
+} sim;
+
+static void sim_start(const uint32_t size, const int inplace) {
+  uint32_t i;
+  for(i=0;i<PF_BUFS;i++) bufs[i].start=bufs[i].buf+32;
+  ring_reset(&ring, PF_BUFS);
+  for(i=0;i<size;i++) sim.msg[i]=rand();
+  sim.size=size;
+  sim.rx=sim.outlen=0;
+  sim.done=sim.ended=sim.blocked=0;
+  sim.inplace=inplace;
+  sim.len=inplace?PF_BUFS:PF_BUFS-1;
+  sim.txlen=0;
+  sim.naks=sim.bufs=0;
+}
+
+// the data endpoint gets the next packet, unless it is nak'ed
+static void sim_irq(void) {
+  if(sim.done || sim.blocked) return;
+  const uint32_t n=(sim.size-sim.rx<64)?sim.size-sim.rx:64;
+  Buffer *buf=ring_head(&ring, sim.len);
+  if(buf==NULL) {
+    // the packet is retried once the endpoint is un-nak'ed
+    sim.blocked=1;
+    sim.naks++;
+    return;
+  }
+  // input never goes into a buf whose output is still queued
+  int i;
+  for(i=0;i<sim.txlen;i++) TEST(sim.txq[i]!=buf);
+  memcpy(buf->start+buf->size, sim.msg+sim.rx, n);
+  sim.rx+=n;
+  if(n<64) sim.done=1;
+  if(ring_rx(&ring, sim.len, n, BUF_SIZE)==-1) {
+    sim.blocked=1;
+    sim.naks++;
+  }
+}
+
+// the usb irq finishes sending the oldest queued buf
+static void sim_tx(void) {
+  if(sim.txlen==0) return;
+  Buffer *buf=sim.txq[0];
+  TEST(sim.outlen+buf->size<=sim.size);
+  memcpy(sim.out+sim.outlen, buf->start, buf->size);
+  sim.outlen+=buf->size;
+  sim.txlen--;
+  memmove(sim.txq, sim.txq+1, sim.txlen*sizeof(sim.txq[0]));
+}
+
+// like handle_buf
+static void sim_main(void) {
+  int i;
+  if(sim.ended) return;
+  if(ring_reclaim(&ring, sim.len, sim.txlen)>0) sim.blocked=0;
+  Buffer *buf=ring_ready(&ring);
+  if(buf==NULL) return;
+  for(i=0;i<buf->size;i++) buf->start[i]^=0x5a;
+  if(sim.inplace && buf->size>0) {
+    TEST(sim.txlen<PF_BUFS);
+    sim.txq[sim.txlen++]=buf;
+    buf->state = (buf->state == CLOSED) ? CLOSED : SENDING;
+  } else {
+    // output via outbuf is only taken once the queue is empty
+    while(sim.txlen>0) sim_tx();
+    memcpy(sim.out+sim.outlen, buf->start, buf->size);
+    sim.outlen+=buf->size;
+  }
+  sim.bufs++;
+  if(buf->state == CLOSED) {
+    while(sim.txlen>0) sim_tx();
+    sim.ended=1;
+    ring_reset(&ring, PF_BUFS);
+  } else if(ring_done(&ring, sim.len)>0) {
+    sim.blocked=0;
+  }
+}
+
+// the output so far must be the input in order
+static void check_out(void) {
+  uint32_t i;
+  for(i=0;i<sim.outlen;i++) TEST(sim.out[i]==(sim.msg[i]^0x5a));
+}
+
+// runs the model with the irqs and the mainloop interleaved at random
+static void sim_run(const uint32_t size, const int inplace, const int irqs) {
+  uint32_t i, steps;
+  sim_start(size, inplace);
+  for(steps=0;!sim.ended;steps++) {
+    TEST(steps<1000000);
+    const int r=rand()%(irqs+2);
+    if(r<irqs) {
+      for(i=1+rand()%64;i>0;i--) sim_irq();
+    } else if(r==irqs) {
+      sim_tx();
+    } else {
+      sim_main();
+    }
+  }
+  TEST(sim.rx==size);
+  TEST(sim.outlen==size);
+  check_out();
+}
+
+// messages of many bufs wrap head and tail around the ring several times,
+// the last buf closes the ring wherever it is, also empty after a zlp
+static void test_wrap(void) {
+  const uint32_t sizes[]={0, 1, 64, BUF_SIZE-1, BUF_SIZE, BUF_SIZE+1,
+                          3*BUF_SIZE+100, 7*BUF_SIZE, 11*BUF_SIZE+64*7};
+  uint32_t i, r, naks=0;
+  for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+    for(r=0;r<8;r++) {
+      sim_run(sizes[i], r&1, 1+r*8);
+      TEST(sim.bufs==sizes[i]/BUF_SIZE+1);
+      naks+=sim.naks;
+    }
+  }
+  TEST(naks>0);
+  printf("[i] wrap: ok, %d naks\n", naks);
+}
+
+// with no buf processed the ring fills up and naks, until one is freed
+static void test_full(void) {
+  uint32_t i;
+  int inplace;
+  for(inplace=0;inplace<2;inplace++) {
+    sim_start(8*BUF_SIZE+10, inplace);
+    for(i=0;i<sim.len*BUF_SIZE/64u+10;i++) sim_irq();
+    TEST(sim.blocked==1 && sim.naks==1);
+    TEST(sim.rx==sim.len*BUF_SIZE);
+    for(i=0;i<sim.len;i++) TEST(bufs[i].state==OUTPUT && bufs[i].size==BUF_SIZE);
+    TEST(ring_head(&ring, sim.len)==NULL);
+    // the oldest one is processed, in place it must be sent first
+    sim_main();
+    TEST(ring.tail==1);
+    TEST(sim.blocked==inplace);
+    sim_tx();
+    if(inplace) sim_main();
+    TEST(sim.blocked==0);
+    TEST(bufs[0].state==INPUT && bufs[0].size==0);
+    sim_irq();
+    TEST(ring.head==0 && bufs[0].size==64);
+    while(!sim.ended) {
+      sim_irq();
+      sim_main();
+      sim_tx();
+    }
+    TEST(sim.outlen==sim.size);
+    check_out();
+  }
+  printf("[i] full ring: ok\n");
+}
+
+// a short packet closes the buf in the middle of the ring, it is only
+// processed after the older bufs, and the ring starts over after it
+static void test_closed(void) {
+  uint32_t i, inplace;
+  for(inplace=0;inplace<2;inplace++) {
+    sim_start(BUF_SIZE+100, inplace);
+    for(i=0;i<BUF_SIZE/64+2;i++) sim_irq();
+    TEST(sim.done==1);
+    TEST(bufs[0].state==OUTPUT && bufs[1].state==CLOSED && bufs[1].size==100);
+    TEST(ring.head==((sim.len>2)?2:1));
+    TEST(ring_ready(&ring)==&bufs[0]);
+    sim_main();
+    TEST(ring_ready(&ring)==&bufs[1]);
+    sim_main();
+    TEST(sim.ended==1 && ring.head==0 && ring.tail==0 && ring.sending==0);
+    for(i=0;i<PF_BUFS;i++) TEST(bufs[i].state==INPUT && bufs[i].size==0);
+    TEST(sim.outlen==sim.size);
+    check_out();
+  }
+  // a zlp closes an empty buf
+  sim_start(BUF_SIZE, 0);
+  for(i=0;i<BUF_SIZE/64+1;i++) sim_irq();
+  TEST(bufs[1].state==CLOSED && bufs[1].size==0);
+  sim_main();
+  TEST(ring_ready(&ring)==&bufs[1]);
+  printf("[i] closed mid ring: ok\n");
+}
+
+// the tx queue finishes sending several bufs at once, they are freed
+// oldest first, but not the full one the irq handler is still at
+static void test_reclaim(void) {
+  uint32_t i;
+  sim_start(8*BUF_SIZE, 1);
+  for(i=0;i<PF_BUFS*BUF_SIZE/64;i++) sim_irq();
+  TEST(sim.blocked==1 && ring.head==PF_BUFS-1);
+  for(i=0;i<PF_BUFS;i++) sim_main();
+  TEST(ring.sending==PF_BUFS && ring.tail==0 && sim.txlen==PF_BUFS);
+  TEST(ring_reclaim(&ring, sim.len, sim.txlen)==0);
+  sim_tx();
+  sim_tx();
+  TEST(ring_reclaim(&ring, sim.len, sim.txlen)==2);
+  TEST(bufs[0].state==INPUT && bufs[1].state==INPUT);
+  // the rest is sent too, but the irq handler hasn't moved on from the
+  // last one yet
+  while(sim.txlen>0) sim_tx();
+  TEST(ring_reclaim(&ring, sim.len, sim.txlen)==PF_BUFS-3);
+  TEST(bufs[PF_BUFS-1].state==SENDING && ring.sending==1);
+  sim.blocked=0;
+  sim_irq();
+  TEST(ring.head==0 && bufs[0].size==64);
+  TEST(ring_reclaim(&ring, sim.len, sim.txlen)==1);
+  TEST(ring.sending==0 && bufs[PF_BUFS-1].state==INPUT);
+  TEST(sim.outlen==PF_BUFS*BUF_SIZE);
+  check_out();
+  printf("[i] reclaim: ok\n");
+}
+
+// in place, the output of a buf is sent from it, so it is neither
+// refilled nor processed again until the usb irq has sent it
+static void test_sending(void) {
+  uint32_t i;
+  sim_start(8*BUF_SIZE+10, 1);
+  for(i=0;i<BUF_SIZE/64;i++) sim_irq();
+  TEST(ring.head==1 && ring.tail==0 && bufs[0].state==OUTPUT);
+  sim_main();
+  TEST(bufs[0].state==SENDING && sim.txlen==1);
+  TEST(ring.head==1 && ring.tail==1 && ring.sending==1);
+  TEST(ring_ready(&ring)==NULL);
+  // the rest of the ring fills up, the head can't go on into the
+  // sending buf
+  for(i=0;i<(PF_BUFS-1)*BUF_SIZE/64+1;i++) sim_irq();
+  TEST(sim.blocked==1 && sim.naks==1);
+  TEST(ring.head==PF_BUFS-1 && bufs[PF_BUFS-1].state==OUTPUT);
+  TEST(ring_head(&ring, sim.len)==NULL && ring.head==PF_BUFS-1);
+  for(i=1;i<PF_BUFS;i++) {
+    TEST(ring_ready(&ring)==&bufs[i]);
+    sim_main();
+    TEST(bufs[i].state==SENDING && ring.sending==i+1);
+  }
+  // all bufs are queued, the tail is back at the oldest one
+  TEST(ring.tail==0 && sim.txlen==PF_BUFS && sim.blocked==1);
+  TEST(ring_ready(&ring)==NULL);
+  sim_main();
+  TEST(sim.txlen==PF_BUFS && ring.sending==PF_BUFS);
+  // once it is sent, it is free for input but has nothing to process
+  sim_tx();
+  sim_main();
+  TEST(bufs[0].state==INPUT && bufs[0].size==0);
+  TEST(ring.sending==PF_BUFS-1 && ring.tail==0 && sim.blocked==0);
+  TEST(ring_ready(&ring)==NULL);
+  sim_irq();
+  TEST(ring.head==0 && bufs[0].size==64);
+  TEST(bufs[PF_BUFS-1].state==SENDING);
+  while(!sim.ended) {
+    sim_irq();
+    sim_main();
+    sim_tx();
+  }
+  TEST(sim.outlen==sim.size);
+  check_out();
+  printf("[i] sending: ok\n");
+}
+
+// the cost of the bookkeeping alone, per 64B packet and per buf
+static void bench_ring(void) {
+  const uint32_t nbufs=200000;
+  uint32_t i, j;
+  Buffer *buf;
+  ring_reset(&ring, PF_BUFS);
+  const clock_t start=clock();
+  for(i=0;i<nbufs;i++) {
+    for(j=0;j<BUF_SIZE/64;j++) {
+      TEST((buf=ring_head(&ring, PF_BUFS))!=NULL);
+      ring_rx(&ring, PF_BUFS, 64, BUF_SIZE);
+    }
+    TEST((buf=ring_ready(&ring))!=NULL);
+    buf->state=SENDING;
+    ring_done(&ring, PF_BUFS);
+    ring_reclaim(&ring, PF_BUFS, 0);
+  }
+  const double secs=(double) (clock()-start)/CLOCKS_PER_SEC;
+  printf("[i] bench ring: %d bufs in %.2fs, %.1f ns/packet, %.0f MB/s of bookkeeping\n",
+         nbufs, secs, secs*1e9/nbufs/(BUF_SIZE/64), (double) nbufs*BUF_SIZE/1024/1024/secs);
+}
+
+int main(void) {
+  srand(0);
+  test_wrap();
+  test_full();
+  test_closed();
+  test_reclaim();
+  test_sending();
+  printf("[i] all tests passed\n");
+  bench_ring();
+  return 0;
+}
+#endif // PF_RING_INLINE_TESTS
@@ -0,0 +1,67 @@
+#ifndef pf_ring_h
+#define pf_ring_h
+
+// the host tests build without libsodium
+#ifndef PF_RING_INLINE_TESTS
+#include <crypto_secretbox.h>
+#else
+#define crypto_secretbox_ZEROBYTES 32
+#endif
+
+#define BUF_SIZE 32768
+
+// number of input buffers in the ring of the data endpoint, the irq
+// handler fills them in turn while the mainloop processes the oldest.
+// the last one doubles as outbuf, kex and pqsign use bufs[0] and
+// bufs[1] as scratch, so at least 3
+#ifndef PF_BUFS
+#define PF_BUFS 3
+#endif
+#if PF_BUFS < 3
+#error "PF_BUFS must be at least 3"
+#endif
+
+/**
+  * @brief  Buffer_State: USB buffer state
+  */
+typedef enum {
+  INPUT,      // buffer is ready to accept
+  OUTPUT,     // buffer is awaiting output processing
+  CLOSED,     // buffer is the final one.
+  SENDING     // buffer is processed, its output is still being sent
+} Buffer_State;
+
+/**
+  * @brief  Buffer: USB read buffer for data double buffering
+  */
+typedef struct {
+  Buffer_State state;                                        /* buffer state (i/o/c) */
+  int size;                                                  /* size of buffer */
+  unsigned char* start;                                      /* ptr to start of unused space in buffer */
+  unsigned char buf[BUF_SIZE+crypto_secretbox_ZEROBYTES+64]; /* extra crypto_secretbox_ZEROBYTES (32) for encryption
+                                                              * and decryption needs 16 (mac)
+                                                              */
+} Buffer;
+
+/**
+  * @brief  PF_Ring: the ring of the first len bufs, the irq handler
+  *         fills the one at head, the mainloop processes the one at
+  *         tail, the sending ones before tail wait for their output to
+  *         be sent. len depends on the op, so it is passed to each call.
+  */
+typedef struct {
+  Buffer *bufs;
+  volatile unsigned char head;  // owned by the irq handler
+  volatile unsigned char tail;  // owned by the mainloop
+  unsigned char sending;
+} PF_Ring;
+
+void ring_reset(PF_Ring *r, const unsigned char n);
+int ring_next(PF_Ring *r, const unsigned char len);
+Buffer* ring_head(PF_Ring *r, const unsigned char len);
+int ring_rx(PF_Ring *r, const unsigned char len, const int n, const int full);
+Buffer* ring_ready(const PF_Ring *r);
+int ring_done(PF_Ring *r, const unsigned char len);
+int ring_reclaim(PF_Ring *r, const unsigned char len, const int pending);
+
+#endif // pf_ring_h
@@ -1,6 +1,9 @@
 #include "usb.h"
 #include "pf_store.h"
 #include "crypto_secretbox.h"
+#include "crypto_stream_xsalsa20.h"
+#include "crypto_onetimeauth_poly1305.h"
+#include "crypto_verify_16.h"
 #include "randombytes_pitchfork.h"
 #include <crypto_generichash.h>
 #include <string.h>
@@ -10,6 +13,7 @@
 #include "axolotl.h"
 #include "xeddsa_keygen.h"
 #include <utils.h>
+#include "mpu.h"
 
 static int hexreduce(int b) {
   if(b>='a') return b-'a'+10;
@@ -77,80 +81,397 @@ static unsigned int combine(unsigned char* a, unsigned char alen, unsigned char*
   return alen+blen+2;
 }
 
-// closes fd
-// plain needs to be crypto_secretbox_ZEROBYTES padded, len not!
-// uses stack to store file! use only on small files
-int cwrite(int fd, uint8_t *plain, uint32_t len, uint8_t clear) {
-  // nonce for encryption, for efficiency stored at beginning of output buffer
-  uint8_t out[crypto_secretbox_NONCEBYTES+len+crypto_secretbox_MACBYTES];
-  // todo factor ut out or outtmp, write directly to file
-  randombytes_buf((void *) out, crypto_secretbox_NONCEBYTES);
-  // padded output buffer
-  uint8_t outtmp[crypto_secretbox_ZEROBYTES+len];
-  // zeroed out
-  memset(plain,0, crypto_secretbox_ZEROBYTES);
-  crypto_secretbox(outtmp,                         // ciphertext output
-                   (uint8_t*) plain,               // plaintext input
-                   len+crypto_secretbox_ZEROBYTES, // plain length
-                   out,                            // nonce
-                   get_master_key("store key"));   // key
-
-  // clear plaintext seed in RAM
-  if(clear) memset(plain,0, len+crypto_secretbox_ZEROBYTES);
-  memcpy(out+crypto_secretbox_NONCEBYTES, outtmp+crypto_secretbox_BOXZEROBYTES, len+crypto_secretbox_MACBYTES);
-  int ret;
-  if((ret=stfs_write(fd, out, crypto_secretbox_NONCEBYTES+len+crypto_secretbox_MACBYTES)) !=
-                              crypto_secretbox_NONCEBYTES+len+crypto_secretbox_MACBYTES) {
+// nonce of segment seq of a stream, the last one is flagged, so streams
+// can't be truncated or reordered
+void pf_stream_nonce(uint8_t *nonce, const uint8_t *base, const uint32_t seq, const int final) {
+  memcpy(nonce, base, crypto_secretbox_NONCEBYTES);
+  nonce[crypto_secretbox_NONCEBYTES-4]^=seq;
+  nonce[crypto_secretbox_NONCEBYTES-3]^=seq>>8;
+  nonce[crypto_secretbox_NONCEBYTES-2]^=seq>>16;
+  nonce[crypto_secretbox_NONCEBYTES-1]^=(seq>>24) | (final?0x80:0);
+}
+
+// encrypts len bytes of plain into mac and the ciphertext following it
+// in out, plain may be out+crypto_secretbox_MACBYTES
+static void seal_segment(uint8_t *out, const uint8_t *plain, const uint32_t len, PF_Stream *s, const int final) {
+  uint8_t nonce[crypto_secretbox_NONCEBYTES];
+  pf_stream_nonce(nonce, s->nonce, s->seq, final);
+  crypto_secretbox_detached(out+crypto_secretbox_MACBYTES, out, plain, len, nonce,
+                            get_master_key("store key"));
+  s->seq++;
+}
+
+static int stream_header(PF_Stream *s, uint8_t *out) {
+  memcpy(out, PF_STREAM_MAGIC, PF_STREAM_MAGIC_LEN);
+  randombytes_buf((void *) s->nonce, crypto_secretbox_NONCEBYTES);
+  memcpy(out+PF_STREAM_MAGIC_LEN, s->nonce, crypto_secretbox_NONCEBYTES);
+  s->seq=0;
+  s->len=0;
+  return PF_STREAM_HEADER;
+}
+
+// starts a segmented encrypted file on the new file fd
+int cstream_create(PF_Stream *s, int fd) {
+  uint8_t hdr[PF_STREAM_HEADER];
+  s->fd=fd;
+  stream_header(s, hdr);
+  if(stfs_write(fd, hdr, sizeof(hdr))!=sizeof(hdr)) {
     stfs_close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+static int stream_flush(PF_Stream *s, const int final) {
+  const uint32_t n=crypto_secretbox_MACBYTES+s->len;
+  seal_segment(s->buf, s->buf+crypto_secretbox_MACBYTES, s->len, s, final);
+  s->len=0;
+  if(stfs_write(s->fd, s->buf, n)!=(int) n) return -1;
+  return 0;
+}
+
+// encrypts and appends len bytes of plain, a segment at a time
+int cstream_write(PF_Stream *s, const uint8_t *plain, uint32_t len) {
+  while(len>0) {
+    // a full segment is only sealed once it's known not to be the last
+    if(s->len==PF_SEGMENT_SIZE && stream_flush(s, 0)!=0) {
+      memset(s->buf,0,sizeof(s->buf));
+      stfs_close(s->fd);
+      return -1;
+    }
+    const uint32_t n=MIN(len, PF_SEGMENT_SIZE-s->len);
+    memcpy(s->buf+crypto_secretbox_MACBYTES+s->len, plain, n);
+    s->len+=n;
+    plain+=n;
+    len-=n;
+  }
+  return 0;
+}
+
+// seals the last segment and closes the file
+int cstream_close(PF_Stream *s) {
+  int ret=stream_flush(s, 1);
+  memset(s->buf,0,sizeof(s->buf));
+  if(stfs_close(s->fd)==-1) ret=-1;
+  return ret;
+}
+
+// opens fname if it is a segmented encrypted file
+int cstream_open(PF_Stream *s, uint8_t *fname) {
+  uint8_t hdr[PF_STREAM_HEADER];
+  if((s->fd=stfs_open(fname, 0))==-1) return -1;
+  const uint32_t size=stfs_size(s->fd);
+  if(size<PF_STREAM_HEADER+crypto_secretbox_MACBYTES ||
+     stfs_read(s->fd, hdr, sizeof(hdr))!=sizeof(hdr) ||
+     memcmp(hdr, PF_STREAM_MAGIC, PF_STREAM_MAGIC_LEN)!=0) {
+    stfs_close(s->fd);
+    return -1;
+  }
+  memcpy(s->nonce, hdr+PF_STREAM_MAGIC_LEN, crypto_secretbox_NONCEBYTES);
+  s->seq=0;
+  s->len=size-PF_STREAM_HEADER;
+  return 0;
+}
+
+// plaintext size of the next segment of s, 0 after the last
+uint32_t cstream_next(const PF_Stream *s) {
+  if(s->len<=crypto_secretbox_MACBYTES) return 0;
+  return MIN(s->len-crypto_secretbox_MACBYTES, PF_SEGMENT_SIZE);
+}
+
+// plaintext size of the rest of s
+uint32_t cstream_size(const PF_Stream *s) {
+  const uint32_t segs=(s->len+crypto_secretbox_MACBYTES+PF_SEGMENT_SIZE-1)/(crypto_secretbox_MACBYTES+PF_SEGMENT_SIZE);
+  return s->len-segs*crypto_secretbox_MACBYTES;
+}
+
+// decrypts the next segment into out, which can hold cstream_next(s)
+// bytes, returns their number or -1 on errors and -2 if forged.
+int cstream_read(PF_Stream *s, uint8_t *out) {
+  uint8_t nonce[crypto_secretbox_NONCEBYTES];
+  const uint32_t n=cstream_next(s);
+  const int final=(s->len==crypto_secretbox_MACBYTES+n);
+  if(s->len<crypto_secretbox_MACBYTES) return -1;
+  if(stfs_read(s->fd, s->buf, crypto_secretbox_MACBYTES)!=crypto_secretbox_MACBYTES ||
+     (n>0 && stfs_read(s->fd, out, n)!=(int) n)) {
+    return -1;
+  }
+  pf_stream_nonce(nonce, s->nonce, s->seq, final);
+  if(crypto_secretbox_open_detached(out, out, s->buf, n, nonce, get_master_key("load key"))!=0) {
+    memset(out,0,n);
+    return -2;
+  }
+  s->len-=crypto_secretbox_MACBYTES+n;
+  s->seq++;
+  return n;
+}
+
+// closes fd, after encrypting and writing plain to it
+int cwrite(int fd, const uint8_t *plain, uint32_t len) {
+  PF_Stream s;
+  if(cstream_create(&s, fd)!=0 || cstream_write(&s, plain, len)!=0) {
     //todo stfs_unlink(file);
     return -1;
   }
-  if(stfs_close(fd)==-1) {
+  if(cstream_close(&s)!=0) {
     //LOG(1,"[x] failed to close keyfile, err: %d\n", stfs_geterrno());
     //todo stfs_unlink(file);
     return -1;
   }
-
   return 0;
 }
 
+// decrypted keys of the unlocked session, in a ram region the mpu keeps
+// closed except in here, so the hot keys cost no read, decrypt or
+// keygen. only /keys and /lt, whose files change only in write_enc and
+// by deleting them in the browser, least recently used go first.
+#define KEYCACHE_PATH_MAX (6+2*33+1)
+#define KEYCACHE_KEY_MAX 32
+
+typedef struct {
+  uint32_t used;
+  uint8_t path[KEYCACHE_PATH_MAX];
+  uint8_t len;
+  uint8_t haspk;
+  uint8_t key[KEYCACHE_KEY_MAX];
+  uint8_t pk[crypto_scalarmult_curve25519_BYTES];
+} KeycacheEntry;
+
+#define KEYCACHE_ENTRIES (MPU_KEYCACHE_SIZE/sizeof(KeycacheEntry))
+
+static KeycacheEntry keycache[KEYCACHE_ENTRIES] __attribute__((section(".keycache")));
+// uninitialized at boot, entries are valid only after this was cleared
+static uint8_t keycache_valid;
+static uint32_t keycache_clock;
+
+static int keycache_cacheable(const uint8_t *path, const uint32_t len) {
+  return len<=KEYCACHE_KEY_MAX && strlen((char*) path)<KEYCACHE_PATH_MAX &&
+    (memcmp(path, "/keys/", 6)==0 || memcmp(path, "/lt/", 4)==0);
+}
+
+// returns the open entry of path, or NULL
+static KeycacheEntry* keycache_find(const uint8_t *path) {
+  const uint32_t len=strlen((char*) path)+1;
+  uint32_t i;
+  if(!keycache_valid || len>KEYCACHE_PATH_MAX) return NULL;
+  for(i=0;i<KEYCACHE_ENTRIES;i++) {
+    if(keycache[i].used && memcmp(keycache[i].path, path, len)==0) {
+      keycache[i].used=++keycache_clock;
+      return &keycache[i];
+    }
+  }
+  return NULL;
+}
+
+void keycache_clear(void) {
+  mpu_keycache_open();
+  memset(keycache,0,sizeof(keycache));
+  mpu_keycache_close();
+  keycache_valid=1;
+  keycache_clock=0;
+}
+
+void keycache_forget(const uint8_t *path) {
+  mpu_keycache_open();
+  KeycacheEntry *e=keycache_find(path);
+  if(e!=NULL) memset(e,0,sizeof(KeycacheEntry));
+  mpu_keycache_close();
+}
+
+static int keycache_get(const uint8_t *path, uint8_t *key, const uint32_t len) {
+  int ret=-1;
+  mpu_keycache_open();
+  KeycacheEntry *e=keycache_find(path);
+  if(e!=NULL && e->len==len) {
+    memcpy(key, e->key, len);
+    ret=0;
+  }
+  mpu_keycache_close();
+  return ret;
+}
+
+static void keycache_put(const uint8_t *path, const uint8_t *key, const uint32_t len) {
+  uint32_t i;
+  if(!keycache_valid) keycache_clear();
+  mpu_keycache_open();
+  KeycacheEntry *e=&keycache[0];
+  for(i=1;i<KEYCACHE_ENTRIES;i++) {
+    if(keycache[i].used<e->used) e=&keycache[i];
+  }
+  memset(e,0,sizeof(KeycacheEntry));
+  memcpy(e->path, path, strlen((char*) path)+1);
+  memcpy(e->key, key, len);
+  e->len=len;
+  e->used=++keycache_clock;
+  mpu_keycache_close();
+}
+
+// the derived public key cached along the key of path
+static int keycache_getpk(const uint8_t *path, uint8_t *pk) {
+  int ret=-1;
+  mpu_keycache_open();
+  KeycacheEntry *e=keycache_find(path);
+  if(e!=NULL && e->haspk) {
+    memcpy(pk, e->pk, sizeof(e->pk));
+    ret=0;
+  }
+  mpu_keycache_close();
+  return ret;
+}
+
+static void keycache_setpk(const uint8_t *path, const uint8_t *pk) {
+  mpu_keycache_open();
+  KeycacheEntry *e=keycache_find(path);
+  if(e!=NULL) {
+    memcpy(e->pk, pk, sizeof(e->pk));
+    e->haspk=1;
+  }
+  mpu_keycache_close();
+}
+
+// opens a secretbox from the flash: the mac is computed straight on the
+// mapped ciphertext, which is then decrypted in place in buf.
 int cread(uint8_t *fname, uint8_t *buf, uint32_t len) {
+  const int cacheable=(buf!=NULL && keycache_cacheable(fname, len));
+  if(cacheable && keycache_get(fname, buf, len)==0) return len;
+  PF_Stream strm;
+  if(cstream_open(&strm, fname)==0) {
+    uint32_t size=0, n;
+    int ret=0;
+    while((n=cstream_next(&strm))>0 || strm.len>0) {
+      if(buf!=NULL && size+n>len) {
+        ret=-1; // larger than buf
+        break;
+      }
+      // without buf the segment is only checked, in the stream's buf
+      if((ret=cstream_read(&strm, (buf!=NULL)?buf+size:strm.buf+crypto_secretbox_MACBYTES))<0) break;
+      size+=n;
+    }
+    stfs_close(strm.fd);
+    memset(&strm,0,sizeof(strm));
+    if(ret>=0) {
+      if(cacheable && size==len) keycache_put(fname, buf, len);
+      return size;
+    }
+    if(buf!=NULL) memset(buf,0,MIN(size,len));
+    // the random nonce of a single secretbox can start with the magic,
+    // such a file is only known by failing to open as segments
+    if(ret!=-2) return ret;
+  }
+  // files written before segments, a single secretbox
   int fd;
   if((fd=stfs_open(fname, 0))==-1) {
     //LOG(1,"[x] failed to open %s, err: %d\n", fname, stfs_geterrno());
     return -1;
   }
 
-  unsigned char cipher[len + crypto_secretbox_ZEROBYTES];
-  memset(cipher,0, crypto_secretbox_BOXZEROBYTES);
-
-  uint8_t nonce[crypto_secretbox_NONCEBYTES];
-  if(stfs_read(fd,nonce,crypto_secretbox_NONCEBYTES)!=crypto_secretbox_NONCEBYTES) {
+  uint8_t nonce[crypto_secretbox_NONCEBYTES], mac[crypto_secretbox_MACBYTES];
+  if(stfs_read(fd,nonce,crypto_secretbox_NONCEBYTES)!=crypto_secretbox_NONCEBYTES ||
+     stfs_read(fd,mac,crypto_secretbox_MACBYTES)!=crypto_secretbox_MACBYTES) {
     //LOG(1,"[x] failed reading nonce from file '%s' err: %d\n", fname, stfs_geterrno());
     stfs_close(fd);
     return -1;
   }
-
-  int size=stfs_read(fd,cipher+crypto_secretbox_BOXZEROBYTES,len + crypto_secretbox_MACBYTES);
-  if(stfs_close(fd)==-1) {
-    //LOG(1,"[x] failed to close file, err: %d\n", stfs_geterrno());
+  const int fsize=stfs_size(fd);
+  uint32_t size=fsize-crypto_secretbox_NONCEBYTES-crypto_secretbox_MACBYTES;
+  if(fsize<=crypto_secretbox_NONCEBYTES+crypto_secretbox_MACBYTES) {
+    //LOG(1,"[x] file '%s' is to short: %d, expected: %d\n", fname, size, len + crypto_secretbox_MACBYTES);
+    stfs_close(fd);
     return -1;
   }
-  if(size<=crypto_secretbox_MACBYTES) {
-    //LOG(1,"[x] file '%s' is to short: %d, expected: %d\n", fname, size, len + crypto_secretbox_MACBYTES);
+  if(size>len) size=len;
+
+  // the first block of the stream keys poly1305, the rest encrypts
+  const uint8_t *key=get_master_key("load key");
+  uint8_t block0[64];
+  crypto_onetimeauth_poly1305_state st;
+  crypto_stream_xsalsa20(block0, sizeof(block0), nonce, key);
+  crypto_onetimeauth_poly1305_init(&st, block0);
+  uint32_t done, seglen;
+  const uint8_t *seg;
+  for(done=0;done<size && (seg=stfs_map(fd, &seglen))!=NULL;done+=seglen) {
+    if(seglen>size-done) seglen=size-done;
+    crypto_onetimeauth_poly1305_update(&st, seg, seglen);
+    if(buf!=NULL) memcpy(buf+done, seg, seglen);
+  }
+  if(stfs_close(fd)==-1 || done<size) {
+    //LOG(1,"[x] failed to close file, err: %d\n", stfs_geterrno());
+    memset(block0,0,sizeof(block0));
+    memset(&st,0,sizeof(st));
+    if(buf!=NULL) memset(buf,0,size);
     return -1;
   }
-  unsigned char plain[size + crypto_secretbox_ZEROBYTES];
-  // decrypt
-  if(crypto_secretbox_open(plain, cipher, size+crypto_secretbox_BOXZEROBYTES, nonce, get_master_key("load key")) == -1) {
+  uint8_t tag[crypto_secretbox_MACBYTES];
+  crypto_onetimeauth_poly1305_final(&st, tag);
+  memset(&st,0,sizeof(st));
+  if(crypto_verify_16(tag, mac)!=0) {
+    memset(block0,0,sizeof(block0));
+    if(buf!=NULL) memset(buf,0,size);
     return -2;
   }
+  // decrypt
   if(buf!=NULL) {
-    memcpy(buf, plain+crypto_secretbox_ZEROBYTES,size-crypto_secretbox_MACBYTES);
+    for(done=0;done<size && done<32;done++) buf[done]^=block0[32+done];
+    if(size>32) crypto_stream_xsalsa20_xor_ic(buf+32, buf+32, size-32, nonce, 1, key);
   }
-  memset(plain,0,sizeof(plain));
+  memset(block0,0,sizeof(block0));
+  if(cacheable && size==len) keycache_put(fname, buf, len);
 
-  return size-crypto_secretbox_MACBYTES;
+  return size;
+}
+
+// names of the peers resolved since unlocking, by peerid, so listings
+// decrypt each /peers file once. dropped when locked.
+static PeerName peernames[PEERNAME_CACHE_SIZE];
+static uint32_t peernames_next;
+
+void peer_names_drop(void) {
+  memset(peernames,0,sizeof(peernames));
+  peernames_next=0;
+}
+
+static void peer_name_put(const uint8_t *peerid, const uint8_t *name, const uint8_t len) {
+  // the oldest entry goes first
+  PeerName *e=&peernames[peernames_next++ % PEERNAME_CACHE_SIZE];
+  memcpy(e->peerid, peerid, STORAGE_ID_LEN);
+  memcpy(e->name, name, len);
+  e->len=len;
+}
+
+void peer_name_forget(const uint8_t *path) {
+  uint8_t peerid[STORAGE_ID_LEN];
+  uint32_t i;
+  if(memcmp(path, "/peers/", 7)!=0 || strlen((char*) path)!=7+STORAGE_ID_LEN*2 ||
+     unhex(peerid, path+7, STORAGE_ID_LEN*2)==-1) return;
+  for(i=0;i<PEERNAME_CACHE_SIZE;i++) {
+    if(peernames[i].len && memcmp(peernames[i].peerid, peerid, STORAGE_ID_LEN)==0) {
+      memset(&peernames[i],0,sizeof(PeerName));
+    }
+  }
+}
+
+/*
+  * @brief  peer_name: resolves a peerid to the name of the peer
+  * @param  hex: peerid in hex, as named in the store
+  * @param  hexlen: length of hex
+  * @param  name: buffer of PEER_NAME_MAX receiving the name
+  * @retval length of name, -1 if unknown or -2 on a bad master key like cread
+  */
+int peer_name(const uint8_t *hex, const int hexlen, uint8_t *name) {
+  uint8_t peerid[STORAGE_ID_LEN];
+  uint32_t i;
+  if(hexlen!=STORAGE_ID_LEN*2 || unhex(peerid, hex, hexlen)==-1) return -1;
+  for(i=0;i<PEERNAME_CACHE_SIZE;i++) {
+    if(peernames[i].len && memcmp(peernames[i].peerid, peerid, STORAGE_ID_LEN)==0) {
+      memcpy(name, peernames[i].name, peernames[i].len);
+      return peernames[i].len;
+    }
+  }
+  uint8_t peerpath[]="/peers/                                ";
+  memcpy(peerpath+7, hex, hexlen);
+  int len=cread(peerpath, name, PEER_NAME_MAX);
+  if(len>0) peer_name_put(peerid, name, len);
+  return len;
 }
 
 int save_peer(uint8_t *peer, const uint8_t len) {
@@ -168,36 +489,21 @@ int save_peer(uint8_t *peer, const uint8_t len) {
     return 0;
   }
 
-  // pad peer for cwrite
-  uint8_t paddedpeer[crypto_secretbox_ZEROBYTES+len],
-    *ppeer=paddedpeer+crypto_secretbox_ZEROBYTES;
-  memset(paddedpeer,0,crypto_secretbox_ZEROBYTES);
-  memcpy(ppeer, peer, len);
-
   // store new peer
-  return cwrite(fd, paddedpeer, len, 0);
+  if(cwrite(fd, peer, len)!=0) return -1;
+  peer_name_put(peerid, peer, len);
+  return 0;
 }
 
 int write_enc(uint8_t *path, const uint8_t *key, const int keylen) {
-  // open file
-  int fd;
-  if((fd=stfs_open(path, 64))==-1) {
-    // exists, overwrite contents
-    if((fd=stfs_open(path, 0))==-1) {
-      // failed to open file
-      return -1;
-    }
-  }
-
-  uint8_t plain[crypto_secretbox_ZEROBYTES+keylen];
-  memset(plain,0,crypto_secretbox_ZEROBYTES);
-  memcpy(plain+crypto_secretbox_ZEROBYTES, key, keylen);
-
-  if(cwrite(fd, plain, keylen, 1)!=0) {
-    //LOG(1, "[x] failed to store ctx '%s'\n", axolotldir);
+  keycache_forget(path);
+  // the segments are sealed one at a time and appended to a new file,
+  // the old contents stay until it is completely written and closed
+  const int fd=stfs_open(path, O_REPLACE);
+  if(fd==-1 || cwrite(fd, key, keylen)!=0) {
+    //LOG(1, "[x] failed to store ctx '%s'\n", path);
     return -1;
   }
-  // todo maybe stfs_truncate(path, keylen);
   return 0;
 }
 
@@ -243,6 +549,7 @@ int store_key(const uint8_t* key, const int keylen, const char *type, const uint
   if(0!=write_enc(path, key, keylen)) {
     return -1;
   }
+  if(keyid) keyid_cache_drop();
   return 0;
 }
 
@@ -405,13 +712,9 @@ unsigned char peer2seed(unsigned char* key, unsigned char* peer, const unsigned
   return 1;
 }
 
-int ekid2key(uint8_t *ekid, uint8_t* path, const int dirlen, uint8_t* key, const int keysize) {
-  //crypto_generichash(ekid, EKID_LEN,                                     // output
-  //                   keyid+EKID_LEN, EKID_NONCE_LEN,                     // nonce
-  //                   (unsigned char*) seedrec->keyid, STORAGE_ID_LEN);   // key
-  //if(sodium_memcmp(ekid,keyid,EKID_LEN) == 0)
-  //  return seedrec;
-
+// looks up ekid by hashing the names of all keys under path, for dirs
+// that aren't cached or didn't fit the cache
+static int ekid_walk(uint8_t *ekid, uint8_t* path, const int dirlen, uint8_t* key, const int keysize) {
   path[dirlen]=0;
   ReaddirCTX pctx, kctx;
   if(stfs_opendir(path, &pctx)!=0) {
@@ -419,38 +722,128 @@ int ekid2key(uint8_t *ekid, uint8_t* path, const int dirlen, uint8_t* key, const
     return -1;
   }
   path[dirlen]='/';
-  const Inode_t *inode;
-  while((inode=stfs_readdir(&pctx))!=0) {
-    if(inode->name_len>32 || inode->name_len<1) {
-      continue; // todo flag error?
-    }
-    memcpy(path+dirlen+1,inode->name, inode->name_len);
-    path[dirlen+33]=0;
-    stfs_opendir(path, &kctx);
-    path[dirlen+33]='/';
-    while((inode=stfs_readdir(&kctx))!=0) {
-      if(inode->name_len>32 || inode->name_len<1) {
+  // peers are listed in batches, their key dirs are opened by inode
+  // instead of path, which saves a lookup per peer
+  const Inode_t *peers[16], *inode;
+  uint32_t n, i;
+  while((n=stfs_readdir_batch(&pctx, peers, 16, 0))>0) {
+    for(i=0;i<n;i++) {
+      if(peers[i]->name_len>32 || peers[i]->name_len<1) {
         continue; // todo flag error?
       }
-      uint8_t keyid[STORAGE_ID_LEN];
-      if(unhex(keyid, inode->name, inode->name_len)==-1) {
-        // fail invalid hex digit in filename, ignore and skip
+      if(stfs_opendir_at(peers[i], &kctx)!=0) {
         continue;
       }
-      unsigned char _ekid[EKID_LEN];
-      crypto_generichash(_ekid, EKID_LEN,                // output
-                         ekid+EKID_LEN, EKID_NONCE_LEN, // nonce
-                         keyid, STORAGE_ID_LEN);         // key
-      if(sodium_memcmp(_ekid,ekid,EKID_LEN) == 0) {
-        // found key
-        memcpy(path+dirlen+33+1, inode->name, inode->name_len);
-        path[dirlen+2*33]=0;
-        if(cread(path, key, keysize)==keysize) {
-          return 0;
+      while((inode=stfs_readdir(&kctx))!=0) {
+        if(inode->name_len>32 || inode->name_len<1) {
+          continue; // todo flag error?
+        }
+        uint8_t keyid[STORAGE_ID_LEN];
+        if(unhex(keyid, inode->name, inode->name_len)==-1) {
+          // fail invalid hex digit in filename, ignore and skip
+          continue;
+        }
+        unsigned char _ekid[EKID_LEN];
+        crypto_generichash(_ekid, EKID_LEN,                // output
+                           ekid+EKID_LEN, EKID_NONCE_LEN, // nonce
+                           keyid, STORAGE_ID_LEN);         // key
+        if(sodium_memcmp(_ekid,ekid,EKID_LEN) == 0) {
+          // found key
+          memcpy(path+dirlen+1,peers[i]->name, peers[i]->name_len);
+          path[dirlen+33]='/';
+          memcpy(path+dirlen+33+1, inode->name, inode->name_len);
+          path[dirlen+2*33]=0;
+          if(cread(path, key, keysize)==keysize) {
+            return 0;
+          }
+        }
+      }
+    }
+  }
+  // nothing found
+  return -1;
+}
+
+// keyids of the keys ekid2key looks up, in ram, so that a lookup hashes
+// the candidates without walking the store. filled on the first lookup
+// after unlocking, dropped when keys are stored, deleted or locked.
+static const char *keyid_dirs[]={"/keys", "/ax"};
+static KeyidEntry keyids[KEYID_CACHE_SIZE];
+static uint32_t nkeyids;
+static enum {KeyidsStale, KeyidsValid, KeyidsPartial} keyids_state=KeyidsStale;
+
+void keyid_cache_drop(void) {
+  memset(keyids,0,sizeof(keyids));
+  nkeyids=0;
+  keyids_state=KeyidsStale;
+}
+
+static int keyid_dir(const uint8_t *path, const int dirlen) {
+  uint32_t i;
+  for(i=0;i<sizeof(keyid_dirs)/sizeof(keyid_dirs[0]);i++) {
+    if((int) strlen(keyid_dirs[i])==dirlen && memcmp(path, keyid_dirs[i], dirlen)==0) return i;
+  }
+  return -1;
+}
+
+static void keyid_cache_fill(void) {
+  ReaddirCTX pctx, kctx;
+  const Inode_t *peers[16], *inode;
+  uint8_t path[16];
+  uint32_t n, i, d;
+  keyids_state=KeyidsValid;
+  for(d=0;d<sizeof(keyid_dirs)/sizeof(keyid_dirs[0]);d++) {
+    memcpy(path, keyid_dirs[d], strlen(keyid_dirs[d])+1);
+    if(stfs_opendir(path, &pctx)!=0) continue;
+    while((n=stfs_readdir_batch(&pctx, peers, 16, 0))>0) {
+      for(i=0;i<n;i++) {
+        if(stfs_opendir_at(peers[i], &kctx)!=0) continue;
+        while((inode=stfs_readdir(&kctx))!=0) {
+          KeyidEntry *e=&keyids[nkeyids];
+          if(nkeyids>=KEYID_CACHE_SIZE ||
+             peers[i]->name_len!=STORAGE_ID_LEN*2 || inode->name_len!=STORAGE_ID_LEN*2) {
+            // not cached, lookups in here also walk the store
+            keyids_state=KeyidsPartial;
+            continue;
+          }
+          if(unhex(e->peerid, peers[i]->name, STORAGE_ID_LEN*2)==-1 ||
+             unhex(e->keyid, inode->name, STORAGE_ID_LEN*2)==-1) {
+            // fail invalid hex digit in filename, ignore and skip
+            continue;
+          }
+          e->dir=d;
+          nkeyids++;
         }
       }
     }
   }
+}
+
+int ekid2key(uint8_t *ekid, uint8_t* path, const int dirlen, uint8_t* key, const int keysize) {
+  const int d=keyid_dir(path, dirlen);
+  if(d==-1) return ekid_walk(ekid, path, dirlen, key, keysize);
+  if(keyids_state==KeyidsStale) keyid_cache_fill();
+
+  uint32_t i;
+  for(i=0;i<nkeyids;i++) {
+    if(keyids[i].dir!=d) continue;
+    unsigned char _ekid[EKID_LEN];
+    crypto_generichash(_ekid, EKID_LEN,                // output
+                       ekid+EKID_LEN, EKID_NONCE_LEN, // nonce
+                       keyids[i].keyid, STORAGE_ID_LEN); // key
+    if(sodium_memcmp(_ekid,ekid,EKID_LEN) == 0) {
+      // found key
+      path[dirlen]='/';
+      stohex(path+dirlen+1, keyids[i].peerid, STORAGE_ID_LEN);
+      path[dirlen+33]='/';
+      stohex(path+dirlen+33+1, keyids[i].keyid, STORAGE_ID_LEN);
+      path[dirlen+2*33]=0;
+      if(cread(path, key, keysize)==keysize) {
+        return 0;
+      }
+    }
+  }
+  if(keyids_state==KeyidsPartial) return ekid_walk(ekid, path, dirlen, key, keysize);
   // nothing found
   return -1;
 }
@@ -463,7 +856,10 @@ int load_ltkeypair(Axolotl_KeyPair *kp) {
   }
   //crypto_scalarmult_curve25519_base(kp->pk, kp->sk);
   sc_clamp(kp->sk);
-  curve25519_keygen(kp->pk,kp->sk);
+  if(keycache_getpk(path, kp->pk)!=0) {
+    curve25519_keygen(kp->pk,kp->sk);
+    keycache_setpk(path, kp->pk);
+  }
   return 1;
 }
 
@@ -4,6 +4,7 @@
 #include "stfs.h"
 #include "user.h"
 #include "axolotl.h"
+#include "crypto_secretbox.h"
 
 #define STORAGE_ID_LEN 16
 #define USER_SALT_LEN 32
@@ -12,17 +13,69 @@
 #define EKID_NONCE_LEN 15
 #define EKID_SIZE (EKID_LEN+EKID_NONCE_LEN)
 
+// number of keys in /keys and /ax whose ids ekid2key keeps in ram
+#ifndef KEYID_CACHE_SIZE
+#define KEYID_CACHE_SIZE 128
+#endif
+
+typedef struct {
+  uint8_t dir;
+  uint8_t peerid[STORAGE_ID_LEN];
+  uint8_t keyid[STORAGE_ID_LEN];
+} KeyidEntry;
+
+// encrypted files are a header of the magic and a nonce, followed by
+// segments of a mac and up to PF_SEGMENT_SIZE bytes of ciphertext, each
+// a secretbox of its own. files without the magic are a single one.
+#define PF_SEGMENT_SIZE 256
+#define PF_STREAM_MAGIC "PFS1"
+#define PF_STREAM_MAGIC_LEN 4
+#define PF_STREAM_HEADER (PF_STREAM_MAGIC_LEN+crypto_secretbox_NONCEBYTES)
+
+typedef struct {
+  int fd;
+  uint32_t seq;
+  uint32_t len; // buffered plaintext when writing, bytes left when reading
+  uint8_t nonce[crypto_secretbox_NONCEBYTES];
+  uint8_t buf[crypto_secretbox_MACBYTES+PF_SEGMENT_SIZE];
+} PF_Stream;
+
+// number of peer names peer_name() keeps in ram
+#ifndef PEERNAME_CACHE_SIZE
+#define PEERNAME_CACHE_SIZE 64
+#endif
+
+typedef struct {
+  uint8_t peerid[STORAGE_ID_LEN];
+  uint8_t len;
+  uint8_t name[PEER_NAME_MAX];
+} PeerName;
+
 #ifndef MIN
 #define MIN(a, b)      (((a) < (b)) ? (a) : (b))
 #endif
 
-int cwrite(int fd, uint8_t *plain, uint32_t len, uint8_t clear);
+void pf_stream_nonce(uint8_t *nonce, const uint8_t *base, const uint32_t seq, const int final);
+int cwrite(int fd, const uint8_t *plain, uint32_t len);
+int cstream_create(PF_Stream *s, int fd);
+int cstream_write(PF_Stream *s, const uint8_t *plain, uint32_t len);
+int cstream_close(PF_Stream *s);
+int cstream_open(PF_Stream *s, uint8_t *fname);
+uint32_t cstream_next(const PF_Stream *s);
+uint32_t cstream_size(const PF_Stream *s);
+int cstream_read(PF_Stream *s, uint8_t *out);
 int cread(uint8_t *fname, uint8_t *buf, uint32_t len);
 int save_seed(unsigned char *seed, unsigned char* peer, unsigned char len);
 int load_key(uint8_t *path, int sep, uint8_t *buf, int buflen);
 int peerbykeyid(uint8_t *keyid, uint8_t *path, uint8_t *peer);
 unsigned char peer2seed(unsigned char* key, unsigned char* peer, const unsigned char len);
 int ekid2key(uint8_t *ekid, uint8_t* path, const int dirlen,  uint8_t* key, const int keysize);
+void keyid_cache_drop(void);
+void keycache_clear(void);
+int peer_name(const uint8_t *hex, const int hexlen, uint8_t *name);
+void peer_name_forget(const uint8_t *path);
+void peer_names_drop(void);
+void keycache_forget(const uint8_t *path);
 int topeerid(uint8_t *peerid, const uint8_t *peer, const int len);
 int load_ltkeypair(Axolotl_KeyPair *kp);
 int get_owner(uint8_t *name);
@@ -39,9 +39,22 @@
 
 #include "pqcrypto_sign.h"
 #include "sphinx_ops.h"
+#include "archive.h"
+#include "systimer.h"
+#include "itoa.h"
 
 #define outstart32 (outbuf+crypto_secretbox_ZEROBYTES)
 
+#ifdef PF_BENCH
+// core clock, the dwt cycle counter runs at it
+#define PF_BENCH_HZ 120000000
+/**
+  * @brief  bench: cycles spent on the blocks of a buffered op, and their
+  *         size, shown as KB/s when the op ends
+  */
+static uint64_t bench_cycles, bench_bytes;
+#endif // PF_BENCH
+
 /*        ----===== typedefs =====----        */
 /**
   * @brief  CMD_Buffer: USB read buffer for commands
@@ -58,11 +71,6 @@ extern usbd_device *usbd_dev;
 
 /*        ----===== local globals =====----        */
 
-/**
-  * @brief  active_buf: index in bufs to active input buffer
-  */
-static unsigned char active_buf = 0;
-
 /**
   * @brief  modus: state of PITCHFORK, off is PITCHFORK_CMD_STOP
   */
@@ -88,16 +96,34 @@ static unsigned char nonce[crypto_secretbox_NONCEBYTES];
   */
 static unsigned char params[128+64];
 
+/**
+  * @brief  archive: state of a key store export or import
+  */
+static PF_Archive archive;
+
+/**
+  * @brief  rng_ts, rng_bytes: start of the rng stream and the bytes
+  *         queued since, rng_shown: when its rate was last shown
+  */
+static unsigned long long rng_ts, rng_shown;
+static uint64_t rng_bytes;
+
+/**
+  * @brief  outbuf_sending: end of the response queued from outbuf, 0
+  *         once reclaim_bufs found it sent and wiped it
+  */
+static int outbuf_sending=0;
+
 /*        ----===== exported globals =====----        */
 /**
-  * @brief  bufs: input double buffering
+  * @brief  bufs: ring of input buffers
   */
-Buffer bufs[2];
+Buffer bufs[PF_BUFS];
 
 /**
-  * @brief  outbuf: output buffer
+  * @brief  ring: head, tail and sending bufs of the ring, see pf_ring.c
   */
-unsigned char outbuf[crypto_secretbox_ZEROBYTES+BUF_SIZE];
+static PF_Ring ring = { bufs, 0, 0, 0 };
 
 /*        ----===== helper functions =====----        */
 
@@ -116,18 +142,35 @@ static void cmd_clear(void) {
 }
 
 /**
-  * @brief  toggle_buf: tries to switch double buffering
+  * @brief  ring_len: number of bufs in the ring, outbuf is only part of
+  *         it for the ops processing their input in place
   * @param  None
-  * @retval ptr to active_buf, or -1 on error
+  * @retval number of bufs
+  */
+static unsigned char ring_len(void) {
+  switch(modus) {
+  case PITCHFORK_CMD_ENCRYPT:
+  case PITCHFORK_CMD_DECRYPT:
+  case PITCHFORK_CMD_SIGN:
+  case PITCHFORK_CMD_PQSIGN:
+  case PITCHFORK_CMD_VERIFY:
+  case PITCHFORK_CMD_IMPORT: return PF_BUFS;
+  default: return PF_BUFS-1;
+  }
+}
+
+/**
+  * @brief  show_rate: shows a throughput on the status line
+  * @param  kbs: KB/s
+  * @retval None
   */
-static int toggle_buf(void) {
-  if(bufs[!active_buf].state == INPUT && bufs[!active_buf].size==0) {
-    if(bufs[active_buf].state == INPUT)
-      bufs[active_buf].state = OUTPUT;
-    active_buf = !active_buf;
-    return active_buf;
-  }
-  return -1;
+static void show_rate(uint32_t kbs) {
+  char line[12]="           ", num[11];
+  int len=itos(num, kbs)-1;
+  if(len>6) len=6;
+  memcpy(line+6-len, num, len);
+  memcpy(line+6, " KB/s", 5);
+  disp_print(40,DISPLAY_HEIGHT-8, line);
 }
 
 /**
@@ -138,10 +181,7 @@ static int toggle_buf(void) {
 static void pf_reset(void) {
   unsigned int i;
   modus = PITCHFORK_CMD_STOP;
-  bufs[0].size = 0;
-  bufs[1].size = 0;
-  bufs[0].state = INPUT;
-  bufs[1].state = INPUT;
+  ring_reset(&ring, PF_BUFS);
   blocked = 0;
   for (i=0;i<(sizeof(params)>>2);i++) ((unsigned int*) params)[i]=0;
   usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
@@ -192,19 +232,30 @@ static int query_user(char* op) {
   return res;
 }
 
-static void pf_send(uint8_t *buf, int size, CRYPTO_CMD m) {
-  int len, i;
-  for(i=0;i<size && (modus == m);i+=len) {
-    len = (size-i)>=64?64:(size-i);
-    /* usb_write(buf+i,len,32,USB_CRYPTO_EP_DATA_OUT); */
-    while((usbd_ep_write_packet(usbd_dev, USB_CRYPTO_EP_DATA_OUT, buf+i, len) == 0) &&
-          (modus == m))
-      usbd_poll(usbd_dev); // todo why are we polling here?
+/**
+  * @brief  pf_send: queues a response on the data end point, the usb
+  *         irq sends it while the mainloop goes on. responses fitting a
+  *         packet are copied by usb_tx, larger ones from outside the bufs
+  *         to outbuf, those in the bufs must stay untouched until sent.
+  *         outbuf is kept from the ring until its response is sent
+  * @param  buf: response
+  * @param  size: size of buf, a zlp follows if it is a multiple of 64
+  * @retval 0, or -1 if outbuf or the queue is busy and the caller has to
+  *         retry in a later pass of the mainloop. ops sending a single
+  *         response start with both free, see handle_cmd
+  */
+static int pf_send(const uint8_t *buf, const int size) {
+  if(size>64 && (buf<(const uint8_t*) bufs || buf>=(const uint8_t*) (bufs+PF_BUFS))) {
+    if(outbuf_sending>0) return -1;
+    memcpy(outbuf, buf, size);
+    buf=outbuf;
   }
-  if(size%64==0) {
-    uDelay(100);
-    usb_write(NULL,0,32,USB_CRYPTO_EP_DATA_OUT);
+  if(usb_tx(buf, size, 1)!=0) return -1;
+  if(buf>=outbuf && buf<outbuf+sizeof(outbuf) && size>0) {
+    outbuf_sending=buf-outbuf+size;
+    bufs[PF_BUFS-1].state=SENDING;
   }
+  return 0;
 }
 
 /*        ----===== handlers for specific operations =====----        */
@@ -221,41 +272,36 @@ static void incnonce() {
 /**
   * @brief  encrypt_block: handler for encrypt op
   * @param  buf: ptr one of the input buffer structs
-  *         encrypts buffer and sends ciphertext back via usb
+  *         encrypts buffer in place and queues the ciphertext for usb
   * @retval None
   */
 static void encrypt_block(Buffer *buf) {
-  int i, len, size = buf->size;
+  int i, size = buf->size;
   // zero out beginning of plaintext as demanded by nacl
   for(i=0;i<(crypto_secretbox_ZEROBYTES>>2);i++) ((unsigned int*) buf->buf)[i]=0;
   // encrypt (key is stored in beginning of params)
-  crypto_secretbox(outbuf, buf->buf, size+crypto_secretbox_ZEROBYTES, nonce, params);
+  crypto_secretbox(buf->buf, buf->buf, size+crypto_secretbox_ZEROBYTES, nonce, params);
   size+=crypto_secretbox_MACBYTES; // add mac size to total size
-  // send usb packet sized result
-  for(i=0;i<size;i+=len) {
-    len = (size-i)>=64?64:(size-i);
-    irq_disable(NVIC_OTG_FS_IRQ);
-    usb_write(outbuf+16+i, len, 0, USB_CRYPTO_EP_DATA_OUT);
-    irq_enable(NVIC_OTG_FS_IRQ);
-  }
+  // sent from the usb irq, while we get on with the next block
+  while(usb_tx(buf->buf+crypto_secretbox_BOXZEROBYTES, size, 0)!=0);
+  buf->state = (buf->state == CLOSED) ? CLOSED : SENDING;
   incnonce();
 }
 
 /**
   * @brief  decrypt_block: handler for decrypt op,
-  *         decrypts buffer and sends plaintext back via usb
+  *         decrypts buffer in place and queues the plaintext for usb
   * @param  buf: ptr one of the input buffer structs
   * @retval None
   */
 static void decrypt_block(Buffer* buf) {
-  int i, len;
   // substract nonce size from total size (16B)
   int size = buf->size - crypto_secretbox_MACBYTES;
   // zero out crypto_secretbox_BOXZEROBYTES preamble
   // overwriting the end of the nonce
   sodium_memzero(buf->start - crypto_secretbox_BOXZEROBYTES,crypto_secretbox_BOXZEROBYTES);
   // decrypt (key is stored in beginning of params)
-  if(-1 == crypto_secretbox_open(outbuf,                                       // m
+  if(-1 == crypto_secretbox_open((buf->start) - crypto_secretbox_BOXZEROBYTES, // m
                                  (buf->start) - crypto_secretbox_BOXZEROBYTES, // c + preamble
                                  size+crypto_secretbox_ZEROBYTES,              // clen = len(plain)+2x(boxzerobytes)
                                  nonce,                                        // n
@@ -264,13 +310,9 @@ static void decrypt_block(Buffer* buf) {
     pf_reset();
     return;
   }
-  // send usb packet sized result
-  for(i=0;i<size;i+=len) {
-    len = (size-i)>=64?64:(size-i);
-    irq_disable(NVIC_OTG_FS_IRQ); // todo why disable irqs, and why in-loop?
-    usb_write(outstart32+i, len, 0, USB_CRYPTO_EP_DATA_OUT);
-    irq_enable(NVIC_OTG_FS_IRQ); // todo why reenable irqs, and why in-loop?
-  }
+  // sent from the usb irq, while we get on with the next block
+  while(usb_tx(buf->start+crypto_secretbox_MACBYTES, size, 0)!=0);
+  buf->state = (buf->state == CLOSED) ? CLOSED : SENDING;
   incnonce();
 }
 
@@ -310,7 +352,7 @@ void kex_start() {
   // send off my_pk
   modus = PITCHFORK_CMD_KEX_START;
   usb_write((unsigned char*) "tx", 2, 32,USB_CRYPTO_EP_CTRL_OUT);
-  pf_send((uint8_t*) &my_pk, sizeof(my_pk), PITCHFORK_CMD_KEX_START);
+  pf_send((uint8_t*) &my_pk, sizeof(my_pk));
   pf_reset();
 }
 
@@ -348,7 +390,7 @@ int kex_resp(Buffer *buf) {
   }
   // send off my_pk
   memcpy(&my_pk.prekeyid,o_pk->ephemeralkey,16); // to remind the initiator what he used
-  pf_send((uint8_t*)&my_pk, sizeof(my_pk), PITCHFORK_CMD_KEX_RESPOND);
+  pf_send((uint8_t*)&my_pk, sizeof(my_pk));
 
   return 0;
 }
@@ -448,7 +490,7 @@ int ax_send_init(uint8_t *peer, uint32_t peerlen) {
   // unpad to output buf
   memcpy(hnonce+crypto_secretbox_NONCEBYTES, header_enc+16, sizeof(header_enc)-16);
   // send off headers
-  pf_send(outbuf, crypto_secretbox_NONCEBYTES+sizeof(header_enc)-16, PITCHFORK_CMD_AX_SEND);
+  pf_send(outbuf, crypto_secretbox_NONCEBYTES+sizeof(header_enc)-16);
 
   ctx.ns++;
   crypto_generichash(ctx.cks, crypto_scalarmult_curve25519_BYTES, // output
@@ -500,8 +542,9 @@ static void ax_recv_init(Buffer *buf) {
   sodium_memzero((uint8_t*) &ctx,sizeof(ctx));
   // send usb packet sized result
   usb_write((unsigned char*) "tx", 2, 32,USB_CRYPTO_EP_CTRL_OUT);
-  pf_send(outstart32, out_len, PITCHFORK_CMD_AX_RECEIVE);
-  sodium_memzero(outstart32,out_len);
+  // reclaim_bufs wipes the plaintext once sent, only then outbuf joins
+  // the ring if the decrypt goes on
+  pf_send(outstart32, out_len);
 
   if(out_len==32768) {
     modus=PITCHFORK_CMD_DECRYPT;
@@ -537,7 +580,7 @@ static void sign_msg(void) {
   }
   sodium_memzero((uint8_t*) &kp,sizeof(kp));
 
-  pf_send(sig, sizeof(sig), PITCHFORK_CMD_SIGN);
+  pf_send(sig, sizeof(sig));
   sodium_memzero(sig,sizeof(sig));
 }
 
@@ -578,11 +621,11 @@ static void verify_msg(void) {
         if(0==xed25519_verify(params /* 64 bytes */, key, h, sizeof(h))) {
           disp_print(0,DISPLAY_HEIGHT/2+5,"       ok");
           // todo recover peer name and send it back also
-          uint8_t peerpath[]="/peers/                                ";
-          memcpy(peerpath+7,inode->name,inode->name_len);
-          if((olen=cread(peerpath, owner+1, olen))>0 && olen<=32) {
+          int nlen;
+          if((nlen=peer_name(inode->name, inode->name_len, owner+1))>0) {
+            olen=nlen;
             owner[0]='1';
-            usb_write((unsigned char*) owner, olen+1, 32,USB_CRYPTO_EP_DATA_OUT);
+            pf_send((uint8_t*) owner, olen+1);
             owner[olen+1]=0;
             disp_print(0,DISPLAY_HEIGHT/2+5," ok, from");
             disp_print(0,DISPLAY_HEIGHT+14,(char*) owner+1);
@@ -601,7 +644,7 @@ static void verify_msg(void) {
       disp_print(0,DISPLAY_HEIGHT/2+5,"       ok");
       olen = get_owner(owner+1);
       owner[0]='1';
-      usb_write((unsigned char*) owner, olen+1, 32,USB_CRYPTO_EP_DATA_OUT);
+      pf_send((uint8_t*) owner, olen+1);
       owner[olen+1]=0;
       disp_print(0,DISPLAY_HEIGHT/2+5,"     from");
       disp_print(0,DISPLAY_HEIGHT/2+14,(char*) owner+1);
@@ -610,7 +653,7 @@ static void verify_msg(void) {
   }
 
   disp_print(0,DISPLAY_HEIGHT/2-4,"     invalid");
-  usb_write((unsigned char*) "0", 1, 32,USB_CRYPTO_EP_DATA_OUT);
+  pf_send((uint8_t*) "0", 1);
 }
 
 /**
@@ -637,30 +680,144 @@ static void pqsign_msg(void) {
   disp_print(0,DISPLAY_HEIGHT/2," doing pq magic ");
   // save bufs
   uint8_t* olds1 = bufs[0].start, *olds2=bufs[1].start;
-  // sign with sphincs, send back sig
-  pqcrypto_sign((uint8_t*) bufs, h, sk);
+  // sign with sphincs, the sig is larger than a buf, so it runs over
+  // the headers of bufs[0] and bufs[1]
+  uint8_t *sig = (uint8_t*) bufs;
+  pqcrypto_sign(sig, h, sk);
   sodium_memzero(sk,PQCRYPTO_SECRETKEYBYTES);
 
-  pf_send((uint8_t*) bufs, PQCRYPTO_BYTES, PITCHFORK_CMD_PQSIGN);
+  // move it off the headers into the data of both bufs, pf_reset
+  // rewrites the headers while the sig is still being sent
+  memmove(bufs[1].buf, sig+BUF_SIZE, PQCRYPTO_BYTES-BUF_SIZE);
+  memmove(bufs[0].buf, sig, BUF_SIZE);
 
   // restore bufs
   bufs[0].start=olds1; bufs[1].start=olds2;
+
+  // send back sig as one transfer, the first part is all full packets
+  // so no zlp, the bufs are left alone until sent, see handle_cmd
+  while(usb_tx(bufs[0].buf, BUF_SIZE, 0)!=0);
+  while(usb_tx(bufs[1].buf, PQCRYPTO_BYTES-BUF_SIZE, 1)!=0);
+}
+
+/**
+  * @brief  get_archive_pass: reads the passphrase of a key store archive
+  * @param  pass: buffer for the passphrase
+  * @param  size: size of pass
+  * @retval length of the passphrase
+  */
+static int get_archive_pass(uint8_t *pass, const int size) {
+  int len;
+  if(!cmd_blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_CTRL_IN, 1);
+  if(!blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 1);
+  disp_clear();
+  disp_print_inv(0,0,"archive pass");
+  memset(pass,0,size);
+  len=get_passcode(pass, size);
+  gui_refresh=1;
+  if(!cmd_blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_CTRL_IN, 0);
+  if(!blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
+  return len;
+}
+
+/**
+  * @brief  export_keys: starts an archive of the key store, sends its
+  *         header, the records are read into bufs[0]
+  * @param  None
+  * @retval None
+  */
+static void export_keys(void) {
+  uint8_t pass[65], hdr[PF_ARCHIVE_HEADER];
+  int len;
+  // keys are archived decrypted, unlock before asking for the archive pass
+  get_master_key("export keys");
+  len=get_archive_pass(pass, sizeof(pass));
+  archive_export_start(&archive, hdr, pass, len, bufs[0].buf, sizeof(bufs[0].buf));
+  sodium_memzero(pass,sizeof(pass));
+  pf_send(hdr, sizeof(hdr));
+}
+
+/**
+  * @brief  export_handler: sends the next chunk of the archive from
+  *         outbuf, once the previous one is out of it. one per pass, so
+  *         a stop cmd gets in between
+  * @param  None
+  * @retval None
+  */
+static void export_handler(void) {
+  int size;
+  if(outbuf_sending>0) return;
+  if((size=archive_export_next(&archive, outbuf))>0) {
+    // only the header might still be queued before it
+    pf_send(outbuf, size);
+    return;
+  }
+  if(size<0) {
+    usb_write((unsigned char*) "err: export", 12, 32,USB_CRYPTO_EP_CTRL_OUT);
+  }
+  archive_clear(&archive);
+  pf_reset();
+}
+
+/**
+  * @brief  import_block: handler for import op, checks a chunk of an
+  *         archive in the first pass over it, and restores it in the
+  *         second, the last one is in the closed buffer
+  * @param  buf: ptr one of the input buffer structs
+  * @retval None
+  */
+static void import_block(Buffer *buf) {
+  const int ret=archive_import(&archive, buf->start, buf->size, buf->state==CLOSED);
+  if(ret>=0) return;
+  archive_clear(&archive);
+  if(ret==-2) {
+    usb_write((unsigned char*) "err: corrupt", 13, 32,USB_CRYPTO_EP_CTRL_OUT);
+  } else {
+    usb_write((unsigned char*) "err: import", 12, 32,USB_CRYPTO_EP_CTRL_OUT);
+  }
+  pf_reset();
+}
+
+/**
+  * @brief  import_end: reports the end of an import. the store is wiped
+  *         when the second pass starts, if it is interrupted by an error,
+  *         a stop or a reset, the store is lost and the flag left in it
+  *         is reported at boot, the archive has to be imported again
+  * @param  None
+  * @retval None
+  */
+static void import_end(void) {
+  if(archive.done) {
+    usb_write((unsigned char*) "ok", 2, 32,USB_CRYPTO_EP_CTRL_OUT);
+  } else {
+    usb_write((unsigned char*) "err: corrupt", 13, 32,USB_CRYPTO_EP_CTRL_OUT);
+  }
+  archive_clear(&archive);
 }
 
 /**
-  * @brief  rng_handler: handler for ~
+  * @brief  rng_handler: streams random, the bufs are a ring of keystream
+  *         batches, the usb irq sends them while the next is generated.
+  *         the rng is reseeded while the host catches up.
   * @param  None
   * @retval None
   */
 static void rng_handler(void) {
-  int i;
-  randombytes_buf((void *) outbuf, BUF_SIZE);
-  for(i=0;i<BUF_SIZE && (modus == PITCHFORK_CMD_RNG);i+=64) {
-    while((usbd_ep_write_packet(usbd_dev, USB_CRYPTO_EP_DATA_OUT, outbuf+i, 64) == 0) &&
-          (modus == PITCHFORK_CMD_RNG))
-      usbd_poll(usbd_dev); // todo why do we poll here? is this some artifact?
+  if(usb_tx_pending()>=PF_BUFS) {
+    // all bufs are queued, reseed now rather than in the next batch
+    randombytes_pitchfork_stir_due();
+    return;
+  }
+  // the tx queue is in order, so the oldest buf has been sent
+  unsigned char *out=bufs[ring.tail].buf;
+  randombytes_buf((void *) out, BUF_SIZE);
+  while(usb_tx(out, BUF_SIZE, 0)!=0);
+  ring.tail=(ring.tail+1) % PF_BUFS;
+  rng_bytes+=BUF_SIZE;
+  if(sysctr-rng_shown>=1000 && sysctr>rng_ts) {
+    rng_shown=sysctr;
+    show_rate((uint32_t) (rng_bytes*1000/1024/(sysctr-rng_ts)));
   }
-  disp_print(40,DISPLAY_HEIGHT-8, "           ");
 }
 
 /**
@@ -754,7 +911,7 @@ static void listkeys(const PF_KeyType type, const unsigned char *peer) {
   }
   memcpy(path,prefix,prefixlen);
 
-  unsigned char *outptr = outbuf, *tptr;
+  unsigned char *outptr = outbuf;
 
   if(haspeer==0) { // simplest case _listkeys for path
     uint8_t owner[33], olen=0;
@@ -800,11 +957,9 @@ static void listkeys(const PF_KeyType type, const unsigned char *peer) {
         continue; // todo flag error?
       }
       // resolve peer and call _listkeys on each key
-      uint8_t peerpath[]="/peers/                                ";
-      memcpy(peerpath+7,inode->name, inode->name_len);
       int retries=3;
       uint8_t cpeer[PEER_NAME_MAX];
-      while((len=cread(peerpath, cpeer, sizeof(cpeer)))==-2 && retries-->=0) {
+      while((len=peer_name(inode->name, inode->name_len, cpeer))==-2 && retries-->=0) {
         erase_master_key();
         get_master_key("bad key");
       }
@@ -828,19 +983,8 @@ static void listkeys(const PF_KeyType type, const unsigned char *peer) {
   if(!cmd_blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_CTRL_IN, 0);
   if(!blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
 
-  // write out result
-  tptr=outbuf;
-  // write out outbuf
-  while(tptr+64<outptr) {
-    usb_write(tptr, 64, 0, USB_CRYPTO_EP_DATA_OUT);
-    tptr+=64;
-  }
-  // write out last packet
-  if(tptr<outptr) {// short pkt
-    usb_write(tptr, outptr-tptr, 0, USB_CRYPTO_EP_DATA_OUT);
-  } else if(tptr==outptr) { // zlp
-    usbd_ep_write_packet(usbd_dev, USB_CRYPTO_EP_DATA_OUT, outbuf, 0);
-  }
+  // write out result, a zlp ends it if it is empty or full packets
+  pf_send(outbuf, outptr-outbuf);
 
  exit:
   if(!cmd_blocked) usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_CTRL_IN, 0);
@@ -905,36 +1049,22 @@ void handle_data(usbd_device *usbd_dev, const uint8_t ep) {
     usb_write((unsigned char*) "err: no op", 11, 32,USB_CRYPTO_EP_CTRL_OUT);
     return;
   }
-  if(bufs[active_buf].state != INPUT) {
-    if(toggle_buf() == -1) { // if other buffer yet unavailable
-      // throttle input
-      blocked = 1;
-      usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 1);
-      usb_write((unsigned char*) "err: oflow", 11, 32,USB_CRYPTO_EP_CTRL_OUT);
-      return;
-    }
-    // or read into the fresh buffer
+  Buffer *buf = ring_head(&ring, ring_len());
+  if(buf == NULL) { // if next buffer yet unavailable
+    // throttle input
+    blocked = 1;
+    usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 1);
+    usb_write((unsigned char*) "err: oflow", 11, 32,USB_CRYPTO_EP_CTRL_OUT);
+    return;
   }
   // read into buffer
-  len = usb_read(bufs[active_buf].start+bufs[active_buf].size);
-  // adjust buffer size
-  bufs[active_buf].size+=len;
-  // todo test this instead of below: if(len<64)
-  if(len<64 && (modus!=PITCHFORK_CMD_DECRYPT || bufs[active_buf].size!=BUF_SIZE+16 )) {
-    // short buffer read finish off reading
-    bufs[active_buf].state = CLOSED;
-    toggle_buf();
-  } else if(bufs[active_buf].size >= BUF_SIZE) {
-    if(modus!=PITCHFORK_CMD_DECRYPT || (bufs[active_buf].size > BUF_SIZE)) {
-      // buffer full mark it ...
-      bufs[active_buf].state = OUTPUT;
-    }
-    // ... and try to switch to other buffer
-    if((bufs[active_buf].state == OUTPUT) && toggle_buf() == -1) { // if other buffer yet unavailable
-      // throttle input
-      blocked = 1;
-      usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 1);
-    }
+  len = usb_read(buf->start+buf->size);
+  // decrypt bufs end with a short pkt of the 16 byte mac
+  const int full = (modus==PITCHFORK_CMD_DECRYPT)?BUF_SIZE+16:BUF_SIZE;
+  if(ring_rx(&ring, ring_len(), len, full) == -1) { // if next buffer yet unavailable
+    // throttle input
+    blocked = 1;
+    usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 1);
   }
 }
 
@@ -951,9 +1081,15 @@ static void handle_cmd(void) {
 
   // shall we stop whatever we're doing?
   if(cmd_buf.buf[0]==PITCHFORK_CMD_STOP) {
+    // drop output not sent yet
+    usb_tx_flush();
     if(modus == PITCHFORK_CMD_RNG) {
       // finish rng with zlp
-      usbd_ep_write_packet(usbd_dev, USB_CRYPTO_EP_DATA_OUT, outbuf, 0);
+      usb_tx(NULL, 0, 1);
+    }
+    if(modus == PITCHFORK_CMD_EXPORT || modus == PITCHFORK_CMD_IMPORT) {
+      // close the file of the current record, wipe its plaintext
+      archive_clear(&archive);
     }
     // stop whatever we're doing
     pf_reset();
@@ -970,6 +1106,21 @@ static void handle_cmd(void) {
     return;
   }
 
+  if(usb_tx_pending()>0) {
+    // the output of the previous op is still sent from the bufs, the host
+    // has to read it first, or drop it with a stop cmd
+    usb_write((unsigned char*) "err: busy", 10, 32,USB_CRYPTO_EP_CTRL_OUT);
+    cmd_clear();
+    return;
+  }
+
+#ifdef PF_BENCH
+  DEMCR |= DEMCR_TRCENA;
+  DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+  bench_cycles=0;
+  bench_bytes=0;
+#endif // PF_BENCH
+
   // what is the cmd?
   switch(cmd_buf.buf[0] & 0x1f) {
 
@@ -992,7 +1143,7 @@ static void handle_cmd(void) {
     // get nonce
     randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
     // send nonce back
-    usb_write(nonce, sizeof(nonce), 32, USB_CRYPTO_EP_DATA_OUT);
+    pf_send(nonce, sizeof(nonce));
     modus = PITCHFORK_CMD_ENCRYPT;
 
     disp_print_inv(40,DISPLAY_HEIGHT-8, "    encrypt");
@@ -1126,8 +1277,8 @@ static void handle_cmd(void) {
     }
     // get nonce
     randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
-    // send nonce back to host
-    usb_write(nonce, sizeof(nonce), 32, USB_CRYPTO_EP_DATA_OUT);
+    // send nonce back to host, after the headers
+    pf_send(nonce, sizeof(nonce));
 
     modus = PITCHFORK_CMD_ENCRYPT;
     break;
@@ -1211,6 +1362,8 @@ static void handle_cmd(void) {
 
   case PITCHFORK_CMD_RNG: {
     modus = PITCHFORK_CMD_RNG;
+    rng_ts = rng_shown = sysctr;
+    rng_bytes = 0;
     disp_print_inv(40,DISPLAY_HEIGHT-8, "        rng");
     break;
   }
@@ -1233,7 +1386,7 @@ static void handle_cmd(void) {
         return;
       }
       sodium_memzero(kp.sk,32);
-      usb_write(kp.pk, 32, 32,USB_CRYPTO_EP_DATA_OUT);
+      pf_send(kp.pk, 32);
     } else if(cmd_buf.buf[1]==1) {
       uint8_t sk[PQCRYPTO_SECRETKEYBYTES];
       uint8_t path[]="/sph/                                ";
@@ -1246,7 +1399,7 @@ static void handle_cmd(void) {
       pqcrypto_sign_public_key(pk, sk);
       sodium_memzero(sk,sizeof(sk));
       modus = PITCHFORK_CMD_DUMP_PUB;
-      pf_send(pk,sizeof(pk),PITCHFORK_CMD_DUMP_PUB);
+      pf_send(pk,sizeof(pk));
     } else {
       usb_write((unsigned char*) "err: inv param", 15, 32,USB_CRYPTO_EP_CTRL_OUT);
       cmd_clear();
@@ -1255,6 +1408,40 @@ static void handle_cmd(void) {
     break;
   }
 
+  case PITCHFORK_CMD_EXPORT: {
+    if(query_user("export keys")==0) {
+      return;
+    }
+    modus = PITCHFORK_CMD_EXPORT;
+    disp_print_inv(40,DISPLAY_HEIGHT-8, "     export");
+    export_keys();
+    break;
+  }
+
+  case PITCHFORK_CMD_IMPORT: { // expects archive header
+    if(cmd_buf.size!=1+PF_ARCHIVE_HEADER) {
+      usb_write((unsigned char*) "err: inv param", 15, 32,USB_CRYPTO_EP_CTRL_OUT);
+      cmd_clear();
+      return;
+    }
+    if(query_user("import keys")==0) {
+      return;
+    }
+    uint8_t pass[65];
+    const int len=get_archive_pass(pass, sizeof(pass));
+    const int ret=archive_import_start(&archive, cmd_buf.buf+1, pass, len);
+    sodium_memzero(pass,sizeof(pass));
+    if(ret!=0) {
+      usb_write((unsigned char*) "err: inv param", 15, 32,USB_CRYPTO_EP_CTRL_OUT);
+      cmd_clear();
+      return;
+    }
+    modus = PITCHFORK_CMD_IMPORT;
+    disp_print_inv(40,DISPLAY_HEIGHT-8, "     import");
+    usb_write((unsigned char*) "go", 2, 32,USB_CRYPTO_EP_CTRL_OUT);
+    break;
+  }
+
   // SPHINX functions
   case PITCHFORK_CMD_SPHINX_CREATE: {
     if(cmd_buf.size!=1+16+32) {
@@ -1361,6 +1548,43 @@ static void handle_cmd(void) {
   cmd_clear();
 }
 
+/**
+  * @brief  reclaim_bufs: returns bufs whose output has been sent to the
+  *         ring, the usb tx queue sends them in order. a response sent
+  *         from outbuf is wiped, it might have been a plaintext
+  * @param  None
+  * @retval None
+  */
+static void reclaim_bufs(void) {
+  int freed=ring_reclaim(&ring, ring_len(), usb_tx_pending());
+  if(outbuf_sending>0 && usb_tx_queued(outbuf, sizeof(outbuf))==0) {
+    sodium_memzero(outbuf, outbuf_sending);
+    outbuf_sending=0;
+    if(bufs[PF_BUFS-1].state==SENDING) {
+      bufs[PF_BUFS-1].state=INPUT;
+      freed++;
+    }
+  }
+  if(freed>0 && blocked==1) {
+    blocked = 0;
+    usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
+  }
+}
+
+#ifdef PF_BENCH
+/**
+  * @brief  bench_report: shows the throughput of the buffered op that
+  *         just ended, in KB/s of input processed
+  * @param  None
+  * @retval None
+  */
+static void bench_report(void) {
+  uint32_t kbs=0;
+  if(bench_cycles>0) kbs=(uint32_t) (bench_bytes*PF_BENCH_HZ/1024/bench_cycles);
+  show_rate(kbs);
+}
+#endif // PF_BENCH
+
 /**
   * @brief  handle_buf: executes operations
   * @param  None
@@ -1369,12 +1593,15 @@ static void handle_cmd(void) {
 static void handle_buf(void) {
   Buffer *buf = 0;
   if(modus == PITCHFORK_CMD_STOP) return; // nothing to process
-  disp_print_inv(40,DISPLAY_HEIGHT-8, "*");
   if(modus == PITCHFORK_CMD_RNG) {
-    disp_print_inv(40,DISPLAY_HEIGHT-8, "        rng");
     rng_handler(); // produce rng pkts
     return;
   }
+  if(modus == PITCHFORK_CMD_EXPORT) {
+    export_handler(); // a chunk of the archive
+    return;
+  }
+  disp_print_inv(40,DISPLAY_HEIGHT-8, "*");
 
   // guard against invalid modus, whitelist allowed actions
   // all other ops don't need an input buffer
@@ -1388,25 +1615,18 @@ static void handle_buf(void) {
   case PITCHFORK_CMD_KEX_END:
   case PITCHFORK_CMD_AX_SEND:
   case PITCHFORK_CMD_AX_RECEIVE:
+  case PITCHFORK_CMD_IMPORT:
   case PITCHFORK_CMD_DECRYPT: { ; break; }
   default: { return; }
   }
 
-  if(((bufs[!active_buf].state!=INPUT) && (bufs[!active_buf].size>0)) ||
-     ((bufs[!active_buf].state==CLOSED) && (bufs[!active_buf].size==0))) {
-    buf = &bufs[!active_buf]; // alias default active buf
-  } else {
-      // inactive buffer has nothing to process, check the active one
-      // this should only happen in the case when we became stalled.
-      // in which case this branch is taken on the second invocation
-      // of this function from the mainloop
-    if(((bufs[active_buf].state!=INPUT) && (bufs[active_buf].size>0)) ||
-       ((bufs[active_buf].state==CLOSED) && (bufs[active_buf].size==0))) {
-        buf = &bufs[active_buf]; // alias other inactive buf
-    } else {
-      return; // nothing to do
-    }
-  }
+  // buffers are processed in the order they were filled
+  buf = ring_ready(&ring);
+  if(buf == NULL) return; // nothing to do
+
+#ifdef PF_BENCH
+  const uint32_t cycles=DWT_CYCCNT;
+#endif // PF_BENCH
 
   // finally do the processing
   if(buf->size>0) {
@@ -1462,24 +1682,45 @@ static void handle_buf(void) {
           hash_block(buf);
           break;
         }
+        case PITCHFORK_CMD_IMPORT: {
+          disp_print_inv(40,DISPLAY_HEIGHT-8, "     import");
+          import_block(buf);
+          break;
+        }
         default: { /* should never get here */ while(1); } // todo error handling/reporting
      }
   }
+  // the handler reset the op, the ring starts over
+  if(modus == PITCHFORK_CMD_STOP) return;
+#ifdef PF_BENCH
+  bench_bytes+=buf->size;
+  bench_cycles+=DWT_CYCCNT-cycles;
+#endif // PF_BENCH
   // some final loose ends to tend to
-  if(buf->state == CLOSED ) {
+  if(buf->state == CLOSED && modus == PITCHFORK_CMD_IMPORT &&
+     archive.verified && !archive.formatted) {
+    // the archive checked out, the host sends it again to be restored
+    ring_reset(&ring, PF_BUFS);
+    if(blocked==1) {
+      blocked = 0;
+      usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
+    }
+    usb_write((unsigned char*) "go", 2, 32,USB_CRYPTO_EP_CTRL_OUT);
+  } else if(buf->state == CLOSED ) {
     if(modus == PITCHFORK_CMD_SIGN) sign_msg();
     else if(modus == PITCHFORK_CMD_PQSIGN) pqsign_msg();
     else if(modus == PITCHFORK_CMD_VERIFY) verify_msg();
+    else if(modus == PITCHFORK_CMD_IMPORT) import_end();
     disp_print(40,DISPLAY_HEIGHT-8, "           ");
     pf_reset();
-  } else { // buf->state == OUTPUT
-    buf->size=0;
-    buf->state=INPUT;
-    if(blocked==1) {
-      // now that there is an empty buf, handle postponed pkts
-      blocked = 0;
-      usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
-    }
+#ifdef PF_BENCH
+    bench_report();
+#endif // PF_BENCH
+  } else if(ring_done(&ring, ring_len())>0 && blocked==1) {
+    // now that there is an empty buf, handle postponed pkts, a sending
+    // buf is freed by reclaim_bufs once sent
+    blocked = 0;
+    usbd_ep_nak_set(usbd_dev, USB_CRYPTO_EP_DATA_IN, 0);
   }
 }
 
@@ -1493,7 +1734,11 @@ static void handle_buf(void) {
   * @retval None
   */
 void pitchfork_main(void) {
+  // free what has been sent, before a cmd might need it
+  reclaim_bufs();
   // process cmd_buf
   handle_cmd();
   handle_buf();
+  // idle, compact the store a bit
+  if(modus == PITCHFORK_CMD_STOP) stfs_vacuum_step();
 }
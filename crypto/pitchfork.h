@@ -3,8 +3,15 @@
 
 #include <crypto_secretbox.h>
 #include <libopencm3/usb/usbd.h>
+#include "usb.h"
 
-#define BUF_SIZE 32768
+#include "pf_ring.h"
+
+// every buffer of the ring can be queued for sending, and then the
+// reply ending the op
+#if PF_BUFS >= USB_TXQ_LEN
+#error "PF_BUFS must be less than USB_TXQ_LEN"
+#endif
 
 /**
   * @brief  CRYPTO_CMD: enum for all PITCHFORK USB cmd byte
@@ -31,6 +38,9 @@ typedef enum {
   PITCHFORK_CMD_SPHINX_COMMIT,
   PITCHFORK_CMD_SPHINX_DELETE,
 
+  // archive of the whole key store
+  PITCHFORK_CMD_EXPORT,
+
   // ops needing double input buffers, starting at 0x10
   // so we can test for them like (modus & PITCHFORK_CMD_BUFFERED)
   PITCHFORK_CMD_BUFFERED = 16,
@@ -60,16 +70,10 @@ typedef enum {
   // kex fns which have prekeys as input
   PITCHFORK_CMD_KEX_RESPOND,
   PITCHFORK_CMD_KEX_END,
-} CRYPTO_CMD;
 
-/**
-  * @brief  Buffer_State: USB buffer state
-  */
-typedef enum {
-  INPUT,      // buffer is ready to accept
-  OUTPUT,     // buffer is awaiting output processing
-  CLOSED      // buffer is the final one.
-} Buffer_State;
+  // restores an archive from PITCHFORK_CMD_EXPORT
+  PITCHFORK_CMD_IMPORT,
+} CRYPTO_CMD;
 
 typedef enum {
   // /lt /ax /sph /keys /pub /prekeys
@@ -81,20 +85,10 @@ typedef enum {
   PF_KEY_PREKEY,
 } PF_KeyType;
 
-/**
-  * @brief  Buffer: USB read buffer for data double buffering
-  */
-typedef struct {
-  Buffer_State state;                                        /* buffer state (i/o/c) */
-  int size;                                                  /* size of buffer */
-  unsigned char* start;                                      /* ptr to start of unused space in buffer */
-  unsigned char buf[BUF_SIZE+crypto_secretbox_ZEROBYTES+64]; /* extra crypto_secretbox_ZEROBYTES (32) for encryption
-                                                              * and decryption needs 16 (mac)
-                                                              */
-} Buffer;
-
-extern Buffer bufs[2];
-extern unsigned char outbuf[crypto_secretbox_ZEROBYTES+BUF_SIZE];
+extern Buffer bufs[PF_BUFS];
+// output buffer of the ops that don't process the ring in place, it is
+// left out of the ring while they run
+#define outbuf (bufs[PF_BUFS-1].buf)
 
 extern unsigned char blocked;
 extern char cmd_blocked;
@@ -134,6 +134,19 @@ static void randombytes_pitchfork_stir_if_needed(void) {
     }
 }
 
+/**
+  * @brief  randombytes_pitchfork_stir_due: reseeds the rng if the next
+  *         randombytes_buf would, so streams can do it while idle
+  * @param  None
+  * @retval None
+  */
+void randombytes_pitchfork_stir_due(void) {
+    if (stream.fresh == 0) {
+      randombytes_pitchfork_stir();
+      stream.fresh = STIRPERIOD;
+    }
+}
+
 /**
   * @brief  randombytes_buf: fills buf with random bytes
   * @param  buf: pointer to output buf
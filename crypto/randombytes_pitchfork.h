@@ -22,6 +22,9 @@ void        randombytes_pitchfork_init(struct entropy_store* pool);
 SODIUM_EXPORT
 void        randombytes_pitchfork_stir(void);
 
+SODIUM_EXPORT
+void        randombytes_pitchfork_stir_due(void);
+
 SODIUM_EXPORT
 void        randombytes_buf(void * const buf, const size_t size);
 
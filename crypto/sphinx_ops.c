@@ -44,11 +44,11 @@ int pf_sphinx_respond(const uint8_t *id, const uint8_t *challenge) {
   }
 
   // send response back over usb
-  usb_write(resp, sizeof(resp), 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx(resp, sizeof(resp), 1);
   return 0;
 
 error:
-  usb_write((uint8_t*)"fail", 5, 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx((uint8_t*)"fail", 5, 1);
   return -1;
 }
 
@@ -73,11 +73,11 @@ static int new_sphinx_key(uint8_t *fname, const uint8_t *challenge) {
   }
 
   // send response back over usb
-  usb_write(resp, sizeof(resp), 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx(resp, sizeof(resp), 1);
   return 0;
 
 error:
-  usb_write((uint8_t*)"fail", 5, 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx((uint8_t*)"fail", 5, 1);
   return -1;
 }
 
@@ -143,10 +143,10 @@ int pf_sphinx_commit(const uint8_t *id) {
     goto error; // todo really signal error here?
   }
 
-  usb_write((uint8_t*)"ok", 3, 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx((uint8_t*)"ok", 3, 1);
   return 0;
 error:
-  usb_write((uint8_t*)"fail", 5, 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx((uint8_t*)"fail", 5, 1);
   return -1;
 }
 
@@ -155,9 +155,9 @@ int pf_sphinx_delete(const uint8_t *id) {
   uint8_t fname[]="/sphinx/                                ";
   stohex(fname+8, id, 16);
   if(-1==stfs_unlink(fname)) {
-    usb_write((uint8_t*)"fail", 5, 32,USB_CRYPTO_EP_DATA_OUT);
+    usb_tx((uint8_t*)"fail", 5, 1);
     return -1;
   }
-  usb_write((uint8_t*)"ok", 3, 32,USB_CRYPTO_EP_DATA_OUT);
+  usb_tx((uint8_t*)"ok", 3, 1);
   return 0;
 }
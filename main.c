@@ -38,6 +38,7 @@
 #include "stfs.h"
 #include "pf_store.h"
 #include "browser.h"
+#include "archive.h"
 
 void randombytes_pitchfork_init(struct entropy_store* pool);
 struct entropy_store* pool;
@@ -142,6 +143,19 @@ static void init_pf_user(void) {
   }
 }
 
+static void check_restore(void) {
+  if(archive_restoring()==0) return;
+  disp_clear();
+  disp_print_inv(0,0, " PITCHFORK!!5!  ");
+  disp_print(0,(FONT_HEIGHT+1), "a key import" );
+  disp_print(0,(FONT_HEIGHT+1)*2, "was cut short");
+  disp_print(0,(FONT_HEIGHT+1)*3, "import it");
+  disp_print(0,(FONT_HEIGHT+1)*4, "again");
+  disp_print(0,(FONT_HEIGHT+1)*5, "ok >");
+  while(button_handler()==0);
+  disp_clear();
+}
+
 void softreset() {
   disable_irqs();
   // stop clocks
@@ -180,6 +194,7 @@ void fwupdate_trampoline(void) {
 void toggle_lock(void) {
   if(pitchfork_hot!=0) {
     erase_master_key();
+    stfs_checkpoint();
   } else {
     get_master_key("unlock from gui");
   }
@@ -241,6 +256,7 @@ static void app(void) {
 }
 
 int main(void) {
+  int i;
   init();
   verify_fwsig();
   mDelay(500);
@@ -248,8 +264,7 @@ int main(void) {
   randombytes_pitchfork_init(pool);
   stfs_init();
 
-  bufs[0].start =  bufs[0].buf + crypto_secretbox_ZEROBYTES;
-  bufs[1].start =  bufs[1].buf + crypto_secretbox_ZEROBYTES;
+  for(i=0;i<PF_BUFS;i++) bufs[i].start =  bufs[i].buf + crypto_secretbox_ZEROBYTES;
 
   disp_show_logo();
 
@@ -264,6 +279,9 @@ int main(void) {
   disp_normal();
   fancycls();
 
+  // a store left by an interrupted import is incomplete
+  check_restore();
+
   // check if user is initialized, if not attempt so
   // user is needed for crypto ops, without an initialized user
   // pitchfork cannot execute crypto ops, only rng
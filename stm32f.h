@@ -1896,6 +1896,13 @@ typedef struct {
 //#define DACCVIOL   (1 << 1)
 //#define IACCVIOL   (1 << 0)
 
+/* DWT cycle counter */
+#define DEMCR                           MMIO32(SCS_BASE + 0xDFC)
+#define DEMCR_TRCENA                    (1 << 24)
+#define DWT_CTRL                        MMIO32(0xE0001000)
+#define DWT_CTRL_CYCCNTENA              (1 << 0)
+#define DWT_CYCCNT                      MMIO32(0xE0001004)
+
 #define OTP_START_ADDR	(0x1FFF7800)
 #define OTP_BYTES_IN_BLOCK	32
 #define OTP_BLOCKS	16
@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+# exports the key store of a PITCHFORK into an encrypted archive, restores
+# such an archive, possibly on another device, or lists its contents.
+# the archive passphrase is entered on the device.
+# usage: pfarchive.py export store.pfa
+#        pfarchive.py import store.pfa
+#        pfarchive.py list store.pfa <passphrase as hex>
+#
+# an archive is "PFA1" | salt[32] | nonce[24], followed by chunks of a mac
+# and up to 32752 bytes of ciphertext, all but the last one are full.
+# chunk n is a secretbox under the nonce with n xored into its last 4
+# bytes, and 0x80 into the last byte of the last chunk. the plaintext is
+# a sequence of records: kind ('d'ir, 'f'ile, 'e'ncrypted on the
+# device) | len(path) | path | len(data) as 32 bit le | data.
+# an import sends the archive twice, the device checks all of it before
+# it wipes its store, and restores it from the second pass.
+
+import sys, struct
+from binascii import unhexlify
+
+idVendor=0x0483
+idProduct=0x5740
+
+USB_CRYPTO_EP_CTRL_IN = 0x01
+USB_CRYPTO_EP_DATA_IN = 0x02
+USB_CRYPTO_EP_CTRL_OUT = 0x81
+USB_CRYPTO_EP_DATA_OUT = 0x82
+
+PITCHFORK_CMD_EXPORT = 10
+PITCHFORK_CMD_IMPORT = 27
+
+BUF_SIZE = 32768
+HEADER_SIZE = 4+32+24
+MAGIC = 'PFA1'
+TIMEOUT = 120000 # ms, the user has to confirm and enter the passphrase
+
+eps={}
+
+def init():
+    import usb.core, usb.util
+    dev = usb.core.find(idVendor=idVendor, idProduct=idProduct)
+    if dev is None:
+        print >>sys.stderr, "no PITCHFORK found"
+        sys.exit(1)
+    cfg = dev.get_active_configuration()
+    interface_number = cfg[(0,0)].bInterfaceNumber
+    intf = usb.util.find_descriptor(cfg, bInterfaceNumber = interface_number)
+    for ep in intf:
+        eps[ep.bEndpointAddress]=ep
+
+def read_ctrl(timeout=TIMEOUT):
+    while True:
+        msg = ''.join(chr(x) for x in eps[USB_CRYPTO_EP_CTRL_OUT].read(64, timeout=timeout)).rstrip('\0')
+        if msg != 'err: oflow': # sent while the device throttles our writes
+            return msg
+
+def expect(msg):
+    resp = read_ctrl()
+    if resp != msg:
+        print >>sys.stderr, "device says:", resp
+        sys.exit(1)
+
+def export(fname):
+    eps[USB_CRYPTO_EP_CTRL_IN].write(chr(PITCHFORK_CMD_EXPORT))
+    expect('ok')
+    hdr = ''.join(chr(x) for x in eps[USB_CRYPTO_EP_DATA_OUT].read(64, timeout=TIMEOUT))
+    if len(hdr) != HEADER_SIZE or hdr[:4] != MAGIC:
+        print >>sys.stderr, "bad archive header"
+        sys.exit(1)
+    with open(fname, 'wb') as fd:
+        fd.write(hdr)
+        size = len(hdr)
+        while True:
+            chunk = eps[USB_CRYPTO_EP_DATA_OUT].read(BUF_SIZE, timeout=TIMEOUT)
+            if len(chunk)==0: continue # zlp after a full chunk
+            fd.write(''.join(chr(x) for x in chunk))
+            size += len(chunk)
+            if len(chunk) < BUF_SIZE: break
+    print "exported %d bytes" % size
+
+def chunks(fname):
+    with open(fname, 'rb') as fd:
+        hdr = fd.read(HEADER_SIZE)
+        if len(hdr) != HEADER_SIZE or hdr[:4] != MAGIC:
+            print >>sys.stderr, "not an archive"
+            sys.exit(1)
+        yield hdr
+        while True:
+            chunk = fd.read(BUF_SIZE)
+            yield chunk
+            if len(chunk) < BUF_SIZE: break
+
+def send_chunks(it):
+    for chunk in it:
+        eps[USB_CRYPTO_EP_DATA_IN].write(chunk, timeout=TIMEOUT)
+        if len(chunk) < BUF_SIZE and len(chunk) % 64 == 0:
+            eps[USB_CRYPTO_EP_DATA_IN].write('', timeout=TIMEOUT)
+
+def restore(fname):
+    it = chunks(fname)
+    eps[USB_CRYPTO_EP_CTRL_IN].write(chr(PITCHFORK_CMD_IMPORT)+next(it))
+    expect('ok')
+    expect('go')
+    send_chunks(it)
+    # the archive checked out, now it is restored
+    expect('go')
+    it = chunks(fname)
+    next(it)
+    send_chunks(it)
+    expect('ok')
+    print "restored"
+
+def pbkdf2_generichash(pwd, salt):
+    # like crypto/pbkdf2_generichash.c
+    from pysodium import crypto_generichash
+    uj = crypto_generichash(pwd, salt+struct.pack('<i', 1), 32)
+    mk = [ord(c) for c in uj]
+    for _ in xrange(4999):
+        uj = crypto_generichash(pwd, uj, 32)
+        mk = [a ^ ord(b) for a, b in zip(mk, uj)]
+    return ''.join(chr(c) for c in mk)
+
+def nonce(base, seq, final):
+    n = [ord(c) for c in base]
+    for i in xrange(4):
+        n[20+i] ^= (seq >> (8*i)) & 0xff
+    if final: n[23] ^= 0x80
+    return ''.join(chr(c) for c in n)
+
+def list_archive(fname, pwd):
+    from pysodium import crypto_secretbox_open
+    it = chunks(fname)
+    hdr = next(it)
+    key = pbkdf2_generichash(pwd, hdr[4:36])
+    plain = ''
+    for seq, chunk in enumerate(it):
+        try:
+            plain += crypto_secretbox_open(chunk, nonce(hdr[36:], seq, len(chunk) < BUF_SIZE), key)
+        except ValueError:
+            print >>sys.stderr, "chunk %d is corrupt or the passphrase is wrong" % seq
+            sys.exit(1)
+    i = 0
+    while i < len(plain):
+        kind, plen = plain[i], ord(plain[i+1])
+        path = plain[i+2:i+2+plen]
+        size = struct.unpack('<I', plain[i+2+plen:i+6+plen])[0]
+        print "%s %6d %s" % (kind, size, path)
+        i += 6+plen+size
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3 or sys.argv[1] not in ('export', 'import', 'list') or \
+       (sys.argv[1] == 'list' and len(sys.argv) < 4):
+        print >>sys.stderr, "usage: %s export|import|list <archive> [passphrase as hex]" % sys.argv[0]
+        sys.exit(1)
+    if sys.argv[1] == 'list':
+        list_archive(sys.argv[2], unhexlify(sys.argv[3]))
+        sys.exit(0)
+    init()
+    if sys.argv[1] == 'export':
+        export(sys.argv[2])
+    else:
+        restore(sys.argv[2])
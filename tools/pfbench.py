@@ -0,0 +1,95 @@
+#!/usr/bin/env python
+# measures the throughput of the usb crypto interface of a PITCHFORK,
+# the output is read in a thread of its own, so the device is fed as
+# fast as its input buffers drain.
+# usage: pfbench.py encrypt <peer> [MB]
+#        pfbench.py rng [MB]
+
+import sys, time, threading, os
+
+idVendor=0x0483
+idProduct=0x5740
+
+USB_CRYPTO_EP_CTRL_IN = 0x01
+USB_CRYPTO_EP_DATA_IN = 0x02
+USB_CRYPTO_EP_CTRL_OUT = 0x81
+USB_CRYPTO_EP_DATA_OUT = 0x82
+
+PITCHFORK_CMD_STOP = 0
+PITCHFORK_CMD_RNG = 2
+PITCHFORK_CMD_ENCRYPT = 19
+
+BUF_SIZE = 32768
+MACBYTES = 16
+TIMEOUT = 60000 # ms, the user has to confirm
+
+eps={}
+
+def init():
+    import usb.core, usb.util
+    dev = usb.core.find(idVendor=idVendor, idProduct=idProduct)
+    if dev is None:
+        print >>sys.stderr, "no PITCHFORK found"
+        sys.exit(1)
+    cfg = dev.get_active_configuration()
+    interface_number = cfg[(0,0)].bInterfaceNumber
+    intf = usb.util.find_descriptor(cfg, bInterfaceNumber = interface_number)
+    for ep in intf:
+        eps[ep.bEndpointAddress]=ep
+
+def read_ctrl():
+    return ''.join(chr(x) for x in eps[USB_CRYPTO_EP_CTRL_OUT].read(64, timeout=TIMEOUT)).rstrip('\0')
+
+def report(op, size, secs):
+    print "%s: %d bytes in %.2fs, %.1f KB/s" % (op, size, secs, size/secs/1024)
+
+def encrypt(peer, mb):
+    blocks = mb*1024*1024 // BUF_SIZE
+    eps[USB_CRYPTO_EP_CTRL_IN].write(chr(PITCHFORK_CMD_ENCRYPT)+peer)
+    resp = read_ctrl()
+    if resp != 'ok':
+        print >>sys.stderr, "device says:", resp
+        sys.exit(1)
+    eps[USB_CRYPTO_EP_DATA_OUT].read(64, timeout=TIMEOUT) # nonce
+    out = [0]
+    def reader():
+        # each block comes back with a mac, the last one is short
+        for i in xrange(blocks+1):
+            out[0] += len(eps[USB_CRYPTO_EP_DATA_OUT].read(BUF_SIZE+MACBYTES, timeout=TIMEOUT))
+    t = threading.Thread(target=reader)
+    block = os.urandom(BUF_SIZE)
+    start = time.time()
+    t.start()
+    for i in xrange(blocks):
+        eps[USB_CRYPTO_EP_DATA_IN].write(block, timeout=TIMEOUT)
+    eps[USB_CRYPTO_EP_DATA_IN].write(block[:1000], timeout=TIMEOUT) # closes the stream
+    t.join()
+    report("encrypt", blocks*BUF_SIZE+1000, time.time()-start)
+    if out[0] != blocks*(BUF_SIZE+MACBYTES)+1000+MACBYTES:
+        print >>sys.stderr, "short output: %d bytes" % out[0]
+
+def rng(mb):
+    size = 0
+    eps[USB_CRYPTO_EP_CTRL_IN].write(chr(PITCHFORK_CMD_RNG))
+    start = time.time()
+    while size < mb*1024*1024:
+        size += len(eps[USB_CRYPTO_EP_DATA_OUT].read(BUF_SIZE, timeout=TIMEOUT))
+    secs = time.time()-start
+    eps[USB_CRYPTO_EP_CTRL_IN].write(chr(PITCHFORK_CMD_STOP))
+    # drain up to the zlp ending the stream
+    try:
+        while len(eps[USB_CRYPTO_EP_DATA_OUT].read(BUF_SIZE, timeout=1000)) > 0: pass
+    except Exception:
+        pass
+    report("rng", size, secs)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2 or sys.argv[1] not in ('encrypt', 'rng') or \
+       (sys.argv[1] == 'encrypt' and len(sys.argv) < 3):
+        print >>sys.stderr, "usage: %s encrypt <peer> [MB] | rng [MB]" % sys.argv[0]
+        sys.exit(1)
+    init()
+    if sys.argv[1] == 'encrypt':
+        encrypt(sys.argv[2], int(sys.argv[3]) if len(sys.argv)>3 else 4)
+    else:
+        rng(int(sys.argv[2]) if len(sys.argv)>2 else 4)
@@ -0,0 +1,47 @@
+#!/usr/bin/env python
+# reports per sector wear of the stfs key store from a raw flash dump
+# of all its sectors (0x08040000 - 0x080fffff), e.g. obtained with
+#   st-flash read store.img 0x08040000 0xc0000
+# usage: stfswear.py store.img [days in service]
+
+import sys, struct
+
+CHUNK_SIZE = 128
+CHUNKS_PER_BLOCK = 1024
+STARTBLOCK = 6
+STFS_MAGIC = 0x53465453
+ENDURANCE = 10000 # min erase cycles of the stm32f2 flash
+
+TYPES = {0x00: 'deleted', 0xaa: 'live', 0xcc: 'live', 0x66: 'live', 0x99: 'live',
+         0x3c: 'deleted', 0xc3: 'deleted', 0xff: 'empty'} # checkpoints are garbage once dropped
+
+def getimg():
+    with open(sys.argv[1], 'rb') as fd:
+        return fd.read()
+
+img = getimg()
+days = float(sys.argv[2]) if len(sys.argv)>2 else None
+
+print "sector erases   live deleted  empty"
+maxerases = 0
+for b in xrange(len(img) // (CHUNK_SIZE*CHUNKS_PER_BLOCK)):
+    block = img[b*CHUNK_SIZE*CHUNKS_PER_BLOCK:(b+1)*CHUNK_SIZE*CHUNKS_PER_BLOCK]
+    stats = {'live': 0, 'deleted': 0, 'empty': 0}
+    for c in xrange(CHUNKS_PER_BLOCK):
+        t = TYPES.get(ord(block[c*CHUNK_SIZE]))
+        if t: stats[t]+=1
+    magic, erases = struct.unpack('<II', block[1:9])
+    if ord(block[0]) != 0x33 or magic != STFS_MAGIC:
+        erases = None # formatted by an old firmware, count unknown
+    else:
+        maxerases = max(maxerases, erases)
+    print "%6d %6s %6d %7d %6d" % (STARTBLOCK+b,
+                                   '?' if erases is None else erases,
+                                   stats['live'],
+                                   stats['deleted'],
+                                   stats['empty'])
+
+print "most worn sector: %d/%d erases (%.1f%%)" % (maxerases, ENDURANCE, maxerases*100.0/ENDURANCE)
+if days and maxerases:
+    rate = maxerases / days
+    print "%.2f erases/day, about %.1f years left" % (rate, (ENDURANCE-maxerases) / rate / 365)
@@ -0,0 +1,235 @@
+/* -*- mode: c; tab-width: 4; indent-tabs-mode: nil; -*- */
+
+/*
+* LZG1 encoder for the decoder in decode.c, written for small RAM instead
+* of the best ratio: the upstream liblzg encoder needs at least 136 KB of
+* work memory, this one a hash table of the last position of each 3 byte
+* prefix, 1 KB (LZG_LEVEL_1) to 16 KB (LZG_LEVEL_9). the level only sizes
+* that table, the fast flag and the progress callback are ignored.
+*
+* like the rest of liblzg this is provided 'as-is', without any express or
+* implied warranty, under the same license terms as decode.c.
+*/
+
+#include "internal.h"
+
+
+/*-- PRIVATE -----------------------------------------------------------------*/
+
+/* Copy lengths the decoder can express, see _LZG_LENGTH_DECODE_LUT */
+static const unsigned char _LZG_LENGTH_ENCODE_LUT[4] = {35, 48, 72, 128};
+
+#define _LZG_MAX_LENGTH   128
+#define _LZG_MAX_OFFSET   526343
+#define _LZG_HASH_BITS(level) (8 + ((level) - 1) / 2)
+
+/* Endian and alignment independent writer for 32-bit integers */
+#define _LZG_SetUINT32(out, offs, x) do { \
+    out[offs] = (unsigned char)((x) >> 24); \
+    out[offs+1] = (unsigned char)((x) >> 16); \
+    out[offs+2] = (unsigned char)((x) >> 8); \
+    out[offs+3] = (unsigned char)(x); \
+} while(0)
+
+static lzg_int32_t _LZG_Level(const lzg_encoder_config_t *config)
+{
+    if (!config || config->level < LZG_LEVEL_1 || config->level > LZG_LEVEL_9)
+        return LZG_LEVEL_DEFAULT;
+    return config->level;
+}
+
+/* Index of the longest codable copy length <= length (>= 3) */
+static unsigned char _LZG_LengthCode(lzg_uint32_t *length)
+{
+    unsigned char i;
+    if (*length < _LZG_LENGTH_ENCODE_LUT[0])
+    {
+        if (*length > 29)
+            *length = 29;
+        return (unsigned char)(*length - 2);
+    }
+    for (i = 3; i > 0 && _LZG_LENGTH_ENCODE_LUT[i] > *length; --i);
+    *length = _LZG_LENGTH_ENCODE_LUT[i];
+    return (unsigned char)(28 + i);
+}
+
+/* Writes the header and the data uncompressed */
+static lzg_uint32_t _LZG_EncodeCopy(const unsigned char *in, lzg_uint32_t insize,
+    unsigned char *out, lzg_uint32_t outsize)
+{
+    lzg_uint32_t i;
+    if (outsize < insize + LZG_HEADER_SIZE)
+        return 0;
+    for (i = 0; i < insize; ++i)
+        out[LZG_HEADER_SIZE + i] = in[i];
+    return insize;
+}
+
+
+/*-- PUBLIC ------------------------------------------------------------------*/
+
+lzg_uint32_t LZG_MaxEncodedSize(lzg_uint32_t insize)
+{
+    /* Incompressible data is stored as a plain copy */
+    return insize + LZG_HEADER_SIZE;
+}
+
+void LZG_InitEncoderConfig(lzg_encoder_config_t *config)
+{
+    config->level = LZG_LEVEL_DEFAULT;
+    config->fast = LZG_TRUE;
+    config->progressfun = 0;
+    config->userdata = (void *)0;
+}
+
+lzg_uint32_t LZG_WorkMemSize(lzg_encoder_config_t *config)
+{
+    return (1u << _LZG_HASH_BITS(_LZG_Level(config))) * sizeof(lzg_uint32_t);
+}
+
+lzg_uint32_t LZG_EncodeFull(const unsigned char *in, lzg_uint32_t insize,
+    unsigned char *out, lzg_uint32_t outsize, lzg_encoder_config_t *config,
+    void *workmem)
+{
+    unsigned char *dst, *outEnd, markers[4], isMarker[256], method, b;
+    lzg_uint32_t *head, hist[256], hashBits, i, j, pos, cand, h;
+    lzg_uint32_t length, offset, encodedSize;
+
+    if (!workmem || outsize < LZG_HEADER_SIZE)
+        return 0;
+    hashBits = _LZG_HASH_BITS(_LZG_Level(config));
+    head = (lzg_uint32_t *)workmem;
+    for (i = 0; i < (1u << hashBits); ++i)
+        head[i] = 0;
+
+    /* The four least used symbols mark copies, literal ones get escaped */
+    for (i = 0; i < 256; ++i)
+    {
+        hist[i] = 0;
+        isMarker[i] = 0;
+    }
+    for (i = 0; i < insize; ++i)
+        hist[in[i]]++;
+    for (j = 0; j < 4; ++j)
+    {
+        b = 0;
+        while (isMarker[b])
+            ++b;
+        for (i = b + 1; i < 256; ++i)
+            if (!isMarker[i] && hist[i] < hist[b])
+                b = (unsigned char)i;
+        isMarker[b] = 1;
+        markers[j] = b;
+    }
+
+    /* Anything not smaller than a plain copy is stored as one */
+    dst = out + LZG_HEADER_SIZE;
+    outEnd = out + ((outsize - LZG_HEADER_SIZE < insize) ? outsize : insize + LZG_HEADER_SIZE);
+    method = LZG_METHOD_LZG1;
+    if (dst + 4 > outEnd)
+        method = LZG_METHOD_COPY;
+    else
+        for (j = 0; j < 4; ++j)
+            *dst++ = markers[j];
+
+    for (pos = 0; pos < insize && method == LZG_METHOD_LZG1;)
+    {
+        /* Longest match at the last position with the same prefix */
+        length = 0;
+        offset = 0;
+        if (pos + 3 <= insize)
+        {
+            h = ((in[pos] << 16 | in[pos+1] << 8 | in[pos+2]) * 2654435761u) >> (32 - hashBits);
+            cand = head[h];
+            head[h] = pos + 1;
+            if (cand && pos + 1 - cand <= _LZG_MAX_OFFSET)
+            {
+                offset = pos + 1 - cand;
+                for (; length < _LZG_MAX_LENGTH && pos + length < insize &&
+                       in[pos + length] == in[pos + length - offset]; ++length);
+            }
+        }
+
+        /* Only take copies that are shorter than the literals */
+        if (length >= 3 && (offset <= 8 || (offset <= 71 && length <= 6) ||
+                            (offset <= 2055 && length >= 4) || length >= 5))
+        {
+            if (dst + 4 > outEnd)
+            {
+                method = LZG_METHOD_COPY;
+                break;
+            }
+            if (offset <= 8)
+            {
+                /* Near copy */
+                b = _LZG_LengthCode(&length);
+                *dst++ = markers[3];
+                *dst++ = (unsigned char)(((offset - 1) << 5) | b);
+            }
+            else if (offset <= 71 && length <= 6)
+            {
+                /* Short copy */
+                *dst++ = markers[2];
+                *dst++ = (unsigned char)(((length - 3) << 6) | (offset - 8));
+            }
+            else if (offset <= 2055)
+            {
+                /* Medium copy */
+                b = _LZG_LengthCode(&length);
+                *dst++ = markers[1];
+                *dst++ = (unsigned char)((((offset - 8) >> 3) & 0xe0) | b);
+                *dst++ = (unsigned char)(offset - 8);
+            }
+            else
+            {
+                /* Distant copy */
+                b = _LZG_LengthCode(&length);
+                *dst++ = markers[0];
+                *dst++ = (unsigned char)((((offset - 2056) >> 11) & 0xe0) | b);
+                *dst++ = (unsigned char)((offset - 2056) >> 8);
+                *dst++ = (unsigned char)(offset - 2056);
+            }
+
+            /* Remember the prefixes skipped over */
+            for (i = pos + 1; i < pos + length && i + 3 <= insize; ++i)
+                head[((in[i] << 16 | in[i+1] << 8 | in[i+2]) * 2654435761u) >> (32 - hashBits)] = i + 1;
+            pos += length;
+        }
+        else
+        {
+            /* Literal, a marker symbol is followed by a zero */
+            if (dst + 1 + isMarker[in[pos]] > outEnd)
+            {
+                method = LZG_METHOD_COPY;
+                break;
+            }
+            *dst++ = in[pos];
+            if (isMarker[in[pos]])
+                *dst++ = 0;
+            ++pos;
+        }
+    }
+
+    if (method == LZG_METHOD_LZG1)
+        encodedSize = (lzg_uint32_t)(dst - out) - LZG_HEADER_SIZE;
+    else if (!(encodedSize = _LZG_EncodeCopy(in, insize, out, outsize)) && insize)
+        return 0;
+
+    out[0] = 'L';
+    out[1] = 'Z';
+    out[2] = 'G';
+    _LZG_SetUINT32(out, 3, insize);
+    _LZG_SetUINT32(out, 7, encodedSize);
+    _LZG_SetUINT32(out, 11, _LZG_CalcChecksum(&out[LZG_HEADER_SIZE], encodedSize));
+    out[15] = method;
+
+    return encodedSize + LZG_HEADER_SIZE;
+}
+
+lzg_uint32_t LZG_Encode(const unsigned char *in, lzg_uint32_t insize,
+    unsigned char *out, lzg_uint32_t outsize, lzg_encoder_config_t *config)
+{
+    /* Work memory from the stack, there is no heap */
+    lzg_uint32_t workmem[LZG_WorkMemSize(config) / sizeof(lzg_uint32_t)];
+    return LZG_EncodeFull(in, insize, out, outsize, config, workmem);
+}